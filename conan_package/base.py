@@ -10,7 +10,7 @@ class ProtocolSessionBase(ConanFile):
     repo_https_url = "https://github.com/JoyStream/protocol_session-cpp.git"
     settings = "os", "compiler", "build_type", "arch"
     generators = "cmake"
-    requires = "ProtocolStateMachine/0.3.1@joystream/stable"
+    requires = "ProtocolStateMachine/0.3.1@joystream/stable", "OpenSSL/1.0.2n@conan/stable"
     build_policy = "missing"
 
     def source(self):
@@ -28,4 +28,8 @@ class ProtocolSessionBase(ConanFile):
         self.copy("*.lib", dst="lib", keep_path=False)
 
     def package_info(self):
-        self.cpp_info.libs = ["protocol_session"]
+        # PieceVerifier hashes with OpenSSL on worker threads
+        self.cpp_info.libs = ["protocol_session", "crypto"]
+
+        if self.settings.os != "Windows":
+            self.cpp_info.libs.append("pthread")
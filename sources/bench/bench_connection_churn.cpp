@@ -0,0 +1,198 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#include <protocol_session/protocol_session.hpp>
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#if __GLIBC_PREREQ(2, 33)
+#define HAVE_MALLINFO2
+#endif
+#endif
+
+using namespace joystream;
+using namespace joystream::protocol_session;
+
+// Id type used to identify connections
+typedef uint ID;
+
+namespace joystream {
+namespace protocol_session {
+    template<>
+    std::string IdToString<ID>(const ID & s) {
+        return std::to_string(s);
+    }
+}}
+
+// Resident set size of this process in bytes, read from /proc/self/statm
+static long residentBytes() {
+
+    std::ifstream statm("/proc/self/statm");
+
+    long totalPages = 0, residentPages = 0;
+    statm >> totalPages >> residentPages;
+
+    return residentPages * sysconf(_SC_PAGESIZE);
+}
+
+// Bytes currently allocated on the heap, which unlike the resident set size
+// is not distorted by memory the allocator retains from earlier runs
+static long heapBytesInUse() {
+#if defined(HAVE_MALLINFO2)
+    return (long)mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+    // Older glibc only has the int sized counters, which wrap past 2GB
+    return (long)(unsigned int)mallinfo().uordblks;
+#else
+    return 0;
+#endif
+}
+
+static const char * modeToString(SessionMode mode) {
+    switch(mode) {
+        case SessionMode::observing: return "observing";
+        case SessionMode::buying: return "buying";
+        case SessionMode::selling: return "selling";
+        default: return "not_set";
+    }
+}
+
+// Callbacks which drop all messages sent to peers
+static SendMessageOnConnectionCallbacks nullSendCallbacks() {
+
+    SendMessageOnConnectionCallbacks callbacks;
+
+    callbacks.observe = [](const protocol_wire::Observe &) {};
+    callbacks.buy = [](const protocol_wire::Buy &) {};
+    callbacks.sell = [](const protocol_wire::Sell &) {};
+    callbacks.join_contract = [](const protocol_wire::JoinContract &) {};
+    callbacks.joining_contract = [](const protocol_wire::JoiningContract &) {};
+    callbacks.ready = [](const protocol_wire::Ready &) {};
+    callbacks.request_full_piece = [](const protocol_wire::RequestFullPiece &) {};
+    callbacks.full_piece = [](const protocol_wire::FullPiece &) {};
+    callbacks.payment = [](const protocol_wire::Payment &) {};
+    callbacks.speedTestRequest = [](const protocol_wire::SpeedTestRequest &) {};
+    callbacks.speedTestPayload = [](const protocol_wire::SpeedTestPayload &) {};
+
+    return callbacks;
+}
+
+static void toMode(Session<ID> & session, SessionMode mode) {
+
+    RemovedConnectionCallbackHandler<ID> removedConnection = [](const ID &, DisconnectCause) {};
+
+    switch(mode) {
+
+        case SessionMode::observing:
+
+            session.toObserveMode(removedConnection);
+            break;
+
+        case SessionMode::buying: {
+
+            TorrentPieceInformation information;
+            for(uint i = 0;i < 1000;i++)
+                information.push_back(PieceInformation(16384, false));
+
+            session.toBuyMode(removedConnection,
+                              [](const ID &, const protocol_wire::PieceData &, int) -> bool { return true; },
+                              [](const ID &, uint64_t, uint64_t, uint64_t, int) -> void {},
+                              protocol_wire::BuyerTerms(),
+                              information,
+                              []() -> void {});
+            break;
+        }
+
+        case SessionMode::selling:
+
+            session.toSellMode(removedConnection,
+                               [](const ID &, int) -> void {},
+                               [](const ID &, const paymentchannel::Payee &) -> void {},
+                               [](const ID &, uint64_t, const Coin::typesafeOutPoint &, const Coin::PublicKey &, const Coin::PubKeyHash &) -> void {},
+                               [](const ID &, uint64_t, uint64_t, uint64_t) -> void {},
+                               protocol_wire::SellerTerms(),
+                               1000);
+            break;
+
+        default:
+            assert(false);
+    }
+}
+
+// Adds and then removes given number of idle connections on a started session in given mode,
+// and reports throughput of both operations and memory held per idle connection
+static void churn(SessionMode mode, uint numberOfConnections) {
+
+    Session<ID> session(Coin::Network::testnet3);
+
+    toMode(session, mode);
+
+    session.start();
+
+    SendMessageOnConnectionCallbacks callbacks = nullSendCallbacks();
+
+    long residentBefore = residentBytes();
+    long heapBefore = heapBytesInUse();
+
+    auto addStart = std::chrono::high_resolution_clock::now();
+
+    for(uint i = 0;i < numberOfConnections;i++)
+        session.addConnection(i, callbacks);
+
+    auto addEnd = std::chrono::high_resolution_clock::now();
+
+    long residentAfter = residentBytes();
+    long heapAfter = heapBytesInUse();
+
+    auto removeStart = std::chrono::high_resolution_clock::now();
+
+    for(uint i = 0;i < numberOfConnections;i++)
+        session.removeConnection(i);
+
+    auto removeEnd = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double> addTime = addEnd - addStart;
+    std::chrono::duration<double> removeTime = removeEnd - removeStart;
+
+    std::printf("%-10s %8u %14.0f %14.0f %16.1f %16.1f\n",
+                modeToString(mode),
+                numberOfConnections,
+                numberOfConnections / addTime.count(),
+                numberOfConnections / removeTime.count(),
+                (double)(residentAfter - residentBefore) / numberOfConnections,
+                (double)(heapAfter - heapBefore) / numberOfConnections);
+
+    session.stop();
+}
+
+int main(int argc, char *argv[]) {
+
+    std::vector<uint> sizes = {1000, 10000, 100000};
+
+    // Optionally restrict run to a single size given as first argument
+    if(argc > 1)
+        sizes = {(uint)std::stoul(argv[1])};
+
+    // Silence logging from the session
+    std::clog.rdbuf(nullptr);
+    std::cout.rdbuf(nullptr);
+
+    std::printf("%-10s %8s %14s %14s %16s %16s\n", "mode", "conns", "adds/s", "removes/s", "rss B/conn", "heap B/conn");
+
+    for(SessionMode mode : {SessionMode::observing, SessionMode::buying, SessionMode::selling})
+        for(uint n : sizes)
+            churn(mode, n);
+
+    return 0;
+}
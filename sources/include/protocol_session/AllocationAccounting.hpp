@@ -0,0 +1,128 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_ALLOCATIONACCOUNTING_HPP
+#define JOYSTREAM_PROTOCOLSESSION_ALLOCATIONACCOUNTING_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+namespace joystream {
+namespace protocol_session {
+
+  // Heap activity observed on the calling thread
+  struct AllocationStatistics {
+
+    AllocationStatistics();
+
+    AllocationStatistics operator-(const AllocationStatistics &) const;
+
+    uint64_t allocations;
+    uint64_t deallocations;
+    uint64_t bytesAllocated;
+  };
+
+  // Per thread counters of heap activity. Counters are only fed when the application
+  // has installed the counting allocation functions, by including
+  // <protocol_session/AllocationHooks.hpp> in exactly one of its translation units.
+  class AllocationAccounting {
+    public:
+
+      // Whether the counting allocation functions are installed
+      static bool hooksInstalled();
+
+      // Totals for the calling thread since it started
+      static AllocationStatistics current();
+
+      // Whether allocations on the calling thread are presently counted, see AllocationCounting
+      static bool isCounting();
+
+      // Called by the allocation functions, must not allocate
+      static void recordAllocation(std::size_t);
+      static void recordDeallocation();
+      static void markHooksInstalled();
+  };
+
+  // Counts heap activity on the calling thread from construction, e.g. around a single
+  // session operation such as processing a message or a tick.
+  class AllocationScope {
+    public:
+
+      AllocationScope();
+
+      // Activity since construction
+      AllocationStatistics statistics() const;
+
+    private:
+
+      AllocationStatistics _start;
+  };
+
+  // Turns counting on the calling thread on or off while in scope. When built with
+  // JOYSTREAM_PROTOCOLSESSION_COUNT_ALLOCATIONS, e.g. in tests, the session turns it off while the
+  // protocol state machine processes an event, and back on when the state machine calls back into the session.
+  // Counts then exclude the state machine, e.g. its state transitions and signing payments, which are
+  // outside this library. Otherwise the session does not touch counting, and counts include the state machine.
+  class AllocationCounting {
+    public:
+
+      explicit AllocationCounting(bool);
+
+      ~AllocationCounting();
+
+    private:
+
+      bool _previous;
+  };
+
+namespace detail {
+
+#ifdef JOYSTREAM_PROTOCOLSESSION_COUNT_ALLOCATIONS
+
+  // Wraps a callback into the session, so allocations it makes are counted
+  template <class F>
+  class CountingAllocations {
+    public:
+
+      CountingAllocations(const F & f) : _f(f) {}
+
+      template <class... Args>
+      void operator()(Args &&... args) const {
+        AllocationCounting counting(true);
+        _f(std::forward<Args>(args)...);
+      }
+
+    private:
+
+      F _f;
+  };
+
+  template <class F>
+  CountingAllocations<F> countingAllocations(const F & f) {
+    return CountingAllocations<F>(f);
+  }
+
+  // Counting is off while state machine processes an event
+  typedef AllocationCounting StateMachineAllocations;
+
+#else
+
+  // Without the flag callbacks are not wrapped, so there is no cost on every event
+  template <class F>
+  F countingAllocations(const F & f) {
+    return f;
+  }
+
+  struct StateMachineAllocations {
+    explicit StateMachineAllocations(bool) {}
+  };
+
+#endif
+}
+
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_ALLOCATIONACCOUNTING_HPP
@@ -0,0 +1,72 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_ALLOCATIONHOOKS_HPP
+#define JOYSTREAM_PROTOCOLSESSION_ALLOCATIONHOOKS_HPP
+
+// Replaces the global allocation functions with versions which feed AllocationAccounting.
+// Defines non-inline functions: include in exactly one translation unit of a binary,
+// typically only in test and benchmark builds.
+
+#include <protocol_session/AllocationAccounting.hpp>
+
+#include <cstdlib>
+#include <new>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+  static const bool allocationHooksInstalled = (AllocationAccounting::markHooksInstalled(), true);
+}
+}
+}
+
+void * operator new(std::size_t size) {
+
+  joystream::protocol_session::AllocationAccounting::recordAllocation(size);
+
+  if(void * p = std::malloc(size == 0 ? 1 : size))
+    return p;
+
+  throw std::bad_alloc();
+}
+
+void * operator new[](std::size_t size) {
+  return ::operator new(size);
+}
+
+void * operator new(std::size_t size, const std::nothrow_t &) noexcept {
+
+  joystream::protocol_session::AllocationAccounting::recordAllocation(size);
+
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+void * operator new[](std::size_t size, const std::nothrow_t & tag) noexcept {
+  return ::operator new(size, tag);
+}
+
+void operator delete(void * p) noexcept {
+
+  if(p == nullptr)
+    return;
+
+  joystream::protocol_session::AllocationAccounting::recordDeallocation();
+
+  std::free(p);
+}
+
+void operator delete[](void * p) noexcept {
+  ::operator delete(p);
+}
+
+void operator delete(void * p, const std::nothrow_t &) noexcept {
+  ::operator delete(p);
+}
+
+void operator delete[](void * p, const std::nothrow_t &) noexcept {
+  ::operator delete(p);
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_ALLOCATIONHOOKS_HPP
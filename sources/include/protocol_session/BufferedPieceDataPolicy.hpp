@@ -0,0 +1,42 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_BUFFEREDPIECEDATAPOLICY_HPP
+#define JOYSTREAM_PROTOCOLSESSION_BUFFEREDPIECEDATAPOLICY_HPP
+
+#include <chrono>
+#include <cstdint>
+
+namespace joystream {
+namespace protocol_session {
+
+  // When selling, caps the bytes of piece data loaded for buyers but not yet sent, summed over all buyers.
+  // Once the budget is used up, pieces are not loaded until data is sent, and data held for buyers which
+  // have not paid for longer than the stall timeout is dropped, to be loaded again when they pay.
+  // A budget of 0 means no limit.
+  class BufferedPieceDataPolicy {
+    public:
+      BufferedPieceDataPolicy();
+
+      bool isEnabled() const;
+
+      uint64_t maxBytes() const;
+
+      std::chrono::seconds stallTimeout() const;
+
+      void setMaxBytes(uint64_t);
+
+      void setStallTimeout(std::chrono::seconds);
+
+    private:
+
+      uint64_t _maxBytes;
+
+      std::chrono::seconds _stallTimeout;
+  };
+
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_BUFFEREDPIECEDATAPOLICY_HPP
@@ -0,0 +1,61 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_BUYINGCHECKPOINT_HPP
+#define JOYSTREAM_PROTOCOLSESSION_BUYINGCHECKPOINT_HPP
+
+#include <protocol_session/PieceAvailability.hpp>
+#include <protocol_session/PiecePriority.hpp>
+#include <protocol_wire/protocol_wire.hpp>
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace joystream {
+namespace protocol_session {
+
+  // Progress of a buying session which outlives a restart, see Session::checkpoint and Session::restore.
+  // Pieces being downloaded are not included, as they have to be requested again anyway.
+  struct BuyingCheckpoint {
+
+    // Pieces in range [begin, end) with a non default priority
+    struct PriorityRange {
+
+      PriorityRange() : begin(0), end(0), priority(DefaultPiecePriority) {}
+      PriorityRange(uint32_t begin, uint32_t end, PiecePriority priority) : begin(begin), end(end), priority(priority) {}
+
+      uint32_t begin;
+      uint32_t end;
+      PiecePriority priority;
+    };
+
+    BuyingCheckpoint();
+
+    // Writes checkpoint to given file, in host byte order
+    void save(const std::string &) const;
+
+    // Reads checkpoint from file written by save, by mapping it into memory
+    static BuyingCheckpoint load(const std::string &);
+
+    // Number of pieces in torrent
+    uint32_t numberOfPieces;
+
+    // Pieces downloaded
+    PieceAvailability downloaded;
+
+    std::vector<PriorityRange> priorities;
+
+    protocol_wire::BuyerTerms terms;
+
+    // Time known peers took to deliver speed test payload, by IdToString of connection id,
+    // so they can be invited without being tested again
+    std::map<std::string, std::chrono::milliseconds> speedTests;
+  };
+
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_BUYINGCHECKPOINT_HPP
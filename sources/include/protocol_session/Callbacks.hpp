@@ -68,7 +68,11 @@ enum class DisconnectCause {
 
     buyer_requested_too_many_speed_tests,
 
-    buyer_speed_test_payload_requested_too_large
+    buyer_speed_test_payload_requested_too_large,
+
+    //// buying, appended so values of earlier causes are unchanged
+
+    seller_is_too_slow
 };
 
 // Removal of a connection from the session: c++11 alias declaration
@@ -92,6 +96,11 @@ typedef std::function<std::vector<Coin::P2PKHAddress>(int)> GenerateChangeAddres
 // Send message callbacks
 typedef protocol_statemachine::Send SendMessageOnConnectionCallbacks;
 
+// Send message callbacks for peer connection with given id, shared by all peers so that
+// a peer does not have to hold its own callbacks until it needs a full connection
+template <class ConnectionIdType>
+using MakeSendMessageOnConnectionCallbacks = std::function<SendMessageOnConnectionCallbacks(const ConnectionIdType &)>;
+
 //// Buying
 
 // Process arrival of a full piece, with given index over peer connection with given id
@@ -99,6 +108,11 @@ typedef protocol_statemachine::Send SendMessageOnConnectionCallbacks;
 template <class ConnectionIdType>
 using FullPieceArrived = std::function<bool(const ConnectionIdType &, const protocol_wire::PieceData &, int)>;
 
+// Full piece with given index arrived over peer connection with given id, and is to be validated.
+// Client returns immediately, and later reports the result through Session::pieceValidated
+template <class ConnectionIdType>
+using ValidatePiece = std::function<void(const ConnectionIdType &, const protocol_wire::PieceData &, int)>;
+
 // Buyer with givne connection id send a valid payment
 template <class ConnectionIdType>
 using SentPayment = std::function<void(const ConnectionIdType &,
@@ -0,0 +1,48 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_ENDGAMEPOLICY_HPP
+#define JOYSTREAM_PROTOCOLSESSION_ENDGAMEPOLICY_HPP
+
+#include <cstdint>
+
+namespace joystream {
+namespace protocol_session {
+
+  // When buying, endgame starts once a seller has no unassigned piece left to request and only a few are
+  // still being downloaded. Idle sellers are then also asked for those pieces, and whichever copy
+  // arrives first is used. Later copies are paid for without notifying the client.
+  class EndgamePolicy {
+    public:
+      EndgamePolicy();
+
+      bool isEnabled() const;
+
+      // Endgame starts when at most this many pieces are being downloaded
+      uint32_t maxPiecesRemaining() const;
+
+      // Maximum number of sellers asked for the same piece, including the one it was assigned to
+      uint32_t maxRequestsPerPiece() const;
+
+      // Maximum number of duplicate requests during a download, each may cost one extra payment
+      uint32_t maxDuplicatePayments() const;
+
+      void enable();
+      void disable();
+      void setMaxPiecesRemaining(uint32_t);
+      void setMaxRequestsPerPiece(uint32_t);
+      void setMaxDuplicatePayments(uint32_t);
+
+    private:
+
+      bool _enabled;
+      uint32_t _maxPiecesRemaining;
+      uint32_t _maxRequestsPerPiece;
+      uint32_t _maxDuplicatePayments;
+  };
+
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_ENDGAMEPOLICY_HPP
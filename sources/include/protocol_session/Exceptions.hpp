@@ -9,6 +9,7 @@
 #define JOYSTREAM_PROTOCOLSESSION_EXCEPTIONS_HPP
 
 #include <protocol_session/common.hpp>
+#include <protocol_session/PiecePriority.hpp>
 
 #include <stdexcept>
 #include <string>
@@ -177,6 +178,58 @@ public:
     PeerNotReadyToStartUploadingCause peerNotReadyToStartUploadingCause;
 };
 
+class InvalidPieceAvailability : public std::runtime_error {
+
+public:
+
+    InvalidPieceAvailability(const std::string & reason)
+        : std::runtime_error(std::string("Invalid piece availability: ") + reason) {
+    }
+};
+
+class InvalidPieceRange : public std::runtime_error {
+
+public:
+
+    InvalidPieceRange(int begin, int end)
+        : std::runtime_error(std::string("Invalid piece range [") +
+                             std::to_string(begin) +
+                             std::string(", ") +
+                             std::to_string(end) +
+                             std::string(")")) {
+    }
+};
+
+class InvalidPiecePriority : public std::runtime_error {
+
+public:
+
+    InvalidPiecePriority(PiecePriority priority)
+        : std::runtime_error(std::string("Invalid piece priority ") +
+                             std::to_string(priority) +
+                             std::string(", maximum is ") +
+                             std::to_string(MaxPiecePriority)) {
+    }
+};
+
+class InvalidStreamingParameters : public std::runtime_error {
+
+public:
+
+    InvalidStreamingParameters(const std::string & reason)
+        : std::runtime_error(std::string("Invalid streaming parameters: ") + reason) {
+    }
+};
+
+class InvalidCheckpoint : public std::runtime_error {
+
+public:
+
+    InvalidCheckpoint(const std::string & reason)
+        : std::runtime_error(std::string("Invalid checkpoint: ") + reason) {
+    }
+};
+
 class NoPieceAvailableException : public std::runtime_error {
 
 public:
@@ -0,0 +1,23 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_PIECEAVAILABILITY_HPP
+#define JOYSTREAM_PROTOCOLSESSION_PIECEAVAILABILITY_HPP
+
+#include <boost/dynamic_bitset.hpp>
+
+#include <cstdint>
+
+namespace joystream {
+namespace protocol_session {
+
+    // Pieces a peer has, one bit per piece in the torrent, e.g. as advertised
+    // through bitfield and have messages. Stored in 64 bit blocks, so that
+    // intersections and counts run a word at a time.
+    typedef boost::dynamic_bitset<uint64_t> PieceAvailability;
+
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_PIECEAVAILABILITY_HPP
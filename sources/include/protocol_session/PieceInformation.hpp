@@ -8,6 +8,8 @@
 #ifndef JOYSTREAM_PROTOCOLSESSION_PIECEINFORMATION_HPP
 #define JOYSTREAM_PROTOCOLSESSION_PIECEINFORMATION_HPP
 
+#include <protocol_session/PiecePriority.hpp>
+
 namespace joystream {
 namespace protocol_session {
 
@@ -15,7 +17,7 @@ class PieceInformation {
 
 public:
 
-    PieceInformation(unsigned int size, bool downloaded);
+    PieceInformation(unsigned int size, bool downloaded, PiecePriority priority = DefaultPiecePriority);
 
     // Getter & setters
     unsigned int size() const;
@@ -24,6 +26,9 @@ public:
     bool downloaded() const;
     void setDownloaded(bool downloaded);
 
+    PiecePriority priority() const;
+    void setPriority(PiecePriority priority);
+
 private:
 
     // Byte length of given piece
@@ -31,6 +36,9 @@ private:
 
     // Download status
     bool _downloaded;
+
+    // Initial priority when buying
+    PiecePriority _priority;
 };
 
 }
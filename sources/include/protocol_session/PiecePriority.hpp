@@ -0,0 +1,22 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_PIECEPRIORITY_HPP
+#define JOYSTREAM_PROTOCOLSESSION_PIECEPRIORITY_HPP
+
+#include <cstdint>
+
+namespace joystream {
+namespace protocol_session {
+
+    // Importance of a piece when buying, pieces with higher priority are requested first
+    typedef uint8_t PiecePriority;
+
+    const PiecePriority DefaultPiecePriority = 4;
+    const PiecePriority MaxPiecePriority = 7;
+
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_PIECEPRIORITY_HPP
@@ -0,0 +1,127 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_PIECEVERIFIER_HPP
+#define JOYSTREAM_PROTOCOLSESSION_PIECEVERIFIER_HPP
+
+#include <protocol_wire/PieceData.hpp>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace joystream {
+namespace protocol_session {
+
+  // Hashes pieces on a pool of worker threads, and compares them with expected digests.
+  // Digests are computed by OpenSSL, which picks SHA extensions or SIMD code for the running CPU.
+  // Results are collected by the session thread with takeResults, see Session::setPieceVerifier.
+  class PieceVerifier {
+
+    public:
+
+      enum class Algorithm {
+        sha1,
+        sha256
+      };
+
+      struct Result {
+
+        Result() : index(-1), valid(false), connection(0), generation(0) {}
+        Result(int index, bool valid, uint32_t connection, uint32_t generation, const protocol_wire::PieceData & data)
+          : index(index), valid(valid), connection(connection), generation(generation), data(data) {}
+
+        int index;
+        bool valid;
+
+        // As given to submit, so result can be matched with connection piece came from,
+        // and told apart from results for an earlier connection which had the same handle
+        uint32_t connection;
+        uint32_t generation;
+
+        // Piece which was verified, so a valid one can be stored without keeping a copy elsewhere
+        protocol_wire::PieceData data;
+      };
+
+      // Expected digests of all pieces concatenated in piece order, as in the pieces field of a
+      // torrent info dictionary. Zero threads means one per core. Given callback, if any, is called
+      // on a worker thread whenever a result is ready, e.g. to schedule a call to
+      // Session::processVerifiedPieces on the session thread.
+      PieceVerifier(Algorithm,
+                    const std::string & digests,
+                    unsigned int numberOfThreads = 0,
+                    const std::function<void()> & resultsReady = std::function<void()>());
+
+      // Finishes pieces being hashed, drops queued ones, and stops workers
+      ~PieceVerifier();
+
+      PieceVerifier(const PieceVerifier &) = delete;
+      void operator=(const PieceVerifier &) = delete;
+
+      static unsigned int digestLength(Algorithm);
+
+      unsigned int numberOfPieces() const;
+
+      unsigned int numberOfThreads() const;
+
+      // Queue given piece for hashing, data is shared rather than copied. Given connection,
+      // e.g. a handle, and generation are opaque to verifier and handed back in result.
+      void submit(int, const protocol_wire::PieceData &, uint32_t connection = 0, uint32_t generation = 0);
+
+      // Moves results completed so far into given vector, which is cleared first
+      void takeResults(std::vector<Result> &);
+
+      // Number of pieces submitted whose results have not been taken
+      unsigned int numberOfPendingPieces() const;
+
+      // Whether given data matches expected digest of given piece, computed on calling thread,
+      // throws if there is no such piece
+      bool verify(int, const char *, unsigned int) const;
+
+    private:
+
+      struct Job {
+
+        Job() : index(-1), connection(0), generation(0) {}
+        Job(int index, const protocol_wire::PieceData & data, uint32_t connection, uint32_t generation)
+          : index(index), connection(connection), generation(generation), data(data) {}
+
+        int index;
+        uint32_t connection;
+        uint32_t generation;
+        protocol_wire::PieceData data;
+      };
+
+      void work();
+
+      Algorithm _algorithm;
+
+      std::string _digests;
+
+      std::function<void()> _resultsReady;
+
+      mutable std::mutex _mutex;
+
+      std::condition_variable _jobAvailable;
+
+      std::deque<Job> _jobs;
+
+      std::vector<Result> _results;
+
+      unsigned int _numberOfPendingPieces;
+
+      bool _stopping;
+
+      std::vector<std::thread> _workers;
+  };
+
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_PIECEVERIFIER_HPP
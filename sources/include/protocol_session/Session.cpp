@@ -8,6 +8,7 @@
 
 #include <protocol_session/Session.hpp>
 #include <protocol_session/Exceptions.hpp>
+#include <protocol_session/AllocationAccounting.hpp>
 #include <protocol_session/detail/Buying.hpp>
 #include <protocol_session/detail/Selling.hpp>
 #include <protocol_session/detail/Observing.hpp>
@@ -48,7 +49,8 @@ namespace protocol_session {
         , _selling(nullptr)
         , _buying(nullptr)
         , _network(network)
-        , _getTime(std::chrono::high_resolution_clock::now) {
+        , _getTime(std::chrono::high_resolution_clock::now)
+        , _speedTestPayloadPool(std::make_shared<SpeedTestPayloadPool>()) {
 
         time(&_started);
     }
@@ -127,6 +129,7 @@ namespace protocol_session {
             case SessionMode::observing:
 
                 assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                _observing->leavingState();
                 delete _observing;
                 _observing = nullptr;
                 break;
@@ -171,6 +174,11 @@ namespace protocol_session {
                                               const AllSellersGone & allSellersGone,
                                               std::chrono::duration<double> maxTimeToServicePiece) {
 
+        // Reject bad priorities before leaving current mode
+        for(const PieceInformation & p : information)
+            if(p.priority() > MaxPiecePriority)
+                throw exception::InvalidPiecePriority(p.priority());
+
         // Prepare for exiting current state
         switch(_mode) {
 
@@ -182,6 +190,7 @@ namespace protocol_session {
             case SessionMode::observing:
 
                 assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                _observing->leavingState();
                 delete _observing;
                 _observing = nullptr;
                 break;
@@ -329,6 +338,9 @@ namespace protocol_session {
     template <class ConnectionIdType>
     void Session<ConnectionIdType>::tick() {
 
+        // No ids of removed connections are referred to at this point
+        _handles.reuseReleased();
+
         switch(_mode) {
 
             case SessionMode::not_set:
@@ -391,6 +403,45 @@ namespace protocol_session {
         }
     }
 
+    template<class ConnectionIdType>
+    uint Session<ConnectionIdType>::addConnection(const ConnectionIdType & id) {
+
+        if(!_makeSendMessageOnConnectionCallbacks)
+            throw exception::StateIncompatibleOperation("cannot add connection without callbacks, none can be made.");
+
+        switch(_mode) {
+
+            case SessionMode::not_set:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::SessionModeNotSetException();
+
+            case SessionMode::observing:
+
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                return _observing->addPassivePeer(id);
+
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                return _buying->addConnection(id, _makeSendMessageOnConnectionCallbacks(id));
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                return _selling->addConnection(id, _makeSendMessageOnConnectionCallbacks(id));
+
+            default:
+
+                assert(false);
+        }
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::setMakeSendMessageOnConnectionCallbacks(const MakeSendMessageOnConnectionCallbacks<ConnectionIdType> & makeCallbacks) {
+        _makeSendMessageOnConnectionCallbacks = makeCallbacks;
+    }
+
     template<class ConnectionIdType>
     bool Session<ConnectionIdType>::hasConnection(const ConnectionIdType & id) const {
 
@@ -398,7 +449,10 @@ namespace protocol_session {
         //if(_mode == SessionMode::not_set)
         //    throw exception::SessionModeNotSetException();
 
-        return _connections.find(id) != _connections.cend();
+        if(find(id) != _connections.cend())
+            return true;
+
+        return _mode == SessionMode::observing && _observing->isPassivePeer(id);
     }
 
     template<class ConnectionIdType>
@@ -475,9 +529,11 @@ namespace protocol_session {
             throw exception::SessionModeNotSetException();
 
         // Try to recover conneciton based on id
-        auto it = _connections.find(id);
+        auto it = find(id);
 
-        if(it == _connections.cend())
+        if(it == _connections.cend() && _mode == SessionMode::observing)
+            return _observing->passivePeerStatus(id);
+        else if(it == _connections.cend())
             throw exception::ConnectionDoesNotExist<ConnectionIdType>(id);
 
         // Generate status for connection
@@ -491,7 +547,10 @@ namespace protocol_session {
 
         // Add ids of all connections
         for(auto mapping: _connections)
-            ids.insert(mapping.first);
+            ids.insert(mapping.second->connectionId());
+
+        if(_mode == SessionMode::observing)
+            _observing->passivePeerIds(ids);
 
         return ids;
     }
@@ -503,6 +562,12 @@ namespace protocol_session {
         if(_mode == SessionMode::not_set)
             throw exception::SessionModeNotSetException();
 
+        // Peers which have only announced a mode in observe mode have no connection yet
+        if(_mode == SessionMode::observing && _observing->isPassivePeer(id)) {
+            _observing->processMessageOnPassivePeer(id, m);
+            return;
+        }
+
         // Get connection
         detail::Connection<ConnectionIdType> * c = get(id);
 
@@ -588,7 +653,7 @@ namespace protocol_session {
     }
 
     template<class ConnectionIdType>
-    void Session<ConnectionIdType>::updateTerms(const protocol_wire::BuyerTerms & terms) {
+    void Session<ConnectionIdType>::setPieceAvailability(const ConnectionIdType & id, const PieceAvailability & availability) {
 
         switch(_mode) {
 
@@ -605,7 +670,7 @@ namespace protocol_session {
             case SessionMode::buying:
 
                 assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
-                _buying->updateTerms(terms);
+                _buying->setPieceAvailability(id, availability);
                 break;
 
             case SessionMode::selling:
@@ -617,14 +682,10 @@ namespace protocol_session {
             default:
                 assert(false);
         }
-
     }
 
     template<class ConnectionIdType>
-    void Session<ConnectionIdType>::startUploading(const ConnectionIdType & id,
-                                                   const protocol_wire::BuyerTerms & terms,
-                                                   const Coin::KeyPair & contractKeyPair,
-                                                   const Coin::PubKeyHash & finalPkHash) {
+    void Session<ConnectionIdType>::peerHasPiece(const ConnectionIdType & id, int index) {
 
         switch(_mode) {
 
@@ -641,16 +702,13 @@ namespace protocol_session {
             case SessionMode::buying:
 
                 assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
-                throw exception::ModeIncompatibleOperation();
+                _buying->peerHasPiece(id, index);
                 break;
 
             case SessionMode::selling:
 
                 assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
-                _selling->startUploading(id,
-                                         terms,
-                                         contractKeyPair,
-                                         finalPkHash);
+                throw exception::ModeIncompatibleOperation();
                 break;
 
             default:
@@ -658,8 +716,8 @@ namespace protocol_session {
         }
     }
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::pieceLoaded(const protocol_wire::PieceData & data, int index) {
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::setPieceValidator(const ValidatePiece<ConnectionIdType> & validatePiece) {
 
         switch(_mode) {
 
@@ -676,13 +734,13 @@ namespace protocol_session {
             case SessionMode::buying:
 
                 assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
-                throw exception::ModeIncompatibleOperation();
+                _buying->setPieceValidator(validatePiece);
                 break;
 
             case SessionMode::selling:
 
                 assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
-                _selling->pieceLoaded(data, index);
+                throw exception::ModeIncompatibleOperation();
                 break;
 
             default:
@@ -690,8 +748,8 @@ namespace protocol_session {
         }
     }
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::updateTerms(const protocol_wire::SellerTerms & terms) {
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::pieceValidated(const ConnectionIdType & id, int index, bool wasValid) {
 
         switch(_mode) {
 
@@ -708,13 +766,13 @@ namespace protocol_session {
             case SessionMode::buying:
 
                 assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
-                throw exception::ModeIncompatibleOperation();
+                _buying->pieceValidated(id, index, wasValid);
                 break;
 
             case SessionMode::selling:
 
                 assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
-                _selling->updateTerms(terms);
+                throw exception::ModeIncompatibleOperation();
                 break;
 
             default:
@@ -722,181 +780,701 @@ namespace protocol_session {
         }
     }
 
-    template<class ConnectionIdType>
-    SessionState Session<ConnectionIdType>::state() const {
-        return _state;
-    }
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::setPieceVerifier(const std::shared_ptr<PieceVerifier> & verifier) {
 
-    template<class ConnectionIdType>
-    SessionMode Session<ConnectionIdType>::mode() const {
-        return _mode;
-    }
+        switch(_mode) {
 
-    template<class ConnectionIdType>
-    typename status::Session<ConnectionIdType> Session<ConnectionIdType>::status() const noexcept {
+            case SessionMode::not_set:
 
-        return status::Session<ConnectionIdType>(_mode,
-                                                 _state,
-                                                 (_mode == SessionMode::selling ? _selling->status() : status::Selling()),
-                                                 (_mode == SessionMode::buying ? _buying->status() : status::Buying<ConnectionIdType>()));
-    }
+                throw exception::SessionModeNotSetException();
 
-    template<class ConnectionIdType>
-    Coin::Network Session<ConnectionIdType>::network() const {
-      return _network;
-    }
+            case SessionMode::observing:
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::peerAnnouncedModeAndTerms(const ConnectionIdType & id, const protocol_statemachine::AnnouncedModeAndTerms & a) {
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
 
-        assert(hasConnection(id));
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                _buying->setPieceVerifier(verifier);
+                break;
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            default:
+                assert(false);
+        }
+    }
+
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::processVerifiedPieces() {
 
         switch(_mode) {
 
             case SessionMode::not_set:
+
                 throw exception::SessionModeNotSetException();
 
             case SessionMode::observing:
 
                 assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
-                // Nothing to do
+                throw exception::ModeIncompatibleOperation();
                 break;
 
             case SessionMode::buying:
 
                 assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
-                _buying->peerAnnouncedModeAndTerms(id, a);
+                _buying->processVerifiedPieces();
                 break;
 
             case SessionMode::selling:
 
                 assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
-                _selling->peerAnnouncedModeAndTerms(id, a);
+                throw exception::ModeIncompatibleOperation();
                 break;
 
-        default:
-            assert(false);
+            default:
+                assert(false);
         }
-
     }
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::invitedToOutdatedContract(const ConnectionIdType & id) {
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::setPiecePriority(int begin, int end, PiecePriority priority) {
 
-        assert(hasConnection(id));
-        assert(_mode == SessionMode::selling);
-        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+        switch(_mode) {
 
-        _selling->invitedToOutdatedContract(id);
-    }
+            case SessionMode::not_set:
 
-    template <class ConnectionIdType>
-    void Session<ConnectionIdType>::invitedToJoinContract(const ConnectionIdType & id) {
+                throw exception::SessionModeNotSetException();
 
-        assert(hasConnection(id));
-        assert(_mode == SessionMode::selling);
-        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+            case SessionMode::observing:
 
-        _selling->invitedToJoinContract(id);
-    }
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
 
-    template <class ConnectionIdType>
-    void Session<ConnectionIdType>::contractPrepared(const ConnectionIdType & id, uint64_t value, const Coin::typesafeOutPoint & anchor, const Coin::PublicKey & payorContractPk, const Coin::PubKeyHash & payorFinalPkHash) {
+            case SessionMode::buying:
 
-        assert(hasConnection(id));
-        assert(_mode == SessionMode::selling);
-        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                _buying->setPiecePriority(begin, end, priority);
+                break;
 
-        _selling->contractPrepared(id, value, anchor, payorContractPk, payorFinalPkHash);
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            default:
+                assert(false);
+        }
     }
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::pieceRequested(const ConnectionIdType & id, int index) {
+    template <class ConnectionIdType>
+    PiecePriority Session<ConnectionIdType>::piecePriority(int index) const {
 
-        assert(hasConnection(id));
-        assert(_mode == SessionMode::selling);
-        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+        switch(_mode) {
 
-        _selling->pieceRequested(id, index);
-    }
+            case SessionMode::not_set:
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::invalidPieceRequested(const ConnectionIdType & id) {
+                throw exception::SessionModeNotSetException();
 
-        assert(hasConnection(id));
-        assert(_mode == SessionMode::selling);
-        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+            case SessionMode::observing:
 
-        _selling->invalidPieceRequested(id);
-    }
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::paymentInterrupted(const ConnectionIdType & id) {
+            case SessionMode::buying:
 
-        assert(hasConnection(id));
-        assert(_mode == SessionMode::selling);
-        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                return _buying->piecePriority(index);
 
-        _selling->paymentInterrupted(id);
-    }
+            case SessionMode::selling:
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::receivedValidPayment(const ConnectionIdType & id, const Coin::Signature & sig) {
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
 
-        assert(hasConnection(id));
-        assert(_mode == SessionMode::selling);
-        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+            default:
+                assert(false);
+        }
 
-        _selling->receivedValidPayment(id, sig);
+        return DefaultPiecePriority;
     }
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::receivedInvalidPayment(const ConnectionIdType & id, const Coin::Signature & sig) {
+    template <class ConnectionIdType>
+    BuyingCheckpoint Session<ConnectionIdType>::checkpoint() const {
 
-        assert(hasConnection(id));
-        assert(_mode == SessionMode::selling);
-        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+        switch(_mode) {
 
-        _selling->receivedInvalidPayment(id, sig);
-    }
+            case SessionMode::not_set:
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::sellerHasJoined(const ConnectionIdType & id) {
+                throw exception::SessionModeNotSetException();
 
-        assert(hasConnection(id));
-        assert(_mode == SessionMode::buying);
-        assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+            case SessionMode::observing:
 
-        _buying->sellerHasJoined(id);
-    }
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::sellerHasInterruptedContract(const ConnectionIdType & id) {
+            case SessionMode::buying:
 
-        assert(hasConnection(id));
-        assert(_mode == SessionMode::buying);
-        assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                return _buying->checkpoint();
 
-        _buying->sellerHasInterruptedContract(id);
-    }
+            case SessionMode::selling:
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::receivedFullPiece(const ConnectionIdType & id, const protocol_wire::PieceData & data) {
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
 
-        assert(hasConnection(id));
-        assert(_mode == SessionMode::buying);
-        assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+            default:
+                assert(false);
+        }
 
-        _buying->receivedFullPiece(id, data);
+        return BuyingCheckpoint();
     }
 
-    template<class ConnectionIdType>
-    void Session<ConnectionIdType>::remoteMessageOverflow(const ConnectionIdType & id) {
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::restore(const BuyingCheckpoint & checkpoint) {
 
-        assert(hasConnection(id));
+        switch(_mode) {
 
-        if (_buying != nullptr) {
-          _buying->remoteMessageOverflow(id);
+            case SessionMode::not_set:
+
+                throw exception::SessionModeNotSetException();
+
+            case SessionMode::observing:
+
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                _buying->restore(checkpoint);
+                break;
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            default:
+                assert(false);
+        }
+    }
+
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::startStreaming(int playhead, uint64_t bytesPerSecond, std::chrono::seconds criticalWindow, uint32_t maxRescuesPerWindow) {
+
+        switch(_mode) {
+
+            case SessionMode::not_set:
+
+                throw exception::SessionModeNotSetException();
+
+            case SessionMode::observing:
+
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                _buying->startStreaming(playhead, bytesPerSecond, criticalWindow, maxRescuesPerWindow);
+                break;
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            default:
+                assert(false);
+        }
+    }
+
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::updatePlayhead(int playhead) {
+
+        switch(_mode) {
+
+            case SessionMode::not_set:
+
+                throw exception::SessionModeNotSetException();
+
+            case SessionMode::observing:
+
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                _buying->updatePlayhead(playhead);
+                break;
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            default:
+                assert(false);
+        }
+    }
+
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::stopStreaming() {
+
+        switch(_mode) {
+
+            case SessionMode::not_set:
+
+                throw exception::SessionModeNotSetException();
+
+            case SessionMode::observing:
+
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                _buying->stopStreaming();
+                break;
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            default:
+                assert(false);
+        }
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::updateTerms(const protocol_wire::BuyerTerms & terms) {
+
+        switch(_mode) {
+
+            case SessionMode::not_set:
+
+                throw exception::SessionModeNotSetException();
+
+            case SessionMode::observing:
+
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                _buying->updateTerms(terms);
+                break;
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            default:
+                assert(false);
+        }
+
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::startUploading(const ConnectionIdType & id,
+                                                   const protocol_wire::BuyerTerms & terms,
+                                                   const Coin::KeyPair & contractKeyPair,
+                                                   const Coin::PubKeyHash & finalPkHash) {
+
+        switch(_mode) {
+
+            case SessionMode::not_set:
+
+                throw exception::SessionModeNotSetException();
+
+            case SessionMode::observing:
+
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                _selling->startUploading(id,
+                                         terms,
+                                         contractKeyPair,
+                                         finalPkHash);
+                break;
+
+            default:
+                assert(false);
+        }
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::pieceLoaded(const protocol_wire::PieceData & data, int index) {
+
+        switch(_mode) {
+
+            case SessionMode::not_set:
+
+                throw exception::SessionModeNotSetException();
+
+            case SessionMode::observing:
+
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                _selling->pieceLoaded(data, index);
+                break;
+
+            default:
+                assert(false);
+        }
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::updateTerms(const protocol_wire::SellerTerms & terms) {
+
+        switch(_mode) {
+
+            case SessionMode::not_set:
+
+                throw exception::SessionModeNotSetException();
+
+            case SessionMode::observing:
+
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                _selling->updateTerms(terms);
+                break;
+
+            default:
+                assert(false);
+        }
+    }
+
+    template<class ConnectionIdType>
+    SessionState Session<ConnectionIdType>::state() const {
+        return _state;
+    }
+
+    template<class ConnectionIdType>
+    SessionMode Session<ConnectionIdType>::mode() const {
+        return _mode;
+    }
+
+    template<class ConnectionIdType>
+    typename status::Session<ConnectionIdType> Session<ConnectionIdType>::status() const noexcept {
+
+        return status::Session<ConnectionIdType>(_mode,
+                                                 _state,
+                                                 (_mode == SessionMode::selling ? _selling->status() : status::Selling()),
+                                                 (_mode == SessionMode::buying ? _buying->status() : status::Buying<ConnectionIdType>()));
+    }
+
+    template<class ConnectionIdType>
+    status::MemoryUsage<ConnectionIdType> Session<ConnectionIdType>::memoryUsage() const {
+
+        status::MemoryUsage<ConnectionIdType> usage;
+
+        // Each connection keeps its counts up to date, so this is one lookup per connection
+        for(auto mapping : _connections) {
+
+            status::ConnectionMemoryUsage connectionUsage = mapping.second->memoryUsage();
+
+            usage.connections += connectionUsage.total() + detail::TreeNodeOverhead + sizeof(typename detail::ConnectionMap<ConnectionIdType>::value_type);
+            usage.bufferedPieceData += connectionUsage.bufferedPieceData;
+
+            usage.perConnection.insert(std::make_pair(mapping.second->connectionId(), connectionUsage));
+        }
+
+        usage.connections += _handles.memoryUsage();
+
+        if(_mode == SessionMode::observing)
+            usage.passivePeers = _observing->passivePeersMemoryUsage();
+
+        if(_mode == SessionMode::buying) {
+            usage.pieces = _buying->piecesMemoryUsage();
+            usage.sellers = _buying->sellersMemoryUsage();
+        }
+
+        return usage;
+    }
+
+    template<class ConnectionIdType>
+    std::vector<status::Piece<ConnectionIdType>> Session<ConnectionIdType>::pieceStatus(int begin, int end) const {
+
+        switch(_mode) {
+
+            case SessionMode::not_set:
+
+                throw exception::SessionModeNotSetException();
+
+            case SessionMode::observing:
+
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                return _buying->pieceStatus(begin, end);
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            default:
+                assert(false);
+        }
+
+        return std::vector<status::Piece<ConnectionIdType>>();
+    }
+
+    template<class ConnectionIdType>
+    PieceAvailability Session<ConnectionIdType>::piecesInState(PieceState state) const {
+
+        switch(_mode) {
+
+            case SessionMode::not_set:
+
+                throw exception::SessionModeNotSetException();
+
+            case SessionMode::observing:
+
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                return _buying->piecesInState(state);
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                throw exception::ModeIncompatibleOperation();
+                break;
+
+            default:
+                assert(false);
+        }
+
+        return PieceAvailability();
+    }
+
+    template<class ConnectionIdType>
+    Coin::Network Session<ConnectionIdType>::network() const {
+      return _network;
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::peerAnnouncedModeAndTerms(const ConnectionIdType & id, const protocol_statemachine::AnnouncedModeAndTerms & a) {
+
+        assert(hasConnection(id));
+
+        switch(_mode) {
+
+            case SessionMode::not_set:
+                throw exception::SessionModeNotSetException();
+
+            case SessionMode::observing:
+
+                assert(_observing != nullptr && _buying == nullptr && _selling == nullptr);
+                // Nothing to do
+                break;
+
+            case SessionMode::buying:
+
+                assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+                _buying->peerAnnouncedModeAndTerms(id, a);
+                break;
+
+            case SessionMode::selling:
+
+                assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+                _selling->peerAnnouncedModeAndTerms(id, a);
+                break;
+
+        default:
+            assert(false);
+        }
+
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::invitedToOutdatedContract(const ConnectionIdType & id) {
+
+        assert(hasConnection(id));
+        assert(_mode == SessionMode::selling);
+        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+
+        _selling->invitedToOutdatedContract(id);
+    }
+
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::invitedToJoinContract(const ConnectionIdType & id) {
+
+        assert(hasConnection(id));
+        assert(_mode == SessionMode::selling);
+        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+
+        _selling->invitedToJoinContract(id);
+    }
+
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::contractPrepared(const ConnectionIdType & id, uint64_t value, const Coin::typesafeOutPoint & anchor, const Coin::PublicKey & payorContractPk, const Coin::PubKeyHash & payorFinalPkHash) {
+
+        assert(hasConnection(id));
+        assert(_mode == SessionMode::selling);
+        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+
+        _selling->contractPrepared(id, value, anchor, payorContractPk, payorFinalPkHash);
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::pieceRequested(const ConnectionIdType & id, int index) {
+
+        assert(hasConnection(id));
+        assert(_mode == SessionMode::selling);
+        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+
+        _selling->pieceRequested(id, index);
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::invalidPieceRequested(const ConnectionIdType & id) {
+
+        assert(hasConnection(id));
+        assert(_mode == SessionMode::selling);
+        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+
+        _selling->invalidPieceRequested(id);
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::paymentInterrupted(const ConnectionIdType & id) {
+
+        assert(hasConnection(id));
+        assert(_mode == SessionMode::selling);
+        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+
+        _selling->paymentInterrupted(id);
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::receivedValidPayment(const ConnectionIdType & id, const Coin::Signature & sig) {
+
+        assert(hasConnection(id));
+        assert(_mode == SessionMode::selling);
+        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+
+        _selling->receivedValidPayment(id, sig);
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::receivedInvalidPayment(const ConnectionIdType & id, const Coin::Signature & sig) {
+
+        assert(hasConnection(id));
+        assert(_mode == SessionMode::selling);
+        assert(_observing == nullptr && _buying == nullptr && _selling != nullptr);
+
+        _selling->receivedInvalidPayment(id, sig);
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::sellerHasJoined(const ConnectionIdType & id) {
+
+        assert(hasConnection(id));
+        assert(_mode == SessionMode::buying);
+        assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+
+        _buying->sellerHasJoined(id);
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::sellerHasInterruptedContract(const ConnectionIdType & id) {
+
+        assert(hasConnection(id));
+        assert(_mode == SessionMode::buying);
+        assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+
+        _buying->sellerHasInterruptedContract(id);
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::receivedFullPiece(const ConnectionIdType & id, const protocol_wire::PieceData & data) {
+
+        assert(hasConnection(id));
+        assert(_mode == SessionMode::buying);
+        assert(_observing == nullptr && _buying != nullptr && _selling == nullptr);
+
+        _buying->receivedFullPiece(id, data);
+    }
+
+    template<class ConnectionIdType>
+    void Session<ConnectionIdType>::remoteMessageOverflow(const ConnectionIdType & id) {
+
+        assert(hasConnection(id));
+
+        if (_buying != nullptr) {
+          _buying->remoteMessageOverflow(id);
         } else if (_selling != nullptr) {
           _selling->remoteMessageOverflow(id);
         }
@@ -935,27 +1513,33 @@ namespace protocol_session {
     template<class ConnectionIdType>
     detail::Connection<ConnectionIdType> * Session<ConnectionIdType>::createConnection(const ConnectionIdType & id, const SendMessageOnConnectionCallbacks & sendMessageCallbacks) {
 
+        // Callbacks refer to interned id by handle, rather than each holding a copy
+        typename detail::ConnectionHandles<ConnectionIdType>::Handle handle = _handles.add(id);
+
+        // Work done by state machine is not counted by AllocationAccounting, but work it calls back into the session for is
         return new detail::Connection<ConnectionIdType>(
-        id,
-        [this, id](const protocol_statemachine::AnnouncedModeAndTerms & a) { this->peerAnnouncedModeAndTerms(id, a); },
-        [this, id](void) { this->invitedToOutdatedContract(id); },
-        [this, id]() { this->invitedToJoinContract(id); },
+        _handles,
+        handle,
+        detail::countingAllocations([this, handle](const protocol_statemachine::AnnouncedModeAndTerms & a) { this->peerAnnouncedModeAndTerms(_handles.id(handle), a); }),
+        detail::countingAllocations([this, handle](void) { this->invitedToOutdatedContract(_handles.id(handle)); }),
+        detail::countingAllocations([this, handle]() { this->invitedToJoinContract(_handles.id(handle)); }),
         sendMessageCallbacks,
-        [this, id](uint64_t value, const Coin::typesafeOutPoint & anchor, const Coin::PublicKey & payorContractPk, const Coin::PubKeyHash & payorFinalPkHash) { this->contractPrepared(id, value, anchor, payorContractPk, payorFinalPkHash); },
-        [this, id](int i) { this->pieceRequested(id, i); },
-        [this, id]() { this->invalidPieceRequested(id); },
-        [this, id]() { this->paymentInterrupted(id); },
-        [this, id](const Coin::Signature & s) { this->receivedValidPayment(id, s); },
-        [this, id](const Coin::Signature & s) { this->receivedInvalidPayment(id, s); },
-        [this, id]() { this->sellerHasJoined(id); },
-        [this, id]() { this->sellerHasInterruptedContract(id); },
-        [this, id](const protocol_wire::PieceData & p) { this->receivedFullPiece(id, p); },
-        [this, id]() { this->remoteMessageOverflow(id); },
-        [this, id]() { this->localMessageOverflow(id); },
-        [this, id](bool successful) { this->sellerCompletedSpeedTest(id, successful); },
-        [this, id](uint32_t payloadSize) { this->buyerRequestedSpeedTest(id, payloadSize); },
+        detail::countingAllocations([this, handle](uint64_t value, const Coin::typesafeOutPoint & anchor, const Coin::PublicKey & payorContractPk, const Coin::PubKeyHash & payorFinalPkHash) { this->contractPrepared(_handles.id(handle), value, anchor, payorContractPk, payorFinalPkHash); }),
+        detail::countingAllocations([this, handle](int i) { this->pieceRequested(_handles.id(handle), i); }),
+        detail::countingAllocations([this, handle]() { this->invalidPieceRequested(_handles.id(handle)); }),
+        detail::countingAllocations([this, handle]() { this->paymentInterrupted(_handles.id(handle)); }),
+        detail::countingAllocations([this, handle](const Coin::Signature & s) { this->receivedValidPayment(_handles.id(handle), s); }),
+        detail::countingAllocations([this, handle](const Coin::Signature & s) { this->receivedInvalidPayment(_handles.id(handle), s); }),
+        detail::countingAllocations([this, handle]() { this->sellerHasJoined(_handles.id(handle)); }),
+        detail::countingAllocations([this, handle]() { this->sellerHasInterruptedContract(_handles.id(handle)); }),
+        detail::countingAllocations([this, handle](const protocol_wire::PieceData & p) { this->receivedFullPiece(_handles.id(handle), p); }),
+        detail::countingAllocations([this, handle]() { this->remoteMessageOverflow(_handles.id(handle)); }),
+        detail::countingAllocations([this, handle]() { this->localMessageOverflow(_handles.id(handle)); }),
+        detail::countingAllocations([this, handle](bool successful) { this->sellerCompletedSpeedTest(_handles.id(handle), successful); }),
+        detail::countingAllocations([this, handle](uint32_t payloadSize) { this->buyerRequestedSpeedTest(_handles.id(handle), payloadSize); }),
         _network,
-        _getTime);
+        _getTime,
+        &_connectionStateIndex);
     }
 
     template <class ConnectionIdType>
@@ -969,7 +1553,7 @@ namespace protocol_session {
             const protocol_statemachine::CBStateMachine & machine = mapping.second->machine();
 
             if(machine.announcedModeAndTermsFromPeer().modeAnnounced() == m)
-                matches.push_back(mapping.first);
+                matches.push_back(mapping.second);
         }
 
         return matches;
@@ -981,22 +1565,35 @@ namespace protocol_session {
 
         std::vector<detail::Connection<ConnectionIdType> *> matches;
 
-        // Add ids of all connections
-        for(auto mapping: _connections) {
+        connectionsInState<T>(matches);
 
-           detail::Connection<ConnectionIdType> * c = mapping.second;
+        return matches;
+    }
 
-            if(c-> template inState<T>())
-                matches.push_back(c);
-        }
+    template <class ConnectionIdType>
+    template <typename T>
+    void Session<ConnectionIdType>::connectionsInState(std::vector<detail::Connection<ConnectionIdType> *> & matches) const {
 
-        return matches;
+        matches.clear();
+
+        _connectionStateIndex. template connectionsInState<T>(matches);
+    }
+
+    template <class ConnectionIdType>
+    typename detail::ConnectionMap<ConnectionIdType>::const_iterator Session<ConnectionIdType>::find(const ConnectionIdType & id) const {
+
+        typename detail::ConnectionHandles<ConnectionIdType>::Handle handle = _handles.find(id);
+
+        if(handle == detail::ConnectionHandles<ConnectionIdType>::NoHandle)
+            return _connections.cend();
+        else
+            return _connections.find(handle);
     }
 
     template <class ConnectionIdType>
     detail::Connection<ConnectionIdType> * Session<ConnectionIdType>::get(const ConnectionIdType & id) const {
 
-        auto itr = _connections.find(id);
+        auto itr = find(id);
 
         if(itr == _connections.cend())
             throw exception::ConnectionDoesNotExist<ConnectionIdType>(id);
@@ -1008,10 +1605,13 @@ namespace protocol_session {
     typename detail::ConnectionMap<ConnectionIdType>::const_iterator Session<ConnectionIdType>::destroyConnection(const ConnectionIdType & id) {
 
         // Get iterator pointing at connection in map
-        auto itr = _connections.find(id);
+        auto itr = find(id);
 
         assert(itr != _connections.cend());
 
+        // Id stays valid until next tick, as it may still be referred to by caller
+        _handles.release(itr->second->handle());
+
         // Delete connection
         delete (itr->second);
 
@@ -1034,7 +1634,7 @@ namespace protocol_session {
         detail::Connection<ConnectionIdType> * connection = createConnection(id, callbacks);
 
         // Add to map
-        _connections.insert(std::make_pair(id, connection));
+        _connections.insert(std::make_pair(connection->handle(), connection));
 
         return connection;
     }
@@ -1049,6 +1649,60 @@ namespace protocol_session {
       _speedTestPolicy = policy;
     }
 
+    template <class ConnectionIdType>
+    EndgamePolicy Session<ConnectionIdType>::endgamePolicy() const {
+      return _endgamePolicy;
+    }
+
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::setEndgamePolicy(const EndgamePolicy & policy) {
+      _endgamePolicy = policy;
+    }
+
+    template <class ConnectionIdType>
+    UploadRateLimitPolicy Session<ConnectionIdType>::uploadRateLimitPolicy() const {
+      return _uploadRateLimitPolicy;
+    }
+
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::setUploadRateLimitPolicy(const UploadRateLimitPolicy & policy) {
+      _uploadRateLimitPolicy = policy;
+    }
+
+    template <class ConnectionIdType>
+    BufferedPieceDataPolicy Session<ConnectionIdType>::bufferedPieceDataPolicy() const {
+      return _bufferedPieceDataPolicy;
+    }
+
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::setBufferedPieceDataPolicy(const BufferedPieceDataPolicy & policy) {
+      _bufferedPieceDataPolicy = policy;
+    }
+
+    template <class ConnectionIdType>
+    std::shared_ptr<SpeedTestPayloadPool> Session<ConnectionIdType>::speedTestPayloadPool() const {
+      return _speedTestPayloadPool;
+    }
+
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::setSpeedTestPayloadPool(const std::shared_ptr<SpeedTestPayloadPool> & pool) {
+
+      if(!pool)
+        throw std::runtime_error("Speed test payload pool cannot be null");
+
+      _speedTestPayloadPool = pool;
+    }
+
+    template <class ConnectionIdType>
+    std::shared_ptr<UploadScheduler> Session<ConnectionIdType>::uploadScheduler() const {
+      return _uploadScheduler;
+    }
+
+    template <class ConnectionIdType>
+    void Session<ConnectionIdType>::setUploadScheduler(const std::shared_ptr<UploadScheduler> & scheduler) {
+      _uploadScheduler = scheduler;
+    }
+
     template <class ConnectionIdType>
     void Session<ConnectionIdType>::setTimeGetter(const std::function<std::chrono::high_resolution_clock::time_point()> & timeGetter) {
       _getTime = timeGetter;
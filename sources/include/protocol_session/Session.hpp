@@ -9,14 +9,26 @@
 #define JOYSTREAM_PROTOCOLSESSION_SESSION_HPP
 
 #include <protocol_session/detail/Connection.hpp>
-#include <protocol_session/detail/Piece.hpp>
+#include <protocol_session/detail/ConnectionStateIndex.hpp>
+#include <protocol_session/detail/ConnectionHandles.hpp>
+#include <protocol_session/detail/PieceTable.hpp>
 #include <protocol_session/Callbacks.hpp>
 #include <protocol_session/SessionMode.hpp>
 #include <protocol_session/SessionState.hpp>
 #include <protocol_session/SpeedTestPolicy.hpp>
+#include <protocol_session/EndgamePolicy.hpp>
+#include <protocol_session/PieceAvailability.hpp>
+#include <protocol_session/PiecePriority.hpp>
+#include <protocol_session/PieceVerifier.hpp>
+#include <protocol_session/SpeedTestPayloadPool.hpp>
+#include <protocol_session/BuyingCheckpoint.hpp>
+#include <protocol_session/UploadScheduler.hpp>
+#include <protocol_session/UploadRateLimitPolicy.hpp>
+#include <protocol_session/BufferedPieceDataPolicy.hpp>
 
 #include <unordered_map>
 #include <chrono>
+#include <memory>
 
 // ConnectionIdType: Type for identifying connections.
 // 1) must be possible to use as key in std::map
@@ -40,7 +52,7 @@ namespace detail {
 }
 
     template <class ConnectionIdType>
-    using PickNextPieceMethod = std::function<int(const std::vector<detail::Piece<ConnectionIdType>>*)>;
+    using PickNextPieceMethod = std::function<int(const detail::PieceTable<ConnectionIdType>*)>;
 
     class TorrentPieceInformation;
 
@@ -117,12 +129,21 @@ namespace detail {
         // Adds connection, and return the current number of connections
         uint addConnection(const ConnectionIdType &, const SendMessageOnConnectionCallbacks &);
 
+        // Same, with callbacks made by callback given to setMakeSendMessageOnConnectionCallbacks.
+        // In observe mode such a peer is kept passive, as only its id and last announced
+        // mode and terms, until it needs a full connection.
+        uint addConnection(const ConnectionIdType &);
+
+        // Callback making send callbacks of connections added without their own
+        void setMakeSendMessageOnConnectionCallbacks(const MakeSendMessageOnConnectionCallbacks<ConnectionIdType> &);
+
         // Whether there is a connection with given id
         bool hasConnection(const ConnectionIdType &) const;
 
         // Remove connection if one exists with given id, otherwise returns false.
         bool removeConnection(const ConnectionIdType &);
 
+        // Disconnects sellers taking longer than given limit to deliver a piece on average, see Buying
         void disconnectSlowSellers(const std::chrono::duration<double> & limit);
 
         // *** TEMPORARY FIX ***
@@ -164,6 +185,57 @@ namespace detail {
         // a regitered connection. Could be non-joystream peers, or something out of bounds.
         void pieceDownloaded(int);
 
+        /**
+         * @brief Sets pieces peer on given connection has, e.g. from a bitfield message.
+         * Pieces are only requested from a seller with availability if it has them,
+         * rarest first. Sellers without availability are assumed to have every piece.
+         * @throws exception::ConnectionDoesNotExist<ConnectionIdType> if there is no such connection
+         * @throws exception::InvalidPieceAvailability if size does not match number of pieces
+         */
+        void setPieceAvailability(const ConnectionIdType &, const PieceAvailability &);
+
+        // Peer on given connection has acquired given piece, e.g. from a have message
+        void peerHasPiece(const ConnectionIdType &, int);
+
+        // Hand pieces arriving while buying to given validator instead of the FullPieceArrived callback.
+        // Validation results are reported through pieceValidated, and in the mean time sellers keep
+        // receiving requests, until too many of their pieces await validation.
+        // An empty validator restores synchronous validation.
+        void setPieceValidator(const ValidatePiece<ConnectionIdType> &);
+
+        // Result of validating piece with given index, which arrived on connection with given id
+        void pieceValidated(const ConnectionIdType &, int, bool);
+
+        // Hand pieces arriving while buying to given verifier, see setPieceValidator.
+        // Results are applied by processVerifiedPieces, which is also called by tick(): valid pieces
+        // are handed to the FullPieceArrived callback to be stored, and paid for unless it rejects them.
+        void setPieceVerifier(const std::shared_ptr<PieceVerifier> &);
+
+        // Apply results of pieces verified since last call, must be called on session thread
+        void processVerifiedPieces();
+
+        // Set priority of pieces in range [begin, end), higher priority pieces are downloaded first
+        void setPiecePriority(int, int, PiecePriority);
+
+        PiecePriority piecePriority(int) const;
+
+        // Progress of buying session, to be saved with BuyingCheckpoint::save
+        BuyingCheckpoint checkpoint() const;
+
+        // Resume from checkpoint of same torrent, e.g. loaded with BuyingCheckpoint::load, before download has started
+        void restore(const BuyingCheckpoint &);
+
+        // Download in playback order from given piece, played at given number of bytes per second.
+        // Pieces due within given critical window of playback get deadlines, and at most given number of
+        // those at risk of missing it are requested again from a faster seller within any such window of time.
+        void startStreaming(int, uint64_t, std::chrono::seconds = std::chrono::seconds(10), uint32_t = 4);
+
+        // Playback has reached given piece
+        void updatePlayhead(int);
+
+        // Stop streaming, and return to order decided by piece picker
+        void stopStreaming();
+
         // Update terms
         void updateTerms(const protocol_wire::BuyerTerms &);
 
@@ -204,12 +276,45 @@ namespace detail {
         // Status of session
         status::Session<ConnectionIdType> status() const noexcept;
 
+        // Status of pieces in range [begin, end) when buying, for paging through large torrents
+        std::vector<status::Piece<ConnectionIdType>> pieceStatus(int, int) const;
+
+        // Bitmap of pieces in given state when buying
+        PieceAvailability piecesInState(PieceState) const;
+
+        // Estimate of bytes held by session, per component and per connection
+        status::MemoryUsage<ConnectionIdType> memoryUsage() const;
+
         Coin::Network network() const;
 
         SpeedTestPolicy speedTestPolicy() const;
 
         void setSpeedTestPolicy(const SpeedTestPolicy);
 
+        EndgamePolicy endgamePolicy() const;
+
+        void setEndgamePolicy(const EndgamePolicy &);
+
+        UploadRateLimitPolicy uploadRateLimitPolicy() const;
+
+        void setUploadRateLimitPolicy(const UploadRateLimitPolicy &);
+
+        BufferedPieceDataPolicy bufferedPieceDataPolicy() const;
+
+        void setBufferedPieceDataPolicy(const BufferedPieceDataPolicy &);
+
+        // Shared test payloads, for use in the speedTestPayload send callback
+        std::shared_ptr<SpeedTestPayloadPool> speedTestPayloadPool() const;
+
+        // Share payloads with other sessions, e.g. when seeding many torrents
+        void setSpeedTestPayloadPool(const std::shared_ptr<SpeedTestPayloadPool> &);
+
+        // Scheduler pieces sent to buyers are metered by, if any
+        std::shared_ptr<UploadScheduler> uploadScheduler() const;
+
+        // Share upload budget with other sessions, nullptr sends pieces as soon as they are ready
+        void setUploadScheduler(const std::shared_ptr<UploadScheduler> &);
+
         void setTimeGetter(const std::function<std::chrono::high_resolution_clock::time_point()> &);
 
     private:
@@ -220,9 +325,18 @@ namespace detail {
         // Current state of session
         SessionState _state;
 
-        // Connections
+        // Interned ids of connections, and the only index by id
+        detail::ConnectionHandles<ConnectionIdType> _handles;
+
+        // Connections by handle
         detail::ConnectionMap<ConnectionIdType> _connections;
 
+        // Makes send callbacks of connections added without their own
+        MakeSendMessageOnConnectionCallbacks<ConnectionIdType> _makeSendMessageOnConnectionCallbacks;
+
+        // Connections partitioned by state, kept up to date by connections themselves
+        detail::ConnectionStateIndex<ConnectionIdType> _connectionStateIndex;
+
         // When session was started
         time_t _started;
 
@@ -232,6 +346,18 @@ namespace detail {
 
         SpeedTestPolicy _speedTestPolicy;
 
+        EndgamePolicy _endgamePolicy;
+
+        UploadRateLimitPolicy _uploadRateLimitPolicy;
+
+        BufferedPieceDataPolicy _bufferedPieceDataPolicy;
+
+        // Never null
+        std::shared_ptr<SpeedTestPayloadPool> _speedTestPayloadPool;
+
+        // May be null
+        std::shared_ptr<UploadScheduler> _uploadScheduler;
+
 
         //// Substates
 
@@ -280,6 +406,13 @@ namespace detail {
         template <typename T>
         std::vector<detail::Connection<ConnectionIdType> *> connectionsInState() const;
 
+        // Same, but writes into given vector which is cleared first
+        template <typename T>
+        void connectionsInState(std::vector<detail::Connection<ConnectionIdType> *> &) const;
+
+        // Connection with given id, or end of connections
+        typename detail::ConnectionMap<ConnectionIdType>::const_iterator find(const ConnectionIdType &) const;
+
         // Returns connection if present, otherwise throws exception
         // ConnectionDoesNotExist<ConnectionIdType>
         detail::Connection<ConnectionIdType> * get(const ConnectionIdType &) const;
@@ -0,0 +1,56 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_SPEEDTESTPAYLOADPOOL_HPP
+#define JOYSTREAM_PROTOCOLSESSION_SPEEDTESTPAYLOADPOOL_HPP
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace joystream {
+namespace protocol_session {
+
+  // Immutable zero filled buffer shared by all speed test payloads. Payloads are prefixes of the
+  // largest one requested so far, so serving a test to any number of buyers, of any size, needs
+  // no per request buffer or copy. May be shared by several sessions, see Session::setSpeedTestPayloadPool.
+  class SpeedTestPayloadPool {
+
+    public:
+
+      struct Payload {
+
+        Payload() : size(0) {}
+        Payload(const std::shared_ptr<const char> & data, uint32_t size) : data(data), size(size) {}
+
+        std::shared_ptr<const char> data;
+        uint32_t size;
+      };
+
+      SpeedTestPayloadPool();
+
+      // Makes sure payloads up to given size can be handed out without allocating
+      void reserve(uint32_t);
+
+      // Payload of given size, buffer is only grown when a larger payload than before is requested
+      Payload get(uint32_t);
+
+      // Size of shared buffer
+      uint32_t capacity() const;
+
+    private:
+
+      mutable std::mutex _mutex;
+
+      std::shared_ptr<const char> _buffer;
+      uint32_t _capacity;
+
+      // Replaces buffer with larger one, if needed, mutex must be held
+      void grow(uint32_t);
+  };
+
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_SPEEDTESTPAYLOADPOOL_HPP
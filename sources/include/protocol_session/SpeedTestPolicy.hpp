@@ -20,12 +20,16 @@ namespace protocol_session {
       bool isEnabled() const;
       bool disconnectIfSlow() const;
 
+      // Maximum number of sellers tested at the same time when buying, others are queued cheapest first. 0 means no limit
+      unsigned int maxConcurrentTests() const;
+
       void setPayloadSize(uint32_t);
       void setMaxPayloadSize(uint32_t);
       void setMaxTimeToRespond(std::chrono::seconds);
       void enable();
       void disable();
       void setDisconnectIfSlow(bool);
+      void setMaxConcurrentTests(unsigned int);
 
     private:
 
@@ -34,6 +38,7 @@ namespace protocol_session {
       std::chrono::seconds _maxTimeToRespond;
       bool _enabled;
       bool _disconnectIfSlow;
+      unsigned int _maxConcurrentTests;
 
   };
 
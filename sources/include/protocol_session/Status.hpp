@@ -17,6 +17,8 @@
 #include <CoinCore/CoinNodeData.h> // Coin::Transaction
 
 #include <queue>
+#include <chrono>
+#include <map>
 
 namespace joystream {
 namespace protocol_session {
@@ -110,14 +112,55 @@ namespace status {
     template <class ConnectionIdType>
     struct Seller {
 
-        Seller() {}
-
-        Seller(ConnectionIdType connection)
-            : connection(connection) {
+        Seller() : piecesPerSecond(0), bytesPerSecond(0), latency(std::chrono::duration<double>::zero()), score(0) {}
+
+        Seller(ConnectionIdType connection,
+               double piecesPerSecond,
+               double bytesPerSecond,
+               std::chrono::duration<double> latency,
+               double score)
+            : connection(connection)
+            , piecesPerSecond(piecesPerSecond)
+            , bytesPerSecond(bytesPerSecond)
+            , latency(latency)
+            , score(score) {
         }
 
         // Connection identifier for seller
         ConnectionIdType connection;
+
+        // Measured delivery rate, zero before first piece arrived
+        double piecesPerSecond;
+        double bytesPerSecond;
+
+        // Measured time from request to arrival of a piece, zero before first piece arrived
+        std::chrono::duration<double> latency;
+
+        // Score used to share pieces among sellers, zero before first piece arrived
+        double score;
+    };
+
+    // Number of pieces in each state
+    struct PieceCounts {
+
+        PieceCounts()
+            : unassigned(0)
+            , beingDownloaded(0)
+            , beingValidatedAndStored(0)
+            , downloaded(0) {
+        }
+
+        PieceCounts(unsigned int unassigned, unsigned int beingDownloaded, unsigned int beingValidatedAndStored, unsigned int downloaded)
+            : unassigned(unassigned)
+            , beingDownloaded(beingDownloaded)
+            , beingValidatedAndStored(beingValidatedAndStored)
+            , downloaded(downloaded) {
+        }
+
+        unsigned int unassigned;
+        unsigned int beingDownloaded;
+        unsigned int beingValidatedAndStored;
+        unsigned int downloaded;
     };
 
     template <class ConnectionIdType>
@@ -129,12 +172,14 @@ namespace status {
                const protocol_wire::BuyerTerms & terms,
                const std::map<ConnectionIdType, Seller<ConnectionIdType>> & sellers,
                //const Coin::Transaction & contractTx,
-               const std::vector<Piece<ConnectionIdType>> & pieces)
+               const std::vector<Piece<ConnectionIdType>> & pieces,
+               const PieceCounts & pieceCounts)
             : state(state)
             , terms(terms)
             , sellers(sellers)
             //, contractTx(contractTx)
-            , pieces(pieces) {
+            , pieces(pieces)
+            , pieceCounts(pieceCounts) {
         }
 
         // State
@@ -149,21 +194,116 @@ namespace status {
         // Contract transaction id
         //Coin::Transaction contractTx;
 
-        // Pieces in torrent file
+        // Pieces in torrent file, left empty as it is expensive for large torrents, see Session::pieceStatus
         std::vector<Piece<ConnectionIdType>> pieces;
+
+        PieceCounts pieceCounts;
     };
 
     struct Selling {
 
-        Selling() {}
+        Selling()
+            : numberOfSpeedTestsServed(0)
+            , speedTestBytesServed(0)
+            , sessionThrottledTime(0)
+            , buyerThrottledTime(0)
+            , bufferedPieceData(0)
+            , piecesBeingLoaded(0)
+            , evictedPieceData(0) {
+        }
 
-        Selling(const protocol_wire::SellerTerms & terms)
-            : terms(terms) {
+        Selling(const protocol_wire::SellerTerms & terms,
+                uint64_t numberOfSpeedTestsServed,
+                uint64_t speedTestBytesServed,
+                std::chrono::duration<double> sessionThrottledTime,
+                std::chrono::duration<double> buyerThrottledTime,
+                uint64_t bufferedPieceData,
+                int piecesBeingLoaded,
+                uint64_t evictedPieceData)
+            : terms(terms)
+            , numberOfSpeedTestsServed(numberOfSpeedTestsServed)
+            , speedTestBytesServed(speedTestBytesServed)
+            , sessionThrottledTime(sessionThrottledTime)
+            , buyerThrottledTime(buyerThrottledTime)
+            , bufferedPieceData(bufferedPieceData)
+            , piecesBeingLoaded(piecesBeingLoaded)
+            , evictedPieceData(evictedPieceData) {
         }
 
         // Terms for selling
         protocol_wire::SellerTerms terms;
 
+        // Speed tests served, and total size of their payloads
+        uint64_t numberOfSpeedTestsServed;
+        uint64_t speedTestBytesServed;
+
+        // Time sending was held back by session upload rate limit,
+        // and by per buyer limits summed over all buyers, see UploadRateLimitPolicy
+        std::chrono::duration<double> sessionThrottledTime;
+        std::chrono::duration<double> buyerThrottledTime;
+
+        // Bytes of piece data loaded for all buyers but not yet sent, pieces the client is loading,
+        // and total bytes dropped for stalled buyers, see BufferedPieceDataPolicy
+        uint64_t bufferedPieceData;
+        int piecesBeingLoaded;
+        uint64_t evictedPieceData;
+    };
+
+    // Bytes held by a connection, estimated from sizes of objects and capacities of their buffers.
+    // Does not include states allocated by the state machine or captures of client callbacks.
+    struct ConnectionMemoryUsage {
+
+        ConnectionMemoryUsage()
+            : connection(0)
+            , pieceAvailability(0)
+            , pieceDeliveryPipeline(0)
+            , bufferedPieceData(0) {
+        }
+
+        uint64_t total() const {
+            return connection + pieceAvailability + pieceDeliveryPipeline + bufferedPieceData;
+        }
+
+        // Connection itself, with state machine and callbacks
+        uint64_t connection;
+
+        // Pieces peer has: only used when buying
+        uint64_t pieceAvailability;
+
+        // Slots of delivery pipeline, and data of pieces loaded but not yet sent: only used when selling
+        uint64_t pieceDeliveryPipeline;
+        uint64_t bufferedPieceData;
+    };
+
+    template <class ConnectionIdType>
+    struct MemoryUsage {
+
+        MemoryUsage()
+            : connections(0)
+            , bufferedPieceData(0)
+            , passivePeers(0)
+            , pieces(0)
+            , sellers(0) {
+        }
+
+        uint64_t total() const {
+            return connections + passivePeers + pieces + sellers;
+        }
+
+        // All connections, including buffered piece data which is also given on its own
+        uint64_t connections;
+        uint64_t bufferedPieceData;
+
+        // Peers without a full connection: only used when observing
+        uint64_t passivePeers;
+
+        // Piece table, bitmaps and index used to pick pieces: only used when buying
+        uint64_t pieces;
+
+        // Sellers of present and earlier contracts: only used when buying
+        uint64_t sellers;
+
+        std::map<ConnectionIdType, ConnectionMemoryUsage> perConnection;
     };
 
     template <class ConnectionIdType>
@@ -0,0 +1,43 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_UPLOADRATELIMITPOLICY_HPP
+#define JOYSTREAM_PROTOCOLSESSION_UPLOADRATELIMITPOLICY_HPP
+
+#include <cstdint>
+
+namespace joystream {
+namespace protocol_session {
+
+  // When selling, caps the rate at which piece data is sent, both to each buyer and by the session
+  // as a whole, so that one fast buyer cannot take all of our upload. Each limit is a token bucket
+  // with a rate in bytes per second and a burst size in bytes. A rate of 0 means no limit.
+  class UploadRateLimitPolicy {
+    public:
+      UploadRateLimitPolicy();
+
+      bool isEnabled() const;
+
+      uint64_t sessionBytesPerSecond() const;
+      uint64_t sessionBurst() const;
+
+      uint64_t buyerBytesPerSecond() const;
+      uint64_t buyerBurst() const;
+
+      void setSessionRate(uint64_t bytesPerSecond, uint64_t burst);
+      void setBuyerRate(uint64_t bytesPerSecond, uint64_t burst);
+
+    private:
+
+      uint64_t _sessionBytesPerSecond;
+      uint64_t _sessionBurst;
+
+      uint64_t _buyerBytesPerSecond;
+      uint64_t _buyerBurst;
+  };
+
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_UPLOADRATELIMITPOLICY_HPP
@@ -0,0 +1,112 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_UPLOADSCHEDULER_HPP
+#define JOYSTREAM_PROTOCOLSESSION_UPLOADSCHEDULER_HPP
+
+#include <protocol_session/detail/TokenBucket.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+
+namespace joystream {
+namespace protocol_session {
+
+  // Meters pieces sent to buyers against one upload budget, which may be shared by the
+  // selling sessions of many torrents, see Session::setUploadScheduler. Each buyer is a flow,
+  // weighted by the price it pays, and flows with pieces ready are served by deficit round robin,
+  // so better paying buyers get proportionally more of the uplink while no buyer is starved.
+  // Not thread safe: sessions sharing a scheduler must be driven from the same thread.
+  class UploadScheduler {
+
+    public:
+
+      typedef uint32_t Flow;
+
+      // Size of next piece flow can send, 0 if it has nothing to send
+      typedef std::function<uint32_t()> NextPieceSize;
+
+      // Send next piece of flow
+      typedef std::function<void()> SendNextPiece;
+
+      // Budget of given bytes per second, 0 for unlimited, and burst size in bytes.
+      // Quantum is bytes per round given to the flows with the lowest weight.
+      UploadScheduler(uint64_t bytesPerSecond = 0, uint64_t burst = 4*1024*1024, uint32_t quantum = 256*1024);
+
+      Flow add(const NextPieceSize &, const SendNextPiece &);
+
+      // Flow is dropped, whether or not it has pieces left, and its id may be reused,
+      // though not before run is done when called from a callback
+      void remove(Flow);
+
+      // Weight of flow, e.g. price per piece, at least 1
+      void setWeight(Flow, uint64_t);
+
+      // Flow may have pieces to send, it is served by next call to run
+      void schedule(Flow);
+
+      // Sends pieces of scheduled flows as budget allows, calls from within
+      // a send callback are ignored
+      void run(std::chrono::high_resolution_clock::time_point);
+
+      void setRate(uint64_t bytesPerSecond, uint64_t burst);
+
+      uint64_t bytesPerSecond() const;
+
+      // Time pieces were held back for lack of budget, up to given time
+      std::chrono::duration<double> throttledTime(std::chrono::high_resolution_clock::time_point) const;
+
+      // Total size of pieces sent
+      uint64_t bytesSent() const;
+
+      // Number of flows, and of those scheduled
+      unsigned int numberOfFlows() const;
+      unsigned int numberOfScheduledFlows() const;
+
+    private:
+
+      struct FlowState {
+
+        FlowState() : inUse(false), scheduled(false), visited(false), weight(1), deficit(0) {}
+
+        bool inUse;
+        bool scheduled;
+
+        // Flow was given its quantum in the present round, but ran out of budget
+        bool visited;
+
+        uint64_t weight;
+        uint64_t deficit;
+
+        NextPieceSize nextPieceSize;
+        SendNextPiece sendNextPiece;
+      };
+
+      std::vector<FlowState> _flows;
+      std::vector<Flow> _free;
+
+      // Flows removed by callbacks during run, released when it is done
+      std::vector<Flow> _removedWhileRunning;
+
+      // Scheduled flows, in round robin order starting with the one presently served
+      std::deque<Flow> _scheduled;
+
+      detail::TokenBucket _budget;
+
+      uint32_t _quantum;
+
+      // Set while run sends pieces
+      bool _running;
+
+      uint64_t _bytesSent;
+      unsigned int _numberOfFlows;
+  };
+
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_UPLOADSCHEDULER_HPP
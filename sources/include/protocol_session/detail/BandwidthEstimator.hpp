@@ -0,0 +1,61 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_DETAIL_BANDWIDTHESTIMATOR_HPP
+#define JOYSTREAM_PROTOCOLSESSION_DETAIL_BANDWIDTHESTIMATOR_HPP
+
+#include <chrono>
+#include <cstdint>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+// Rolling estimate of how fast a peer delivers pieces, fed by every delivery.
+// Each average is exponentially weighted, with every new sample weighing in by a quarter.
+class BandwidthEstimator {
+
+public:
+
+  BandwidthEstimator();
+
+  // Piece of given byte length was delivered, given time after peer could start on it
+  // (request, or arrival of previous piece when pipelined), and given time after it was requested
+  void delivered(uint64_t length, std::chrono::duration<double> serviceTime, std::chrono::duration<double> latency);
+
+  bool hasEstimate() const;
+
+  uint64_t numberOfSamples() const;
+
+  uint64_t bytesDelivered() const;
+
+  // Average time to deliver a piece, zero without estimate
+  std::chrono::duration<double> serviceTime() const;
+
+  // Average time from request to arrival, zero without estimate
+  std::chrono::duration<double> latency() const;
+
+  // Average delivery rate, zero without estimate
+  double bytesPerSecond() const;
+
+private:
+
+  static constexpr double _weight = 0.25;
+
+  uint64_t _numberOfSamples;
+
+  uint64_t _bytesDelivered;
+
+  std::chrono::duration<double> _serviceTime;
+
+  std::chrono::duration<double> _latency;
+
+  double _bytesPerSecond;
+};
+
+}
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_DETAIL_BANDWIDTHESTIMATOR_HPP
@@ -15,6 +15,8 @@
 #include <common/Bitcoin.hpp> // BITCOIN_DUST_LIMIT
 #include <common/P2SHAddress.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <numeric>
 
 namespace joystream {
@@ -36,30 +38,64 @@ namespace detail {
         , _sentPayment(sentPayment)
         , _state(BuyingState::sending_invitations)
         , _terms(terms)
+        , _duplicateRequestsMade(0)
+        , _streaming(false)
+        , _playhead(0)
+        , _bytesPerSecond(0)
+        , _criticalWindow(0)
         , _numberOfMissingPieces(0)
+        , _numberOfSellersCreated(0)
         , _allSellersGone(allSellersGone)
         , _maxConcurrentRequests(4)
-        , _maxTimeToServicePiece(maxTimeToServicePiece) {
+        , _minDeliveriesBeforeJudgingSpeed(3)
+        , _maxPiecesAwaitingValidation(8)
+        , _maxTimeToServicePiece(maxTimeToServicePiece)
+        , _maxKnownSpeedTests(1000) {
         //, _lastStartOfSendingInvitations(0) {
 
+        _unassigned.resize(information.size());
+        _beingDownloaded.resize(information.size());
+        _priorityIndex.resize(information.size());
+
         // Setup pieces
+        _pieces = detail::PieceTable<ConnectionIdType>(&_session->_handles, information);
+
         for(uint i = 0;i < information.size();i++) {
 
-            PieceInformation p = information[i];
+            const PieceInformation & p = information[i];
 
-            _pieces.push_back(detail::Piece<ConnectionIdType>(i, p));
+            if(p.priority() != DefaultPiecePriority)
+                _priorityIndex.setPriority(i, i + 1, p.priority());
 
-            if(!p.downloaded())
+            if(!p.downloaded()) {
                 _numberOfMissingPieces++;
+                _unassigned.set(i);
+                _priorityIndex.include(i);
+            }
+        }
+
+        // Count availability of existing peers, dropping any which does not match torrent
+        for(auto i : _session->_connections) {
+
+            PieceAvailability & availability = (i.second)->pieceAvailability();
+
+            if(availability.size() == _pieces.size())
+                addAvailability(availability);
+            else
+                availability.clear();
         }
 
+        // Sellers among existing peers, only time all peers are looked at
+        for(auto i : _session->_connections)
+            updateSellerOrderBook((i.second)->connectionId(), (i.second)->announcedModeAndTermsFromPeer());
+
         // Notify any existing peers
         for(auto i : _session->_connections)
             (i.second)->processEvent(protocol_statemachine::event::BuyModeStarted(_terms));
 
         // If session is started, then set start time of this new mode
         if(_session->_state == SessionState::started)
-            _lastStartOfSendingInvitations = std::chrono::high_resolution_clock::now();
+            _lastStartOfSendingInvitations = _session->_getTime();
     }
 
     template <class ConnectionIdType>
@@ -86,6 +122,9 @@ namespace detail {
             throw exception::ConnectionDoesNotExist<ConnectionIdType>(id);
 
         removeConnection(id, DisconnectCause::client);
+
+        // Connection may have held a speed test slot
+        startQueuedSpeedTests();
     }
 
     template <class ConnectionIdType>
@@ -100,9 +139,7 @@ namespace detail {
 
         auto connection = seller.connection();
 
-        const paymentchannel::Payor & payor = connection->payor();
-
-        _sentPayment(connection->connectionId(), payor.price(), payor.numberOfPaymentsMade(), payor.amountPaid(), index);
+        _sentPayment(connection->connectionId(), connection->price(), connection->numberOfPayments(), connection->amountPaid(), index);
 
         tryToAssignAndRequestPieces(seller);
     }
@@ -130,6 +167,8 @@ namespace detail {
 
         //assert(c->announcedModeAndTermsFromPeer() == a);
 
+        updateSellerOrderBook(id, a);
+
         // If we are currently started and sending out invitations, then we may (re)invite
         // sellers with sufficiently good terms
         if(_session->_state == SessionState::started &&
@@ -181,17 +220,51 @@ namespace detail {
          */
 
         // Get seller corresponding to given id
-        auto itr = _sellers.find(id);
+        auto itr = _sellers.find(_session->get(id)->handle());
         assert(itr != _sellers.end());
 
         detail::Seller<ConnectionIdType> & s = itr->second;
 
         // Update state and get expected piece index
-        int index = s.fullPieceArrived();
+        int index = s.fullPieceArrived(p.length(), _session->_getTime());
+
+        PieceState state = _pieces.state(index);
+
+        // During endgame or streaming a piece may be requested from several sellers, and only the first copy
+        // to arrive is used. Later copies are paid for, as the seller did the work, but the client
+        // is not bothered with them.
+        if(state == PieceState::being_validated_and_stored || state == PieceState::downloaded) {
+            validPieceReceivedOnConnection(s, index);
+            return;
+        }
+
+        // Copy from a seller other than the one piece was assigned to arrived first, so it takes over
+        if(state == PieceState::unassigned) {
+            _unassigned.reset(index);
+            _priorityIndex.exclude(index);
+            _pieces.assigned(index, itr->first);
+        } else if(!_pieces.assignedTo(index, itr->first)) {
+            _pieces.deAssign(index);
+            _pieces.assigned(index, itr->first);
+        }
+
+        _pieces.arrived(index);
+        _beingDownloaded.reset(index);
+
+        // Hand piece to verifier or validator, and keep requests flowing while it is being validated
+        if(_pieceVerifier || _validatePiece) {
+
+            // Verifier hands back handle and generation of seller with result, see processVerifiedPieces
+            if(_pieceVerifier)
+                _pieceVerifier->submit(index, p, itr->first, s.generation());
+            else
+                _validatePiece(id, p, index);
 
-        detail::Piece<ConnectionIdType> & piece = _pieces[index];
+            if(!s.isGone())
+                tryToAssignAndRequestPieces(s);
 
-        piece.arrived();
+            return;
+        }
 
         // Notify client - client should immediatly validate the piece and return result of validation
         bool wasValid = _fullPieceArrived(id, p, index);
@@ -218,10 +291,15 @@ namespace detail {
 
       detail::Connection<ConnectionIdType> * c = _session->get(id);
 
+      // Let next seller in queue be tested
+      speedTestFinished(id);
+
       if (!successful) {
         // Remove connection
         removeConnection(id, DisconnectCause::seller_failed_speed_test);
 
+        startQueuedSpeedTests();
+
         // Notify state machine about deletion
         throw protocol_statemachine::exception::StateMachineDeletedException();
 
@@ -229,23 +307,26 @@ namespace detail {
         // record completion time
         c->endingSpeedTest();
 
-        if (!_session->speedTestPolicy().disconnectIfSlow()) {
-          maybeInviteSeller(c);
-        } else {
+        if (_session->speedTestPolicy().disconnectIfSlow() &&
+            !c->speedTestCompletedInLessThan(_session->speedTestPolicy().maxTimeToRespond())) {
 
-          if (c->speedTestCompletedInLessThan(_session->speedTestPolicy().maxTimeToRespond())) {
-            // Invite seller if they met the speedTestPolicy requirement
-            maybeInviteSeller(c);
+          // Disconnect seller if they did not meet the speedTestPolicy requirement
+          removeConnection(id, DisconnectCause::seller_failed_speed_test);
 
-          } else {
-            // otherwise disconnect them
-            removeConnection(id, DisconnectCause::seller_failed_speed_test);
+          startQueuedSpeedTests();
 
-            // Notify state machine about deletion
-            throw protocol_statemachine::exception::StateMachineDeletedException();
-          }
+          // Notify state machine about deletion
+          throw protocol_statemachine::exception::StateMachineDeletedException();
         }
 
+        // Remembered for checkpoints
+        rememberSpeedTest(IdToString(id), *c->timeToDeliverTestPayload());
+
+        // Invite seller, unless we are no longer sending invitations
+        if(_session->_state == SessionState::started && _state == BuyingState::sending_invitations)
+          maybeInviteSeller(c);
+
+        startQueuedSpeedTests();
       }
 
     }
@@ -256,6 +337,8 @@ namespace detail {
         // Prepare sellers before we interrupt with new mode
         politeSellerCompensation();
 
+        clearSpeedTests();
+
         // Reset speed testing state for all connections that have not completed a speed test
         // This is to ensure when the session comes back to buying mode it will make sure to send a speed test request
         // to sellers that have not completed yet.
@@ -276,7 +359,7 @@ namespace detail {
         assert(_session->_state != SessionState::started);
 
         // Note starting time
-        _lastStartOfSendingInvitations = std::chrono::high_resolution_clock::now();
+        _lastStartOfSendingInvitations = _session->_getTime();
 
         // Set client mode to started
         _session->_state = SessionState::started;
@@ -290,12 +373,16 @@ namespace detail {
         // Prepare sellers for closing connections
         politeSellerCompensation();
 
-        // Clear sellers
+        clearSpeedTests();
+
+        // Clear sellers, and with them any duplicate requests
         _sellers.clear();
+        _duplicateRequestsMade = 0;
+        _recentRescues.clear();
 
         // Disconnect everyone:
         for(auto itr = _session->_connections.cbegin();itr != _session->_connections.cend();)
-            itr = removeConnection(itr->first, DisconnectCause::client);
+            itr = removeConnection(itr->second->connectionId(), DisconnectCause::client);
 
         // Update core session state
         _session->_state = SessionState::stopped;
@@ -329,7 +416,12 @@ namespace detail {
             // Reset state to allow restarting downloading after all sellers are gone
             if(_state == BuyingState::downloading) {
 
-                for(auto mapping : _sellers) {
+                // Results from verifier, in case client does not process them as they arrive
+                processVerifiedPieces();
+
+                _idleSellers.clear();
+
+                for(auto & mapping : _sellers) {
 
                     // Reference to seller
                     detail::Seller<ConnectionIdType> & s = mapping.second;
@@ -337,13 +429,14 @@ namespace detail {
                     if (s.isGone()) continue;
 
                     // Disconnect if seller timed-out servicing request
-                    if (s.servicingPieceHasTimedOut(_maxTimeToServicePiece)) {
+                    if (s.servicingPieceHasTimedOut(_maxTimeToServicePiece, _session->_getTime())) {
                       removeConnection(s.connection()->connectionId(), DisconnectCause::seller_servicing_piece_has_timed_out);
                       continue;
                     }
 
                     // A seller may be waiting to be assigned a new piece
-                    if(s.piecesAwaitingArrival().size() == 0) {
+                    // When streaming, sellers with spare capacity may also rescue pieces at risk
+                    if(s.numberOfPiecesAwaitingArrival() == 0 || (_streaming && s.numberOfPiecesAwaitingArrival() < requestWindow(s))) {
 
                         // This can happen when a seller has previously uploaded a valid piece,
                         // but there were no unassigned pieces at that time,
@@ -352,12 +445,27 @@ namespace detail {
                         // * seller interrupts contract by updating terms
                         // * seller sent an invalid piece
 
-                        tryToAssignAndRequestPieces(s);
+                        _idleSellers.push_back(&s);
                     }
                 }
 
+                // Best sellers get first pick
+                std::sort(_idleSellers.begin(), _idleSellers.end(),
+                          [](const detail::Seller<ConnectionIdType> * a, const detail::Seller<ConnectionIdType> * b) {
+                              return a->score() > b->score();
+                          });
+
+                for(detail::Seller<ConnectionIdType> * s : _idleSellers)
+                    if(!s->isGone())
+                        tryToAssignAndRequestPieces(*s);
+
                 // If all sellers are gone, reset state
                 resetIfAllSellersGone();
+
+            } else if(_state == BuyingState::sending_invitations) {
+
+                // Do not let unresponsive sellers hold up testing of others
+                expireSpeedTests();
             }
         }
     }
@@ -368,14 +476,13 @@ namespace detail {
         assert(index >= 0);
 
         // We cannot apriori assert anything about piece state.
-        detail::Piece<ConnectionIdType> & piece = _pieces[index];
 
         // If its not already, then mark piece as downloaded and
         // count towards missing piece count.
         // NB: There may be a seller currently sending us this piece,
         // or it may be in validation/storage, or even downloaded before.
 
-        if(piece.state() != PieceState::downloaded) {
+        if(_pieces.state(index) != PieceState::downloaded) {
 
             _numberOfMissingPieces--;
 
@@ -384,7 +491,318 @@ namespace detail {
                 _state = BuyingState::download_completed;
         }
 
-        piece.downloaded();
+        _pieces.downloaded(index);
+
+        _unassigned.reset(index);
+        _priorityIndex.exclude(index);
+        _beingDownloaded.reset(index);
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::setPieceAvailability(const ConnectionIdType & id, const PieceAvailability & availability) {
+
+        if(availability.size() != _pieces.size())
+            throw exception::InvalidPieceAvailability("number of pieces does not match torrent.");
+
+        detail::Connection<ConnectionIdType> * c = _session->get(id);
+
+        PieceAvailability & current = c->pieceAvailability();
+
+        removeAvailability(current);
+
+        current = availability;
+
+        addAvailability(current);
+
+        tryToRequestFromIdleSeller(id);
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::peerHasPiece(const ConnectionIdType & id, int index) {
+
+        if(index < 0 || index >= (int)_pieces.size())
+            throw exception::InvalidPieceAvailability("piece index out of range.");
+
+        detail::Connection<ConnectionIdType> * c = _session->get(id);
+
+        PieceAvailability & current = c->pieceAvailability();
+
+        // Peer which has not advertised availability yet starts out with no pieces
+        if(current.empty())
+            current.resize(_pieces.size());
+
+        if(current.test(index))
+            return;
+
+        current.set(index);
+
+        _priorityIndex.addAvailability(index);
+
+        tryToRequestFromIdleSeller(id);
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::startStreaming(int playhead, uint64_t bytesPerSecond, std::chrono::seconds criticalWindow, uint32_t maxRescuesPerWindow) {
+
+        if(bytesPerSecond == 0)
+            throw exception::InvalidStreamingParameters("playback rate must be positive.");
+
+        if(criticalWindow <= std::chrono::seconds::zero())
+            throw exception::InvalidStreamingParameters("critical window must be positive.");
+
+        // Checked before switching to streaming, so a bad playhead leaves mode unchanged
+        if(playhead < 0 || playhead >= (int)_pieces.size())
+            throw exception::InvalidStreamingParameters("playhead out of range.");
+
+        _bytesPerSecond = bytesPerSecond;
+        _criticalWindow = criticalWindow;
+        _streaming = true;
+
+        // Earlier rescues count against new limit
+        _recentRescues.set_capacity(maxRescuesPerWindow);
+
+        updatePlayhead(playhead);
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::updatePlayhead(int playhead) {
+
+        if(!_streaming)
+            throw exception::InvalidStreamingParameters("not streaming.");
+
+        if(playhead < 0 || playhead >= (int)_pieces.size())
+            throw exception::InvalidStreamingParameters("playhead out of range.");
+
+        _playhead = playhead;
+        _playheadUpdatedAt = _session->_getTime();
+
+        updateCriticalWindow();
+
+        // Idle sellers may now have urgent pieces to fetch
+        if(_session->_state == SessionState::started && _state == BuyingState::downloading)
+            for(auto & mapping : _sellers)
+                if(!mapping.second.isGone() && mapping.second.numberOfPiecesAwaitingArrival() == 0)
+                    tryToAssignAndRequestPieces(mapping.second);
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::stopStreaming() {
+        _streaming = false;
+        _playbackOffsets.clear();
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::disconnectSlowSellers(const std::chrono::duration<double> & limit) {
+
+        if(_session->_state != SessionState::started || _state != BuyingState::downloading)
+            return;
+
+        // Best seller is kept
+        const detail::Seller<ConnectionIdType> * best = nullptr;
+
+        for(const auto & mapping : _sellers)
+            if(!mapping.second.isGone() && (best == nullptr || mapping.second.score() > best->score()))
+                best = &mapping.second;
+
+        for(auto & mapping : _sellers) {
+
+            detail::Seller<ConnectionIdType> & s = mapping.second;
+
+            if(s.isGone() || &s == best || s.bandwidth().numberOfSamples() < _minDeliveriesBeforeJudgingSpeed)
+                continue;
+
+            if(s.bandwidth().serviceTime() > limit) {
+                const ConnectionIdType & id = s.connection()->connectionId();
+
+                std::clog << "Disconnecting slow seller " << IdToString(id) << std::endl;
+                removeConnection(id, DisconnectCause::seller_is_too_slow);
+            }
+        }
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::setPieceValidator(const ValidatePiece<ConnectionIdType> & validatePiece) {
+        _validatePiece = validatePiece;
+        _pieceVerifier.reset();
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::setPieceVerifier(const std::shared_ptr<PieceVerifier> & verifier) {
+
+        if(verifier && verifier->numberOfPieces() != _pieces.size())
+            throw exception::StateIncompatibleOperation("verifier does not have digests for all pieces.");
+
+        _pieceVerifier = verifier;
+        _validatePiece = ValidatePiece<ConnectionIdType>();
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::processVerifiedPieces() {
+
+        if(!_pieceVerifier)
+            return;
+
+        _pieceVerifier->takeResults(_verifiedPieces);
+
+        for(const PieceVerifier::Result & result : _verifiedPieces) {
+
+            // As for pieceValidated, nobody is owed payment once download is stopped, or reset as all sellers are gone
+            if(_session->_state == SessionState::stopped || _state != BuyingState::downloading)
+                break;
+
+            // Seller which sent piece may be gone, in which case piece was deassigned,
+            // and it may since have been assigned to, and arrived from, another seller
+            if(_pieces.state(result.index) != PieceState::being_validated_and_stored || !_pieces.assignedTo(result.index, result.connection))
+                continue;
+
+            auto itr = _sellers.find(result.connection);
+
+            if(itr == _sellers.end() || itr->second.isGone())
+                continue;
+
+            // Handle of a removed seller may since have been reused by a new seller, which is owed nothing for this piece
+            if(itr->second.generation() != result.generation)
+                continue;
+
+            detail::Seller<ConnectionIdType> & s = itr->second;
+
+            // Client stores valid piece before seller is paid, as without verifier, and may still reject it
+            if(result.valid && _fullPieceArrived(s.connection()->connectionId(), result.data, result.index))
+                validPieceReceivedOnConnection(s, result.index);
+            else
+                invalidPieceReceivedOnConnection(s, result.index);
+        }
+
+        // Do not keep piece data alive until next call
+        _verifiedPieces.clear();
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::pieceValidated(const ConnectionIdType & id, int index, bool wasValid) {
+
+        if(index < 0 || index >= (int)_pieces.size())
+            throw exception::InvalidPieceRange(index, index + 1);
+
+        // Seller may have been removed, or download stopped, while validating,
+        // in which case the piece was deassigned and nobody is owed payment.
+        // Pausing keeps sellers, so a piece validated while paused is still paid for.
+        if(_session->_state == SessionState::stopped || _state != BuyingState::downloading)
+            return;
+
+        auto connection = _session->find(id);
+
+        if(connection == _session->_connections.cend())
+            return;
+
+        auto itr = _sellers.find(connection->first);
+
+        if(itr == _sellers.end() || itr->second.isGone())
+            return;
+
+        if(_pieces.state(index) != PieceState::being_validated_and_stored || !_pieces.assignedTo(index, itr->first))
+            throw exception::StateIncompatibleOperation("piece is not being validated for given connection.");
+
+        if(wasValid)
+            validPieceReceivedOnConnection(itr->second, index);
+        else
+            invalidPieceReceivedOnConnection(itr->second, index);
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::setPiecePriority(int begin, int end, PiecePriority priority) {
+
+        if(begin < 0 || begin > end || end > (int)_pieces.size())
+            throw exception::InvalidPieceRange(begin, end);
+
+        if(priority > MaxPiecePriority)
+            throw exception::InvalidPiecePriority(priority);
+
+        _priorityIndex.setPriority(begin, end, priority);
+    }
+
+    template <class ConnectionIdType>
+    PiecePriority Buying<ConnectionIdType>::piecePriority(int index) const {
+
+        if(index < 0 || index >= (int)_pieces.size())
+            throw exception::InvalidPieceRange(index, index + 1);
+
+        return _priorityIndex.priority(index);
+    }
+
+    template <class ConnectionIdType>
+    BuyingCheckpoint Buying<ConnectionIdType>::checkpoint() const {
+
+        BuyingCheckpoint checkpoint;
+
+        checkpoint.numberOfPieces = _pieces.size();
+        checkpoint.terms = _terms;
+        checkpoint.speedTests = _knownSpeedTests;
+
+        checkpoint.downloaded = _pieces.piecesInState(PieceState::downloaded);
+
+        // Runs of pieces with same non default priority
+        for(uint i = 0;i < _pieces.size();) {
+
+            PiecePriority priority = _priorityIndex.priority(i);
+
+            uint end = i + 1;
+
+            while(end < _pieces.size() && _priorityIndex.priority(end) == priority)
+                end++;
+
+            if(priority != DefaultPiecePriority)
+                checkpoint.priorities.push_back(BuyingCheckpoint::PriorityRange(i, end, priority));
+
+            i = end;
+        }
+
+        return checkpoint;
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::restore(const BuyingCheckpoint & checkpoint) {
+
+        // Pieces may already be assigned to sellers
+        if(_state == BuyingState::downloading)
+            throw exception::StateIncompatibleOperation("cannot restore checkpoint while downloading.");
+
+        if(checkpoint.numberOfPieces != _pieces.size() || checkpoint.downloaded.size() != _pieces.size())
+            throw exception::InvalidCheckpoint("number of pieces does not match torrent");
+
+        // Whole checkpoint is checked before anything is changed, so a bad one leaves session as it was
+        for(const BuyingCheckpoint::PriorityRange & range : checkpoint.priorities) {
+
+            if(range.begin > range.end || range.end > _pieces.size())
+                throw exception::InvalidCheckpoint("priority range out of bounds");
+
+            if(range.priority > MaxPiecePriority)
+                throw exception::InvalidCheckpoint("priority out of range");
+        }
+
+        for(auto i = checkpoint.downloaded.find_first();i != PieceAvailability::npos;i = checkpoint.downloaded.find_next(i))
+            pieceDownloaded(i);
+
+        _priorityIndex.setPriority(0, _pieces.size(), DefaultPiecePriority);
+
+        for(const BuyingCheckpoint::PriorityRange & range : checkpoint.priorities)
+            setPiecePriority(range.begin, range.end, range.priority);
+
+        for(const auto & mapping : checkpoint.speedTests)
+            rememberSpeedTest(mapping.first, mapping.second);
+
+        if(checkpoint.terms != _terms) {
+
+            // Only a started session sends invitations
+            if(_session->_state == SessionState::started)
+                updateTerms(checkpoint.terms);
+            else {
+
+                for(auto itr : _session->_connections)
+                    itr.second->processEvent(protocol_statemachine::event::UpdateTerms<protocol_wire::BuyerTerms>(checkpoint.terms));
+
+                _terms = checkpoint.terms;
+            }
+        }
     }
 
     template <class ConnectionIdType>
@@ -428,19 +846,65 @@ namespace detail {
         // Generate statuses of all sellers
         std::map<ConnectionIdType, status::Seller<ConnectionIdType>> sellerStatuses;
 
-        for(auto mapping : _sellers) {
+        for(const auto & mapping : _sellers) {
             // skip sellers that are no longer around
             if(mapping.second.isGone())
                 continue;
 
-            sellerStatuses.insert(std::make_pair(mapping.first, mapping.second.status()));
+            sellerStatuses.insert(std::make_pair(mapping.second.connection()->connectionId(), mapping.second.status()));
         }
 
         return status::Buying<ConnectionIdType>(_state,
                                                 _terms,
                                                 sellerStatuses,
                                                 //_contractTx,
-                                                pieceStatuses);
+                                                pieceStatuses,
+                                                status::PieceCounts(_pieces.numberOfPieces(PieceState::unassigned),
+                                                                    _pieces.numberOfPieces(PieceState::being_downloaded),
+                                                                    _pieces.numberOfPieces(PieceState::being_validated_and_stored),
+                                                                    _pieces.numberOfPieces(PieceState::downloaded)));
+    }
+
+    template <class ConnectionIdType>
+    uint64_t Buying<ConnectionIdType>::piecesMemoryUsage() const {
+        return _pieces.memoryUsage() +
+               detail::memoryUsage(_unassigned) +
+               detail::memoryUsage(_candidates) +
+               detail::memoryUsage(_beingDownloaded) +
+               detail::memoryUsage(_playbackOffsets) +
+               _priorityIndex.memoryUsage();
+    }
+
+    template <class ConnectionIdType>
+    uint64_t Buying<ConnectionIdType>::sellersMemoryUsage() const {
+
+        // Sellers are not erased when gone, so all are counted
+        uint64_t usage = _sellers.size() * (detail::TreeNodeOverhead + sizeof(typename detail::ConnectionHandles<ConnectionIdType>::Handle));
+
+        for(const auto & mapping : _sellers)
+            usage += mapping.second.memoryUsage();
+
+        return usage;
+    }
+
+    template <class ConnectionIdType>
+    std::vector<status::Piece<ConnectionIdType>> Buying<ConnectionIdType>::pieceStatus(int begin, int end) const {
+
+        if(begin < 0 || begin > end || end > (int)_pieces.size())
+            throw exception::InvalidPieceRange(begin, end);
+
+        std::vector<status::Piece<ConnectionIdType>> statuses;
+        statuses.reserve(end - begin);
+
+        for(int i = begin;i < end;i++)
+            statuses.push_back(status::Piece<ConnectionIdType>(i, _pieces.state(i), _pieces.connectionId(i), _pieces.pieceSize(i)));
+
+        return statuses;
+    }
+
+    template <class ConnectionIdType>
+    PieceAvailability Buying<ConnectionIdType>::piecesInState(PieceState state) const {
+        return _pieces.piecesInState(state);
     }
 
     template <class ConnectionIdType>
@@ -463,7 +927,7 @@ namespace detail {
 
            auto id = m.first;
 
-           auto it = _session->_connections.find(id);
+           auto it = _session->find(id);
 
            if(it == _session->_connections.cend()) {
 
@@ -514,12 +978,20 @@ namespace detail {
         // has to be done before starting to assign pieces to sellers
         _state = BuyingState::downloading;
 
+        // Duplicate request budget is per download
+        _duplicateRequestsMade = 0;
+
+        // Sellers still waiting for a speed test are no longer going to be invited,
+        // tests already running are left to complete
+        _speedTestQueue.clear();
+        _speedTestQueuePrice.clear();
+
         /// Try to announce to each prospective seller
         for(auto m : peerToStartDownloadInformationMap) {
 
             auto id = m.first;
 
-            auto it = _session->_connections.find(id);
+            auto it = _session->find(id);
 
             // test above =>
             assert(it != _session->_connections.cend());
@@ -527,7 +999,7 @@ namespace detail {
             auto c = it->second;
 
             // Create sellers
-            _sellers[id] = detail::Seller<ConnectionIdType>(c);
+            _sellers[it->first] = detail::Seller<ConnectionIdType>(c, _numberOfSellersCreated++);
 
             // Send message to peer
             StartDownloadConnectionInformation inf = m.second;
@@ -537,8 +1009,11 @@ namespace detail {
                                                                            inf.buyerFinalPkHash,
                                                                            inf.value));
 
+            // Payor was set up by announcing the contract
+            c->resetPaymentCountersFromPayor();
+
             // Assign the first piece to this peer
-            tryToAssignAndRequestPieces(_sellers[id]);
+            tryToAssignAndRequestPieces(_sellers[it->first]);
         }
 
         /////////////////////////
@@ -547,37 +1022,61 @@ namespace detail {
     }
 
     template <class ConnectionIdType>
-    void Buying<ConnectionIdType>::sendInvitations() const {
+    void Buying<ConnectionIdType>::sendInvitations() {
 
       assert(_session->_state == SessionState::started);
       assert(_state == BuyingState::sending_invitations);
 
-      for(auto mapping : _session->_connections) {
+      _sellerOrderBook.compatibleSellers(_terms, 0, _sellersToInvite);
 
-          detail::Connection<ConnectionIdType> * c = mapping.second;
+      for(const ConnectionIdType & id : _sellersToInvite) {
 
-          maybeInviteSeller(c);
+          // Seller may be gone due to an earlier invitation, e.g. if disconnected by client when sending it
+          if(!_session->hasConnection(id))
+              continue;
+
+          maybeInviteSeller(_session->get(id));
       }
 
     }
 
     template <class ConnectionIdType>
-    void Buying<ConnectionIdType>::maybeInviteSeller(detail::Connection<ConnectionIdType> * c) const {
+    void Buying<ConnectionIdType>::maybeInviteSeller(detail::Connection<ConnectionIdType> * c) {
 
         assert(_session->_state == SessionState::started);
         assert(_state == BuyingState::sending_invitations);
 
         // Check that this peer is seller,
-        protocol_statemachine::AnnouncedModeAndTerms a = c->announcedModeAndTermsFromPeer();
+        const protocol_wire::SellerTerms * sellerTerms = _sellerOrderBook.terms(c->connectionId());
 
         // Do not send invitations if peer is not announcing sell mode or has incompatible terms
-        if(a.modeAnnounced() != protocol_statemachine::ModeAnnounced::sell || !_terms.satisfiedBy(a.sellModeTerms())) {
+        if(sellerTerms == nullptr || !_terms.satisfiedBy(*sellerTerms)) {
           return;
         }
 
+        // Peer which passed a speed test before checkpoint was restored is not tested again
+        if (_session->_speedTestPolicy.isEnabled() && !c->hasStartedSpeedTest() && !_knownSpeedTests.empty()) {
+
+            auto itr = _knownSpeedTests.find(IdToString(c->connectionId()));
+
+            if(itr != _knownSpeedTests.end() &&
+               (!_session->_speedTestPolicy.disconnectIfSlow() || itr->second <= _session->_speedTestPolicy.maxTimeToRespond()))
+                c->restoreSpeedTest(itr->second);
+        }
+
         // Does seller need to complete a speed test to be invited?
         if (_session->_speedTestPolicy.isEnabled() && !c->hasCompletedSpeedTest()) {
             if (c->hasStartedSpeedTest()) return;
+
+            // Tests running at the same time compete for our bandwidth, so wait for a slot
+            if (!canStartSpeedTest()) {
+                queueSpeedTest(c->connectionId(), sellerTerms->minPrice());
+                return;
+            }
+
+            dequeueSpeedTest(c->connectionId());
+            _speedTestsRunning[c->connectionId()] = _session->_getTime();
+
             c->startingSpeedTest(); // record starting time
             c->processEvent(protocol_statemachine::event::TestSellerSpeed(_session->_speedTestPolicy.payloadSize()));
             return;
@@ -588,6 +1087,107 @@ namespace detail {
         std::cout << "Invited: " << IdToString(c->connectionId()) << std::endl;
     }
 
+    template <class ConnectionIdType>
+    bool Buying<ConnectionIdType>::canStartSpeedTest() const {
+
+        unsigned int maxConcurrentTests = _session->_speedTestPolicy.maxConcurrentTests();
+
+        return maxConcurrentTests == 0 || _speedTestsRunning.size() < maxConcurrentTests;
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::queueSpeedTest(const ConnectionIdType & id, uint64_t price) {
+
+        dequeueSpeedTest(id);
+
+        _speedTestQueue.insert(std::make_pair(price, id));
+        _speedTestQueuePrice[id] = price;
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::dequeueSpeedTest(const ConnectionIdType & id) {
+
+        auto itr = _speedTestQueuePrice.find(id);
+
+        if(itr == _speedTestQueuePrice.end())
+            return;
+
+        _speedTestQueue.erase(std::make_pair(itr->second, id));
+        _speedTestQueuePrice.erase(itr);
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::speedTestFinished(const ConnectionIdType & id) {
+        _speedTestsRunning.erase(id);
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::startQueuedSpeedTests() {
+
+        if(_session->_state != SessionState::started || _state != BuyingState::sending_invitations)
+            return;
+
+        while(canStartSpeedTest() && !_speedTestQueue.empty()) {
+
+            ConnectionIdType id = _speedTestQueue.begin()->second;
+
+            dequeueSpeedTest(id);
+
+            // Connections are dequeued when removed
+            assert(_session->hasConnection(id));
+
+            // Checks terms again, as seller may have changed them while waiting
+            maybeInviteSeller(_session->get(id));
+        }
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::expireSpeedTests() {
+
+        std::chrono::high_resolution_clock::time_point now = _session->_getTime();
+
+        std::vector<ConnectionIdType> expired;
+
+        for(const auto & mapping : _speedTestsRunning)
+            if(now - mapping.second > _session->_speedTestPolicy.maxTimeToRespond())
+                expired.push_back(mapping.first);
+
+        for(const ConnectionIdType & id : expired) {
+
+            if(_session->_speedTestPolicy.disconnectIfSlow())
+                removeConnection(id, DisconnectCause::seller_failed_speed_test);
+            else
+                speedTestFinished(id); // seller is still invited if payload arrives later
+        }
+
+        startQueuedSpeedTests();
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::clearSpeedTests() {
+        _speedTestQueue.clear();
+        _speedTestQueuePrice.clear();
+        _speedTestsRunning.clear();
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::rememberSpeedTest(const std::string & id, const std::chrono::milliseconds & time) {
+
+        auto result = _knownSpeedTests.insert(std::make_pair(id, time));
+
+        if(!result.second) {
+            result.first->second = time;
+            return;
+        }
+
+        _knownSpeedTestsOrder.push_back(id);
+
+        if(_knownSpeedTestsOrder.size() > _maxKnownSpeedTests) {
+            _knownSpeedTests.erase(_knownSpeedTestsOrder.front());
+            _knownSpeedTestsOrder.pop_front();
+        }
+    }
+
     template <class ConnectionIdType>
     int Buying<ConnectionIdType>::tryToAssignAndRequestPieces(detail::Seller<ConnectionIdType> & s) {
 
@@ -595,26 +1195,63 @@ namespace detail {
         assert(_state == BuyingState::downloading);
         assert(!s.isGone());
 
+        // Wait for validator to catch up
+        if(s.numberOfPiecesAwaitingValidation() >= _maxPiecesAwaitingValidation)
+            return 0;
+
+        std::chrono::high_resolution_clock::time_point now = _session->_getTime();
+
         int totalNewRequests = 0;
-        int concurrentRequests = s.piecesAwaitingArrival().size();
+        int concurrentRequests = s.numberOfPiecesAwaitingArrival();
+        int window = requestWindow(s);
 
-        while(concurrentRequests < _maxConcurrentRequests) {
+        while(concurrentRequests < window) {
 
           // Try to find index of next unassigned piece
-          int pieceIndex;
+          int pieceIndex = pickNextPiece(s);
 
-          try {
-              pieceIndex = this->_pickNextPieceMethod(&_pieces);
-          } catch(const std::runtime_error & e) {
-              // No unassigned piece was found
+          // No unassigned piece was found
+          if(pieceIndex < 0)
               break;
-          }
 
           // Assign piece to seller
-          _pieces[pieceIndex].assigned(s.connection()->connectionId());
+          _pieces.assigned(pieceIndex, s.connection()->handle());
+          _unassigned.reset(pieceIndex);
+          _priorityIndex.exclude(pieceIndex);
+          _beingDownloaded.set(pieceIndex);
 
           // Request piece from seller
-          concurrentRequests = s.requestPiece(pieceIndex);
+          concurrentRequests = s.requestPiece(pieceIndex, now);
+
+          totalNewRequests++;
+        }
+
+        // Use remaining capacity to rescue pieces likely to miss their playback deadline
+        while(_streaming && concurrentRequests < window && rescueAllowed(now)) {
+
+          int pieceIndex = pickAtRiskPiece(s);
+
+          if(pieceIndex < 0)
+              break;
+
+          _recentRescues.push_back(now);
+
+          concurrentRequests = s.requestPiece(pieceIndex, now);
+
+          totalNewRequests++;
+        }
+
+        // Use remaining capacity to also ask for pieces other sellers are still delivering
+        while(concurrentRequests < window) {
+
+          int pieceIndex = pickEndgamePiece(s);
+
+          if(pieceIndex < 0)
+              break;
+
+          _duplicateRequestsMade++;
+
+          concurrentRequests = s.requestPiece(pieceIndex, now);
 
           totalNewRequests++;
         }
@@ -622,6 +1259,289 @@ namespace detail {
         return totalNewRequests;
     }
 
+    template <class ConnectionIdType>
+    int Buying<ConnectionIdType>::pickNextPiece(const detail::Seller<ConnectionIdType> & s) {
+
+        if(_streaming)
+            return pickStreamingPiece(s);
+
+        const PieceAvailability & has = s.connection()->pieceAvailability();
+
+        // Seller without advertised availability is assumed to have every piece
+        if(has.empty()) {
+
+            // Once priorities are set they decide, rather than the client supplied method
+            if(_priorityIndex.hasPriorities())
+                return _priorityIndex.top();
+
+            try {
+                return this->_pickNextPieceMethod(&_pieces);
+            } catch(const std::runtime_error & e) {
+                return -1;
+            }
+        }
+
+        // Unassigned piece seller has with highest priority, then rarest, lowest index breaks ties
+        return _priorityIndex.top(has);
+    }
+
+    template <class ConnectionIdType>
+    int Buying<ConnectionIdType>::pickStreamingPiece(const detail::Seller<ConnectionIdType> & s) {
+
+        const PieceAvailability & has = s.connection()->pieceAvailability();
+
+        // Unassigned pieces seller has
+        _candidates = _unassigned;
+
+        if(!has.empty())
+            _candidates &= has;
+
+        auto from = [this](int i) {
+            return i == 0 ? _candidates.find_first() : _candidates.find_next(i - 1);
+        };
+
+        int end = _playhead + _playbackOffsets.size();
+
+        // Time critical pieces, in playback order
+        for(auto i = from(_playhead);i != PieceAvailability::npos && (int)i < end;i = _candidates.find_next(i))
+            if(canMeetDeadline(s, i))
+                return i;
+
+        // Lookahead after critical window
+        auto i = from(end);
+
+        if(i != PieceAvailability::npos)
+            return i;
+
+        // Pieces before playhead, in case of seeking back
+        i = _candidates.find_first();
+
+        if(i != PieceAvailability::npos && (int)i < _playhead)
+            return i;
+
+        return -1;
+    }
+
+    template <class ConnectionIdType>
+    int Buying<ConnectionIdType>::pickAtRiskPiece(const detail::Seller<ConnectionIdType> & s) const {
+
+        // Unmeasured seller cannot be expected to do better
+        if(!s.hasDeliveredPiece())
+            return -1;
+
+        const PieceAvailability & has = s.connection()->pieceAvailability();
+        const boost::circular_buffer<int> & requested = s.piecesAwaitingArrival();
+        std::chrono::high_resolution_clock::time_point now = _session->_getTime();
+        auto arrival = s.expectedArrival(s.numberOfPiecesAwaitingArrival(), now);
+
+        int end = _playhead + _playbackOffsets.size();
+
+        for(int i = _playhead;i < end;i++) {
+
+            if(!_beingDownloaded.test(i) || (!has.empty() && !has.test(i)))
+                continue;
+
+            // Given seller would be too late as well
+            if(arrival > deadline(i))
+                continue;
+
+            // Already requested from given seller, or from more than the one it was assigned to
+            if(std::find(requested.begin(), requested.end(), i) != requested.end() || numberOfOtherSellersRequesting(i, &s) != 1)
+                continue;
+
+            auto itr = _sellers.find(_pieces.handle(i));
+
+            if(itr == _sellers.end() || itr->second.isGone() || !itr->second.hasDeliveredPiece())
+                continue;
+
+            const detail::Seller<ConnectionIdType> & assigned = itr->second;
+            const boost::circular_buffer<int> & queue = assigned.piecesAwaitingArrival();
+
+            int position = std::find(queue.begin(), queue.end(), i) - queue.begin();
+
+            if(assigned.expectedArrival(position, now) > deadline(i))
+                return i;
+        }
+
+        return -1;
+    }
+
+    template <class ConnectionIdType>
+    bool Buying<ConnectionIdType>::rescueAllowed(std::chrono::high_resolution_clock::time_point now) {
+
+        // Rescues older than a critical window no longer count
+        while(!_recentRescues.empty() && now - _recentRescues.front() >= _criticalWindow)
+            _recentRescues.pop_front();
+
+        // Each rescue may cost an extra payment
+        return !_recentRescues.full();
+    }
+
+    template <class ConnectionIdType>
+    bool Buying<ConnectionIdType>::canMeetDeadline(const detail::Seller<ConnectionIdType> & s, int index) const {
+
+        if(!s.hasDeliveredPiece())
+            return true;
+
+        if(s.expectedArrival(s.numberOfPiecesAwaitingArrival(), _session->_getTime()) <= deadline(index))
+            return true;
+
+        // Someone has to fetch urgent pieces, so best seller always may
+        for(const auto & mapping : _sellers)
+            if(mapping.second.score() > s.score())
+                return false;
+
+        return true;
+    }
+
+    template <class ConnectionIdType>
+    std::chrono::high_resolution_clock::time_point Buying<ConnectionIdType>::deadline(int index) const {
+        assert(index >= _playhead && index < _playhead + (int)_playbackOffsets.size());
+
+        std::chrono::duration<double> offset(_playbackOffsets[index - _playhead]);
+
+        return _playheadUpdatedAt + std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(offset);
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::updateCriticalWindow() {
+
+        _playbackOffsets.clear();
+
+        double offset = 0;
+
+        for(int i = _playhead;i < (int)_pieces.size() && offset < _criticalWindow.count();i++) {
+            _playbackOffsets.push_back(offset);
+            offset += (double)_pieces.pieceSize(i) / _bytesPerSecond;
+        }
+    }
+
+    template <class ConnectionIdType>
+    int Buying<ConnectionIdType>::requestWindow(const detail::Seller<ConnectionIdType> & s) const {
+
+        if(!s.hasDeliveredPiece())
+            return _maxConcurrentRequests;
+
+        double best = 0;
+
+        for(const auto & mapping : _sellers)
+            best = std::max(best, mapping.second.score());
+
+        if(best <= 0)
+            return _maxConcurrentRequests;
+
+        return std::max(1, (int)std::ceil(_maxConcurrentRequests * s.score() / best));
+    }
+
+    template <class ConnectionIdType>
+    int Buying<ConnectionIdType>::pickEndgamePiece(const detail::Seller<ConnectionIdType> & s) const {
+
+        const EndgamePolicy & policy = _session->_endgamePolicy;
+
+        if(!policy.isEnabled() || _duplicateRequestsMade >= policy.maxDuplicatePayments())
+            return -1;
+
+        // Endgame starts when only a few pieces are left being downloaded
+        if(_beingDownloaded.none() || _beingDownloaded.count() > policy.maxPiecesRemaining())
+            return -1;
+
+        const PieceAvailability & has = s.connection()->pieceAvailability();
+        const boost::circular_buffer<int> & requested = s.piecesAwaitingArrival();
+
+        // Prefer piece fewest sellers have been asked for
+        int best = -1;
+        uint bestRequests = 0;
+
+        for(auto i = _beingDownloaded.find_first();i != PieceAvailability::npos;i = _beingDownloaded.find_next(i)) {
+
+            if(!has.empty() && !has.test(i))
+                continue;
+
+            // Already requested from this seller
+            if(std::find(requested.begin(), requested.end(), (int)i) != requested.end())
+                continue;
+
+            uint requests = numberOfOtherSellersRequesting(i, &s);
+
+            if(requests >= policy.maxRequestsPerPiece())
+                continue;
+
+            if(best < 0 || requests < bestRequests) {
+                best = i;
+                bestRequests = requests;
+            }
+        }
+
+        return best;
+    }
+
+    template <class ConnectionIdType>
+    uint Buying<ConnectionIdType>::numberOfOtherSellersRequesting(int index, const detail::Seller<ConnectionIdType> * seller) const {
+
+        uint count = 0;
+
+        for(const auto & mapping : _sellers) {
+
+            const detail::Seller<ConnectionIdType> & s = mapping.second;
+
+            if(&s == seller || s.isGone())
+                continue;
+
+            const boost::circular_buffer<int> & requested = s.piecesAwaitingArrival();
+
+            if(std::find(requested.begin(), requested.end(), index) != requested.end())
+                count++;
+        }
+
+        return count;
+    }
+
+    template <class ConnectionIdType>
+    detail::Seller<ConnectionIdType> * Buying<ConnectionIdType>::otherSellerRequesting(int index, const detail::Seller<ConnectionIdType> & seller) {
+
+        for(auto & mapping : _sellers) {
+
+            detail::Seller<ConnectionIdType> & s = mapping.second;
+
+            if(&s == &seller || s.isGone())
+                continue;
+
+            const boost::circular_buffer<int> & requested = s.piecesAwaitingArrival();
+
+            if(std::find(requested.begin(), requested.end(), index) != requested.end())
+                return &s;
+        }
+
+        return nullptr;
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::tryToRequestFromIdleSeller(const ConnectionIdType & id) {
+
+        if(_session->_state != SessionState::started || _state != BuyingState::downloading)
+            return;
+
+        auto itr = _sellers.find(_session->get(id)->handle());
+
+        if(itr == _sellers.end())
+            return;
+
+        detail::Seller<ConnectionIdType> & s = itr->second;
+
+        if(!s.isGone() && s.numberOfPiecesAwaitingArrival() == 0)
+            tryToAssignAndRequestPieces(s);
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::addAvailability(const PieceAvailability & availability) {
+        _priorityIndex.addAvailability(availability);
+    }
+
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::removeAvailability(const PieceAvailability & availability) {
+        _priorityIndex.removeAvailability(availability);
+    }
+
     template<class ConnectionIdType>
     typename detail::ConnectionMap<ConnectionIdType>::const_iterator Buying<ConnectionIdType>::removeConnection(const ConnectionIdType & id, DisconnectCause cause) {
 
@@ -630,21 +1550,28 @@ namespace detail {
 
         // If this is the connection of a seller,
         // we have to deal with that.
-        auto itr = _sellers.find(id);
+        auto itr = _sellers.find(_session->get(id)->handle());
 
         if(itr != _sellers.cend()) {
 
             detail::Seller<ConnectionIdType> & s = itr->second;
 
             // It is possible to find a seller in the "gone" state that we have previoulsy removed.
-            // This happens when the connection times out and is later re-establish. The connection will have the
-            // same connection id (because it is the same peer)
+            // This happens when its handle has been reused by a connection which is not a seller.
             if(!s.isGone()) {
               // Remove
               removeSeller(s);
             }
         }
 
+        // Peer no longer contributes to availability
+        removeAvailability(_session->get(id)->pieceAvailability());
+
+        dequeueSpeedTest(id);
+        speedTestFinished(id);
+
+        _sellerOrderBook.remove(id);
+
         // Destroy connection - important todo before notifying client
         auto it = _session->destroyConnection(id);
 
@@ -661,14 +1588,27 @@ namespace detail {
         // we must be downloading or just finish downloading
         assert(_state == BuyingState::downloading || _state == BuyingState::download_completed);
 
+        // Only during endgame or streaming may another seller already have been asked for a piece
+        bool duplicatesRequested = _streaming || _duplicateRequestsMade > 0;
+
         // If this seller has assigned piecees, then we must unassign them
         for(uint i = 0;i < _pieces.size();i++) {
-            detail::Piece<ConnectionIdType> & piece = _pieces[i];
 
-            if (piece.connectionId() != s.connection()->connectionId()) continue;
+            if (!_pieces.assignedTo(i, s.connection()->handle())) continue;
 
             // Deassign the piece
-            piece.deAssign();
+            _pieces.deAssign(i);
+            _beingDownloaded.reset(i);
+
+            detail::Seller<ConnectionIdType> * other = duplicatesRequested ? otherSellerRequesting(i, s) : nullptr;
+
+            if(other) {
+                _pieces.assigned(i, other->connection()->handle());
+                _beingDownloaded.set(i);
+            } else {
+                _unassigned.set(i);
+                _priorityIndex.include(i);
+            }
         }
 
         // Mark as seller as gone, but is not removed from _sellers map
@@ -682,7 +1622,7 @@ namespace detail {
         assert(_session->_state == SessionState::started);
 
         // Find any seller that is not in gone state
-        auto seller = find_if(_sellers.begin(), _sellers.end(), [] ( std::pair<ConnectionIdType, detail::Seller<ConnectionIdType>> mapping) {
+        auto seller = find_if(_sellers.begin(), _sellers.end(), [] (const typename decltype(_sellers)::value_type & mapping) {
           return !mapping.second.isGone();
         });
 
@@ -697,13 +1637,24 @@ namespace detail {
         // Transition to sending invitations state
         _state = BuyingState::sending_invitations;
 
-        // Clear sellers
+        // Clear sellers, and with them any duplicate requests
         _sellers.clear();
+        _duplicateRequestsMade = 0;
+        _recentRescues.clear();
 
         // Send invitations to all connections
         sendInvitations();
     }
 
+    template <class ConnectionIdType>
+    void Buying<ConnectionIdType>::updateSellerOrderBook(const ConnectionIdType & id, const protocol_statemachine::AnnouncedModeAndTerms & a) {
+
+        if(a.modeAnnounced() == protocol_statemachine::ModeAnnounced::sell)
+            _sellerOrderBook.update(id, a.sellModeTerms());
+        else
+            _sellerOrderBook.remove(id);
+    }
+
     template <class ConnectionIdType>
     void Buying<ConnectionIdType>::politeSellerCompensation() {
 
@@ -712,19 +1663,12 @@ namespace detail {
         // NB: paying for only requested piece can lead to our payment
         // being dropped by peer state machine if it has not yet sent
         // the piece, but its worth trying.
-        for(auto itr : _sellers) {
+        for(auto & itr : _sellers) {
 
             detail::Seller<ConnectionIdType> & s = itr.second;
 
-            if(s.isPossiblyOwedPayment()) {
-              while(s.piecesAwaitingArrival().size() > 0) {
-                s.fullPieceArrived();
-              }
-
-              while(s.numberOfPiecesAwaitingValidation() > 0) {
-                s.pieceWasValid();
-              }
-            }
+            if(s.isPossiblyOwedPayment())
+                s.payForOutstandingPieces();
         }
     }
 
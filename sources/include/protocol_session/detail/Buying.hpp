@@ -12,12 +12,22 @@
 #include <protocol_session/detail/Connection.hpp>
 #include <protocol_session/Callbacks.hpp>
 #include <protocol_session/BuyingState.hpp>
-#include <protocol_session/detail/Piece.hpp>
+#include <protocol_session/PieceAvailability.hpp>
+#include <protocol_session/PiecePriority.hpp>
+#include <protocol_session/PieceVerifier.hpp>
+#include <protocol_session/BuyingCheckpoint.hpp>
+#include <protocol_session/detail/PieceTable.hpp>
+#include <protocol_session/detail/PriorityIndex.hpp>
 #include <protocol_session/detail/Seller.hpp>
+#include <protocol_session/detail/SellerOrderBook.hpp>
 #include <protocol_wire/protocol_wire.hpp>
 #include <CoinCore/CoinNodeData.h>
 
+#include <boost/circular_buffer.hpp>
+
+#include <deque>
 #include <vector>
+#include <set>
 
 namespace joystream {
 namespace protocol_statemachine {
@@ -101,29 +111,165 @@ public:
     // a regitered connection. Could be non-joystream peers, or something out of bounds.
     void pieceDownloaded(int);
 
+    // Peer on given connection has given pieces, replaces any prior availability
+    void setPieceAvailability(const ConnectionIdType &, const PieceAvailability &);
+
+    // Peer on given connection has acquired given piece
+    void peerHasPiece(const ConnectionIdType &, int);
+
+    // Disconnects sellers which on average take longer than given time to deliver a piece, as measured
+    // over at least a few pieces. The best seller is always kept, so downloading can continue, while
+    // pieces of those disconnected are reassigned to remaining sellers.
+    // Disconnected sellers are not replaced, as the contract is already announced, so their outputs
+    // in it go unused until download is restarted, e.g. after all sellers are gone.
+    void disconnectSlowSellers(const std::chrono::duration<double> &);
+
+    // Hand arriving pieces to given validator rather than FullPieceArrived callback,
+    // an empty validator restores synchronous validation
+    void setPieceValidator(const ValidatePiece<ConnectionIdType> &);
+
+    // Result of validating piece with given index which arrived on given connection, for pieces handed to validator
+    void pieceValidated(const ConnectionIdType &, int, bool);
+
+    // Hand arriving pieces to given verifier rather than validator, an empty verifier restores synchronous validation
+    void setPieceVerifier(const std::shared_ptr<PieceVerifier> &);
+
+    // Apply results completed by verifier since last call, handing valid pieces to FullPieceArrived callback before paying
+    void processVerifiedPieces();
+
+    // Set priority of pieces in range [begin, end)
+    void setPiecePriority(int, int, PiecePriority);
+
+    PiecePriority piecePriority(int) const;
+
+    //// Checkpoint
+
+    BuyingCheckpoint checkpoint() const;
+
+    void restore(const BuyingCheckpoint &);
+
+    //// Streaming
+
+    // Download in playback order from given piece, with playback consuming given number of bytes per second.
+    // Pieces due within given critical window get deadlines, and are assigned to sellers able to meet them.
+    // At most given number of pieces at risk of missing their deadline are requested again within any
+    // critical window of time, each may cost an extra payment.
+    void startStreaming(int, uint64_t, std::chrono::seconds, uint32_t);
+
+    // Playback has reached given piece
+    void updatePlayhead(int);
+
+    // Return to order decided by piece picker
+    void stopStreaming();
+
     // Update terms
     void updateTerms(const protocol_wire::BuyerTerms &);
 
     // Status of Buying
     status::Buying<ConnectionIdType> status() const;
 
+    // Status of pieces in range [begin, end)
+    std::vector<status::Piece<ConnectionIdType>> pieceStatus(int, int) const;
+
+    // Bitmap of pieces in given state
+    PieceAvailability piecesInState(PieceState) const;
+
+    // Bytes held by piece table, bitmaps and index for picking pieces, and by sellers
+    uint64_t piecesMemoryUsage() const;
+    uint64_t sellersMemoryUsage() const;
+
     protocol_wire::BuyerTerms terms() const;
 
     void setPickNextPieceMethod(const PickNextPieceMethod<ConnectionIdType> & pickNextPieceMethod);
 
 private:
 
-    void sendInvitations () const;
+    // Invites compatible sellers in order book, cheapest first
+    void sendInvitations ();
+
+    void maybeInviteSeller(detail::Connection<ConnectionIdType> *);
+
+    //// Speed test scheduling
+
+    // Whether another speed test may be started under speed test policy
+    bool canStartSpeedTest() const;
+
+    // Queue seller with given price for a speed test, replaces any earlier entry
+    void queueSpeedTest(const ConnectionIdType &, uint64_t);
+    void dequeueSpeedTest(const ConnectionIdType &);
 
-    void maybeInviteSeller(detail::Connection<ConnectionIdType> *) const;
+    // Test is no longer taking up a slot
+    void speedTestFinished(const ConnectionIdType &);
+
+    // Start queued tests while slots are available
+    void startQueuedSpeedTests();
+
+    // Frees slots of tests past their deadline, disconnecting seller if policy says so
+    void expireSpeedTests();
+
+    // Drop queued and running tests
+    void clearSpeedTests();
+
+    // Remember time given peer took to pass speed test, forgetting the peer remembered first when there are too many
+    void rememberSpeedTest(const std::string &, const std::chrono::milliseconds &);
 
     void resetIfAllSellersGone ();
 
+    // Keep order book in line with given announcement of peer
+    void updateSellerOrderBook(const ConnectionIdType &, const protocol_statemachine::AnnouncedModeAndTerms &);
+
     //// Assigning pieces
 
     // Tries to assign pieces to given seller
     int tryToAssignAndRequestPieces(detail::Seller<ConnectionIdType> &);
 
+    // Index of next piece to assign to given seller, or -1 if there is none.
+    // Sellers which advertised availability get the highest priority and then rarest unassigned piece they have,
+    // otherwise the highest priority piece, or if no priorities have been set, the client supplied method decides.
+    int pickNextPiece(const detail::Seller<ConnectionIdType> &);
+
+    // Index of piece for given seller when streaming: the first unassigned piece in the critical window it
+    // can deliver in time, otherwise the first unassigned piece after the window, or -1 if there is none
+    int pickStreamingPiece(const detail::Seller<ConnectionIdType> &);
+
+    // Index of piece in the critical window likely to miss its deadline with the seller it was assigned to,
+    // which given seller is expected to deliver in time, or -1 if there is none
+    int pickAtRiskPiece(const detail::Seller<ConnectionIdType> &) const;
+
+    // Whether another piece at risk may be requested at given time, see startStreaming
+    bool rescueAllowed(std::chrono::high_resolution_clock::time_point);
+
+    // Whether a new request for given piece to given seller is expected to arrive by its deadline.
+    // Sellers not yet measured, and the best seller, are given the benefit of the doubt.
+    bool canMeetDeadline(const detail::Seller<ConnectionIdType> &, int) const;
+
+    // Deadline of given piece in the critical window
+    std::chrono::high_resolution_clock::time_point deadline(int) const;
+
+    // Recompute critical window from playhead
+    void updateCriticalWindow();
+
+    // Number of concurrent requests given seller is allowed, proportional to its score relative to the best seller.
+    // Sellers not yet scored get the full window, so they can be measured
+    int requestWindow(const detail::Seller<ConnectionIdType> &) const;
+
+    // Index of piece being downloaded from another seller to also request from given seller
+    // during endgame, or -1 if there is none or endgame has not started
+    int pickEndgamePiece(const detail::Seller<ConnectionIdType> &) const;
+
+    // Number of sellers, other than given one, with an outstanding request for given piece
+    uint numberOfOtherSellersRequesting(int, const detail::Seller<ConnectionIdType> *) const;
+
+    // Some seller other than given one with an outstanding request for given piece, if any
+    detail::Seller<ConnectionIdType> * otherSellerRequesting(int, const detail::Seller<ConnectionIdType> &);
+
+    // Given seller may have become able to service a request
+    void tryToRequestFromIdleSeller(const ConnectionIdType &);
+
+    // Update per piece counts to include or exclude given availability
+    void addAvailability(const PieceAvailability &);
+    void removeAvailability(const PieceAvailability &);
+
     //// Utility routines
 
     // Prepare given connection for deletion due to given cause
@@ -153,6 +299,11 @@ private:
     // Callback handlers
     RemovedConnectionCallbackHandler<ConnectionIdType> _removedConnection;
     FullPieceArrived<ConnectionIdType> _fullPieceArrived;
+    ValidatePiece<ConnectionIdType> _validatePiece;
+
+    // Verifier pieces are handed to instead of validator, if any, and buffer reused for its results
+    std::shared_ptr<PieceVerifier> _pieceVerifier;
+    std::vector<PieceVerifier::Result> _verifiedPieces;
     SentPayment<ConnectionIdType> _sentPayment;
     AllSellersGone _allSellersGone;
 
@@ -162,8 +313,8 @@ private:
     // Terms for buying
     protocol_wire::BuyerTerms _terms;
 
-    // Maps connection identifier to connection
-    std::map<ConnectionIdType, detail::Seller<ConnectionIdType>> _sellers;
+    // Sellers by handle of their connection, see ConnectionHandles
+    std::map<typename detail::ConnectionHandles<ConnectionIdType>::Handle, detail::Seller<ConnectionIdType>> _sellers;
 
     // Contract transaction id
     // NB** Must be stored, as signatures are non-deterministic
@@ -172,12 +323,55 @@ private:
     //Coin::Transaction _contractTx;
 
     // Pieces in torrent file
-    std::vector<detail::Piece<ConnectionIdType>> _pieces;
+    detail::PieceTable<ConnectionIdType> _pieces;
+
+    // Pieces in unassigned state, mirrors _pieces
+    PieceAvailability _unassigned;
+
+    // Priorities of pieces, and number of connections having each piece among those
+    // advertising availability, with unassigned pieces as candidates
+    detail::PriorityIndex _priorityIndex;
+
+    // Idle sellers, reused by tick() to assign pieces in order of score
+    std::vector<detail::Seller<ConnectionIdType> *> _idleSellers;
+
+    // Scratch space for intersecting availability, reused to avoid allocating
+    PieceAvailability _candidates;
+
+    // Pieces in being_downloaded state, mirrors _pieces
+    PieceAvailability _beingDownloaded;
+
+    // Number of requests for pieces already requested from another seller in endgame of present download,
+    // see EndgamePolicy. Only non-zero once endgame has started.
+    uint32_t _duplicateRequestsMade;
+
+    //// Streaming
+
+    bool _streaming;
+
+    // Piece being played, and when playback reached it
+    int _playhead;
+    std::chrono::high_resolution_clock::time_point _playheadUpdatedAt;
+
+    uint64_t _bytesPerSecond;
+
+    // Seconds of playback from playhead until each piece in the critical window, starting with playhead
+    std::vector<double> _playbackOffsets;
+
+    // Pieces due within this much playback are time critical
+    std::chrono::seconds _criticalWindow;
+
+    // When the most recent requests for pieces at risk of missing their deadline were made to
+    // another seller, capacity is the number allowed within a critical window of time
+    boost::circular_buffer<std::chrono::high_resolution_clock::time_point> _recentRescues;
 
     // The number of pieces not yet downloaded.
     // Is used to detect when we are done.
     uint32_t _numberOfMissingPieces;
 
+    // Number of sellers created so far, used as generation of next seller
+    uint32_t _numberOfSellersCreated;
+
     // When we started sending out invitations
     // (i.e. entered state StartedState::sending_invitations).
     // Is used to figure out when to start trying to build the contract
@@ -190,11 +384,39 @@ private:
     // The optimum value depends on many factors. It is hardcoded to 4 for now.
     const int _maxConcurrentRequests;
 
+    // Number of pieces a seller must have delivered before being judged by disconnectSlowSellers.
+    // It is hardcoded to 3 for now.
+    const uint64_t _minDeliveriesBeforeJudgingSpeed;
+
+    // Maximum number of pieces from a seller handed to validator and not yet validated,
+    // beyond which no new requests are sent to seller. It is hardcoded to 8 for now.
+    const int _maxPiecesAwaitingValidation;
+
     std::chrono::duration<double> _maxTimeToServicePiece;
 
     // Do we need to ask sellers to perform a speed test
     bool _speedTestPolicyEnabled;
     uint32_t _speedTestPolicyPayloadSize;
+
+    // Sellers waiting for a speed test, cheapest first, and price each was queued under
+    std::set<std::pair<uint64_t, ConnectionIdType>> _speedTestQueue;
+    std::map<ConnectionIdType, uint64_t> _speedTestQueuePrice;
+
+    // Peers announcing sell mode, by price, and buffer for sellers to invite
+    detail::SellerOrderBook<ConnectionIdType> _sellerOrderBook;
+    std::vector<ConnectionIdType> _sellersToInvite;
+
+    // Time taken by peers to pass speed test, by IdToString of id, also from before restoring a checkpoint,
+    // and ids in order they were first remembered
+    std::map<std::string, std::chrono::milliseconds> _knownSpeedTests;
+    std::deque<std::string> _knownSpeedTestsOrder;
+
+    // Maximum number of peers in _knownSpeedTests, so neither memory nor checkpoints
+    // grow with every peer ever tested. It is hardcoded to 1000 for now.
+    const unsigned int _maxKnownSpeedTests;
+
+    // Sellers presently being tested, and when test was started
+    std::map<ConnectionIdType, std::chrono::high_resolution_clock::time_point> _speedTestsRunning;
 };
 
 }
@@ -6,6 +6,9 @@
  */
 
 #include <protocol_session/detail/Connection.hpp>
+#include <protocol_session/detail/ConnectionStateIndex.hpp>
+#include <protocol_session/detail/MemoryUsage.hpp>
+#include <protocol_session/AllocationAccounting.hpp>
 #include <protocol_session/Status.hpp>
 #include <protocol_wire/protocol_wire.hpp>
 
@@ -14,7 +17,8 @@ namespace protocol_session {
 namespace detail {
 
     template <class ConnectionIdType>
-    Connection<ConnectionIdType>::Connection(const ConnectionIdType & connectionId,
+    Connection<ConnectionIdType>::Connection(const ConnectionHandles<ConnectionIdType> & handles,
+                                             typename ConnectionHandles<ConnectionIdType>::Handle handle,
                                              const protocol_statemachine::PeerAnnouncedMode & peerAnnouncedMode,
                                              const protocol_statemachine::InvitedToOutdatedContract & invitedToOutdatedContract,
                                              const protocol_statemachine::InvitedToJoinContract & invitedToJoinContract,
@@ -33,17 +37,19 @@ namespace detail {
                                              const protocol_statemachine::SellerCompletedSpeedTest & sellerCompletedSpeedTest,
                                              const protocol_statemachine::BuyerRequestedSpeedTest & buyerRequestedSpeedTest,
                                              Coin::Network network,
-                                             const std::function<std::chrono::high_resolution_clock::time_point()> & getTime)
-        : _connectionId(connectionId)
+                                             const std::function<std::chrono::high_resolution_clock::time_point()> & getTime,
+                                             ConnectionStateIndex<ConnectionIdType> * stateIndex)
+        : _handles(handles)
+        , _handle(handle)
         , _machine(peerAnnouncedMode,
                    invitedToOutdatedContract,
                    invitedToJoinContract,
-                   send,
-                   contractIsReady,
+                   countingPayments(send),
+                   resettingPaymentCounters(contractIsReady),
                    pieceRequested,
                    invalidPieceRequested,
                    peerInterruptedPayment,
-                   validPayment,
+                   countingPayments(validPayment),
                    invalidPayment,
                    sellerJoined,
                    sellerInterruptedContract,
@@ -54,10 +60,34 @@ namespace detail {
                    buyerRequestedSpeedTest,
                    0,
                    network)
+        , _innerState(typeid(void))
+        , _stateIndex(stateIndex)
+        , _statePartition(-1)
+        , _statePartitionSlot(-1)
+        , _destroyed(nullptr)
+        , _price(0)
+        , _numberOfPayments(0)
+        , _amountPaid(0)
         , _getTime(getTime) {
 
         // Initiating state machine
         _machine.initiate();
+
+        _innerState = _machine.getInnerStateTypeIndex();
+
+        if(_stateIndex)
+            _stateIndex->add(this);
+    }
+
+    template <class ConnectionIdType>
+    Connection<ConnectionIdType>::~Connection() {
+
+        // Let an ongoing processEvent know it must not touch this connection
+        if(_destroyed)
+            *_destroyed = true;
+
+        if(_stateIndex)
+            _stateIndex->remove(this);
     }
 
     template <class ConnectionIdType>
@@ -68,18 +98,93 @@ namespace detail {
 
     template <class ConnectionIdType>
     void Connection<ConnectionIdType>::processEvent(const boost::statechart::event_base & e) {
-        _machine.processEvent(e);
+
+        // Reentrant calls each get their own flag, and pass on destruction to outer calls
+        bool destroyed = false;
+        bool * outer = _destroyed;
+
+        // Outermost call takes connection out of its state partition for the duration
+        if(outer == nullptr && _stateIndex)
+            _stateIndex->beginProcessing(this);
+
+        _destroyed = &destroyed;
+
+        try {
+            // State machine allocations are not ours to count, see AllocationCounting
+            StateMachineAllocations counting(false);
+
+            _machine.processEvent(e);
+        } catch(...) {
+
+            if(destroyed) {
+                if(outer) *outer = true;
+            } else
+                finishedProcessing(outer);
+
+            throw;
+        }
+
+        // State machine deleted this connection, DO NOT USE members
+        if(destroyed) {
+            if(outer) *outer = true;
+            return;
+        }
+
+        finishedProcessing(outer);
     }
 
     template <class ConnectionIdType>
     template<typename T>
     bool Connection<ConnectionIdType>::inState() const {
-        return _machine. template inState<T>();
+
+        // Cached state is not reliable while processing an event
+        if(_destroyed)
+            return _machine. template inState<T>();
+
+        // Inner state is T
+        if(_innerState == typeid(T))
+            return true;
+
+        // Whether a given inner state is nested in T is fixed by the state machine definition,
+        // so the answer from the state machine is remembered per inner state
+        static thread_local std::unordered_map<std::type_index, bool> nestedInT;
+
+        auto it = nestedInT.find(_innerState);
+
+        if(it != nestedInT.cend())
+            return it->second;
+
+        bool nested = _machine. template inState<T>();
+
+        nestedInT.insert(std::make_pair(_innerState, nested));
+
+        return nested;
     }
 
     template <class ConnectionIdType>
-    ConnectionIdType Connection<ConnectionIdType>::connectionId() const {
-        return _connectionId;
+    std::type_index Connection<ConnectionIdType>::innerState() const {
+        return _destroyed ? _machine.getInnerStateTypeIndex() : _innerState;
+    }
+
+    template <class ConnectionIdType>
+    void Connection<ConnectionIdType>::finishedProcessing(bool * outer) {
+
+        _destroyed = outer;
+
+        _innerState = _machine.getInnerStateTypeIndex();
+
+        if(outer == nullptr && _stateIndex)
+            _stateIndex->endProcessing(this);
+    }
+
+    template <class ConnectionIdType>
+    const ConnectionIdType & Connection<ConnectionIdType>::connectionId() const {
+        return _handles.id(_handle);
+    }
+
+    template <class ConnectionIdType>
+    typename ConnectionHandles<ConnectionIdType>::Handle Connection<ConnectionIdType>::handle() const {
+        return _handle;
     }
 
     template <class ConnectionIdType>
@@ -97,6 +202,79 @@ namespace detail {
         return _machine.payor();
     }
 
+    template <class ConnectionIdType>
+    uint64_t Connection<ConnectionIdType>::price() const {
+        return _price;
+    }
+
+    template <class ConnectionIdType>
+    uint64_t Connection<ConnectionIdType>::numberOfPayments() const {
+        return _numberOfPayments;
+    }
+
+    template <class ConnectionIdType>
+    uint64_t Connection<ConnectionIdType>::amountPaid() const {
+        return _amountPaid;
+    }
+
+    template <class ConnectionIdType>
+    void Connection<ConnectionIdType>::resetPaymentCountersFromPayor() {
+        const paymentchannel::Payor payor = _machine.payor();
+
+        _price = payor.price();
+        _numberOfPayments = payor.numberOfPaymentsMade();
+        _amountPaid = payor.amountPaid();
+    }
+
+    template <class ConnectionIdType>
+    void Connection<ConnectionIdType>::resetPaymentCountersFromPayee() {
+        const paymentchannel::Payee payee = _machine.payee();
+
+        _price = payee.price();
+        _numberOfPayments = payee.numberOfPaymentsMade();
+        _amountPaid = payee.amountPaid();
+    }
+
+    template <class ConnectionIdType>
+    protocol_statemachine::Send Connection<ConnectionIdType>::countingPayments(const protocol_statemachine::Send & send) {
+
+        protocol_statemachine::Send counting = send;
+
+        // State machine only sends a payment after it was made by the payor
+        auto payment = send.payment;
+
+        counting.payment = [this, payment](const protocol_wire::Payment & m) {
+            _numberOfPayments++;
+            _amountPaid += _price;
+
+            payment(m);
+        };
+
+        return counting;
+    }
+
+    template <class ConnectionIdType>
+    protocol_statemachine::ValidPayment Connection<ConnectionIdType>::countingPayments(const protocol_statemachine::ValidPayment & validPayment) {
+
+        // State machine only reports a valid payment after it was registered by the payee
+        return [this, validPayment](const Coin::Signature & s) {
+            _numberOfPayments++;
+            _amountPaid += _price;
+
+            validPayment(s);
+        };
+    }
+
+    template <class ConnectionIdType>
+    protocol_statemachine::ContractIsReady Connection<ConnectionIdType>::resettingPaymentCounters(const protocol_statemachine::ContractIsReady & contractIsReady) {
+
+        return [this, contractIsReady](uint64_t value, const Coin::typesafeOutPoint & anchor, const Coin::PublicKey & payorContractPk, const Coin::PubKeyHash & payorFinalPkHash) {
+            resetPaymentCountersFromPayee();
+
+            contractIsReady(value, anchor, payorContractPk, payorFinalPkHash);
+        };
+    }
+
     template <class ConnectionIdType>
     int Connection<ConnectionIdType>::maxPieceIndex() const {
         return _machine.MAX_PIECE_INDEX();
@@ -116,19 +294,67 @@ namespace detail {
 
     template <class ConnectionIdType>
     typename status::Connection<ConnectionIdType> Connection<ConnectionIdType>::status() const {
-        return status::Connection<ConnectionIdType>(_connectionId,
-                                                    status::CBStateMachine(_machine.getInnerStateTypeIndex(),
+        return status::Connection<ConnectionIdType>(connectionId(),
+                                                    status::CBStateMachine(innerState(),
                                                                            _machine.announcedModeAndTermsFromPeer(),
                                                                            _machine.payor(),
                                                                            _machine.payee(),
                                                                            timeToDeliverTestPayload()));
     }
 
+    template <class ConnectionIdType>
+    status::ConnectionMemoryUsage Connection<ConnectionIdType>::memoryUsage() const {
+
+        status::ConnectionMemoryUsage usage;
+
+        usage.connection = sizeof(Connection<ConnectionIdType>);
+        usage.pieceAvailability = detail::memoryUsage(_pieceAvailability);
+        usage.pieceDeliveryPipeline = _pieceDeliveryPipeline.memoryUsage();
+        usage.bufferedPieceData = _pieceDeliveryPipeline.bytesBuffered();
+
+        return usage;
+    }
+
     template <class ConnectionIdType>
     PieceDeliveryPipeline & Connection<ConnectionIdType>::pieceDeliveryPipeline() {
       return _pieceDeliveryPipeline;
     }
 
+    template <class ConnectionIdType>
+    TokenBucket & Connection<ConnectionIdType>::uploadLimit() {
+      return _uploadLimit;
+    }
+
+    template <class ConnectionIdType>
+    const TokenBucket & Connection<ConnectionIdType>::uploadLimit() const {
+      return _uploadLimit;
+    }
+
+    template <class ConnectionIdType>
+    boost::optional<UploadScheduler::Flow> & Connection<ConnectionIdType>::uploadFlow() {
+      return _uploadFlow;
+    }
+
+    template <class ConnectionIdType>
+    const boost::optional<std::chrono::high_resolution_clock::time_point> & Connection<ConnectionIdType>::lastUploadProgress() const {
+      return _lastUploadProgress;
+    }
+
+    template <class ConnectionIdType>
+    boost::optional<std::chrono::high_resolution_clock::time_point> & Connection<ConnectionIdType>::lastUploadProgress() {
+      return _lastUploadProgress;
+    }
+
+    template <class ConnectionIdType>
+    const PieceAvailability & Connection<ConnectionIdType>::pieceAvailability() const {
+      return _pieceAvailability;
+    }
+
+    template <class ConnectionIdType>
+    PieceAvailability & Connection<ConnectionIdType>::pieceAvailability() {
+      return _pieceAvailability;
+    }
+
     template <class ConnectionIdType>
     bool Connection<ConnectionIdType>::hasStartedSpeedTest() const {
       return !!_startedSpeedTestAt;
@@ -167,6 +393,12 @@ namespace detail {
       _completedSpeedTestAt = boost::none;
       _startedSpeedTestAt = boost::none;
     }
+
+    template <class ConnectionIdType>
+    void Connection<ConnectionIdType>::restoreSpeedTest(std::chrono::milliseconds timeToDeliverTestPayload) {
+      _completedSpeedTestAt = _getTime();
+      _startedSpeedTestAt = *_completedSpeedTestAt - timeToDeliverTestPayload;
+    }
 }
 }
 }
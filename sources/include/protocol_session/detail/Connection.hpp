@@ -10,10 +10,16 @@
 
 #include <protocol_statemachine/protocol_statemachine.hpp>
 #include <protocol_session/detail/PieceDeliveryPipeline.hpp>
+#include <protocol_session/detail/ConnectionHandles.hpp>
+#include <protocol_session/detail/TokenBucket.hpp>
+#include <protocol_session/UploadScheduler.hpp>
+#include <protocol_session/PieceAvailability.hpp>
 
 #include <common/Network.hpp>
 #include <queue>
 #include <chrono>
+#include <typeindex>
+#include <unordered_map>
 
 namespace joystream {
 namespace protocol_wire {
@@ -23,15 +29,20 @@ namespace protocol_session {
 namespace status {
     template <class ConnectionIdType>
     struct Connection;
+    struct ConnectionMemoryUsage;
 }
 namespace detail {
 
+    template <class ConnectionIdType>
+    class ConnectionStateIndex;
+
     template <class ConnectionIdType>
     class Connection {
 
     public:
 
-        Connection(const ConnectionIdType &,
+        Connection(const ConnectionHandles<ConnectionIdType> &,
+                   typename ConnectionHandles<ConnectionIdType>::Handle,
                    const protocol_statemachine::PeerAnnouncedMode &,
                    const protocol_statemachine::InvitedToOutdatedContract &,
                    const protocol_statemachine::InvitedToJoinContract &,
@@ -50,7 +61,10 @@ namespace detail {
                    const protocol_statemachine::SellerCompletedSpeedTest &,
                    const protocol_statemachine::BuyerRequestedSpeedTest &,
                    Coin::Network network,
-                   const std::function<std::chrono::high_resolution_clock::time_point()> &);
+                   const std::function<std::chrono::high_resolution_clock::time_point()> &,
+                   ConnectionStateIndex<ConnectionIdType> * = nullptr);
+
+        ~Connection();
 
         // Processes given message
         template<class M>
@@ -63,8 +77,14 @@ namespace detail {
         template<typename T>
         bool inState() const;
 
-        // Id of given connection
-        ConnectionIdType connectionId() const;
+        // Innermost state of state machine, cached after every event.
+        // While an event is being processed, only the state machine knows the inner state.
+        std::type_index innerState() const;
+
+        // Id of given connection, remains valid until handle is reused, see ConnectionHandles
+        const ConnectionIdType & connectionId() const;
+
+        typename ConnectionHandles<ConnectionIdType>::Handle handle() const;
 
         // Peer terms announced
         protocol_statemachine::AnnouncedModeAndTerms announcedModeAndTermsFromPeer() const;
@@ -75,6 +95,21 @@ namespace detail {
         // Payee in state machine: only used when buying
         paymentchannel::Payor payor() const;
 
+        //// Payment counters of current contract, maintained without copying
+        //// the payor/payee out of the state machine
+
+        // Price per piece
+        uint64_t price() const;
+
+        // Number of payments sent (buying) or valid payments received (selling)
+        uint64_t numberOfPayments() const;
+
+        // Total amount sent (buying) or received (selling)
+        uint64_t amountPaid() const;
+
+        // Reload counters from payor in state machine, to be called when contract is announced to seller
+        void resetPaymentCountersFromPayor();
+
         // Connection state machine reference
         //protocol_statemachine::CBStateMachine & machine();
 
@@ -85,8 +120,26 @@ namespace detail {
         // Statu of connection
         status::Connection<ConnectionIdType> status() const;
 
+        // Bytes held by connection
+        status::ConnectionMemoryUsage memoryUsage() const;
+
         PieceDeliveryPipeline & pieceDeliveryPipeline();
 
+        // Upload rate limit of buyer, see UploadRateLimitPolicy: only used when selling
+        TokenBucket & uploadLimit();
+        const TokenBucket & uploadLimit() const;
+
+        // Flow of buyer in upload scheduler of selling session, if any: only used when selling
+        boost::optional<UploadScheduler::Flow> & uploadFlow();
+
+        // Last time a piece was sent to, or a payment arrived from, buyer: only used when selling
+        const boost::optional<std::chrono::high_resolution_clock::time_point> & lastUploadProgress() const;
+        boost::optional<std::chrono::high_resolution_clock::time_point> & lastUploadProgress();
+
+        // Pieces peer has, empty if peer has not advertised availability: only used when buying
+        const PieceAvailability & pieceAvailability() const;
+        PieceAvailability & pieceAvailability();
+
         void startingSpeedTest();
         void endingSpeedTest();
         bool hasStartedSpeedTest() const;
@@ -95,18 +148,58 @@ namespace detail {
         boost::optional<std::chrono::milliseconds> timeToDeliverTestPayload() const;
         void abandonSpeedTest();
 
+        // Speed test completed just now, having taken given time, e.g. as known from a checkpoint
+        void restoreSpeedTest(std::chrono::milliseconds);
+
     private:
 
-        // Connection id
-        ConnectionIdType _connectionId;
+        // Caches inner state once processEvent call is done, given flag of enclosing call if any
+        void finishedProcessing(bool *);
+
+        // Reload counters from payee in state machine, done when contract is ready
+        void resetPaymentCountersFromPayee();
+
+        // Counting wrappers around state machine callbacks
+        protocol_statemachine::Send countingPayments(const protocol_statemachine::Send &);
+        protocol_statemachine::ValidPayment countingPayments(const protocol_statemachine::ValidPayment &);
+        protocol_statemachine::ContractIsReady resettingPaymentCounters(const protocol_statemachine::ContractIsReady &);
+
+        // Connection id, interned by session
+        const ConnectionHandles<ConnectionIdType> & _handles;
+        typename ConnectionHandles<ConnectionIdType>::Handle _handle;
 
         // State machine for this connection
         protocol_statemachine::CBStateMachine _machine;
 
+        //// Cached state
+
+        // Innermost state of _machine
+        std::type_index _innerState;
+
+        // Index to keep informed about state changes, if any, and position in it
+        ConnectionStateIndex<ConnectionIdType> * _stateIndex;
+        int _statePartition;
+        int _statePartitionSlot;
+
+        // Set by the destructor, points to a flag on the stack of the innermost
+        // processEvent call, since the state machine may delete its connection
+        bool * _destroyed;
+
+        friend class ConnectionStateIndex<ConnectionIdType>;
+
+        //// Payment counters
+        uint64_t _price;
+        uint64_t _numberOfPayments;
+        uint64_t _amountPaid;
+
         //// Buyer
+        PieceAvailability _pieceAvailability;
 
         //// Selling
         PieceDeliveryPipeline _pieceDeliveryPipeline;
+        TokenBucket _uploadLimit;
+        boost::optional<UploadScheduler::Flow> _uploadFlow;
+        boost::optional<std::chrono::high_resolution_clock::time_point> _lastUploadProgress;
 
         //// Speed Testing - used by when buying and selling
         // buyer: records time when request to seller was sent
@@ -119,8 +212,9 @@ namespace detail {
         std::function<std::chrono::high_resolution_clock::time_point()> _getTime;
     };
 
+    // Connections keyed by handle, see ConnectionHandles
     template <class ConnectionIdType>
-    using ConnectionMap = std::map<ConnectionIdType, Connection<ConnectionIdType> *>;
+    using ConnectionMap = std::map<typename ConnectionHandles<ConnectionIdType>::Handle, Connection<ConnectionIdType> *>;
 
 }
 }
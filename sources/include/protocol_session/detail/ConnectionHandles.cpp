@@ -0,0 +1,91 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#include <protocol_session/detail/ConnectionHandles.hpp>
+#include <protocol_session/detail/MemoryUsage.hpp>
+
+#include <cassert>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+    template <class ConnectionIdType>
+    const typename ConnectionHandles<ConnectionIdType>::Handle ConnectionHandles<ConnectionIdType>::NoHandle;
+
+    template <class ConnectionIdType>
+    ConnectionHandles<ConnectionIdType>::ConnectionHandles() {
+    }
+
+    template <class ConnectionIdType>
+    typename ConnectionHandles<ConnectionIdType>::Handle ConnectionHandles<ConnectionIdType>::add(const ConnectionIdType & id) {
+
+        assert(_handleOfId.count(id) == 0);
+
+        Handle handle;
+
+        if(_free.empty()) {
+            _ids.push_back(id);
+            handle = _ids.size() - 1;
+        } else {
+            handle = _free.back();
+            _free.pop_back();
+
+            _ids[handle] = id;
+        }
+
+        _handleOfId[id] = handle;
+
+        return handle;
+    }
+
+    template <class ConnectionIdType>
+    void ConnectionHandles<ConnectionIdType>::release(Handle handle) {
+
+        assert(handle < _ids.size());
+        assert(find(_ids[handle]) == handle);
+
+        _handleOfId.erase(_ids[handle]);
+        _released.push_back(handle);
+    }
+
+    template <class ConnectionIdType>
+    void ConnectionHandles<ConnectionIdType>::reuseReleased() {
+
+        _free.insert(_free.end(), _released.begin(), _released.end());
+        _released.clear();
+    }
+
+    template <class ConnectionIdType>
+    const ConnectionIdType & ConnectionHandles<ConnectionIdType>::id(Handle handle) const {
+
+        assert(handle < _ids.size());
+
+        return _ids[handle];
+    }
+
+    template <class ConnectionIdType>
+    typename ConnectionHandles<ConnectionIdType>::Handle ConnectionHandles<ConnectionIdType>::find(const ConnectionIdType & id) const {
+
+        auto itr = _handleOfId.find(id);
+
+        return itr == _handleOfId.cend() ? NoHandle : itr->second;
+    }
+
+    template <class ConnectionIdType>
+    unsigned int ConnectionHandles<ConnectionIdType>::size() const {
+        return _ids.size() - _free.size() - _released.size();
+    }
+
+    template <class ConnectionIdType>
+    uint64_t ConnectionHandles<ConnectionIdType>::memoryUsage() const {
+        return _ids.size() * sizeof(ConnectionIdType) +
+               detail::memoryUsage(_handleOfId) +
+               detail::memoryUsage(_free) +
+               detail::memoryUsage(_released);
+    }
+
+}
+}
+}
@@ -0,0 +1,75 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_DETAIL_CONNECTIONHANDLES_HPP
+#define JOYSTREAM_PROTOCOLSESSION_DETAIL_CONNECTIONHANDLES_HPP
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <vector>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+    // Dense 32 bit handles for connection ids, so connections and their callbacks refer to
+    // one interned copy of the id rather than each holding their own, and state of the session
+    // is keyed by handle. Ids are only looked up here, where they come in through the public API.
+    // References to ids stay valid until released handles are reused, which only happens
+    // in reuseReleased, so ids can safely be used during callbacks which destroy their connection.
+    template <class ConnectionIdType>
+    class ConnectionHandles {
+
+    public:
+
+        typedef uint32_t Handle;
+
+        // Returned by find when id has no handle
+        static const Handle NoHandle = UINT32_MAX;
+
+        ConnectionHandles();
+
+        // New handle for given id
+        Handle add(const ConnectionIdType &);
+
+        // Handle is no longer used, it is reused after next call to reuseReleased,
+        // but id can be given a new handle right away
+        void release(Handle);
+
+        // Make released handles available, must not be called while any id is in use, e.g. from tick()
+        void reuseReleased();
+
+        const ConnectionIdType & id(Handle) const;
+
+        // Handle of given id, or NoHandle if it has none
+        Handle find(const ConnectionIdType &) const;
+
+        // Number of handles in use
+        unsigned int size() const;
+
+        // Bytes held by handles
+        uint64_t memoryUsage() const;
+
+    private:
+
+        // Id of each handle, deque keeps references stable when growing
+        std::deque<ConnectionIdType> _ids;
+
+        // Handle of each id in use
+        std::map<ConnectionIdType, Handle> _handleOfId;
+
+        // Handles which can be reused, and those released since last reuseReleased
+        std::vector<Handle> _free;
+        std::vector<Handle> _released;
+    };
+
+}
+}
+}
+
+// Templated type defenitions
+#include <protocol_session/detail/ConnectionHandles.cpp>
+
+#endif // JOYSTREAM_PROTOCOLSESSION_DETAIL_CONNECTIONHANDLES_HPP
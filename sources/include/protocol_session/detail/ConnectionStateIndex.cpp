@@ -0,0 +1,114 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#include <protocol_session/detail/ConnectionStateIndex.hpp>
+#include <protocol_session/detail/Connection.hpp>
+
+#include <algorithm>
+#include <cassert>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+    template <class ConnectionIdType>
+    void ConnectionStateIndex<ConnectionIdType>::add(Connection<ConnectionIdType> * c) {
+
+        int partition = partitionOf(c->_innerState);
+
+        std::vector<Connection<ConnectionIdType> *> & connections = _partitions[partition].connections;
+
+        c->_statePartition = partition;
+        c->_statePartitionSlot = connections.size();
+
+        connections.push_back(c);
+    }
+
+    template <class ConnectionIdType>
+    void ConnectionStateIndex<ConnectionIdType>::remove(Connection<ConnectionIdType> * c) {
+
+        if(c->_statePartition >= 0)
+            removeFromPartition(c);
+        else
+            _processing.erase(std::find(_processing.begin(), _processing.end(), c));
+    }
+
+    template <class ConnectionIdType>
+    void ConnectionStateIndex<ConnectionIdType>::beginProcessing(Connection<ConnectionIdType> * c) {
+
+        removeFromPartition(c);
+
+        _processing.push_back(c);
+    }
+
+    template <class ConnectionIdType>
+    void ConnectionStateIndex<ConnectionIdType>::endProcessing(Connection<ConnectionIdType> * c) {
+
+        auto it = std::find(_processing.begin(), _processing.end(), c);
+
+        assert(it != _processing.end());
+
+        _processing.erase(it);
+
+        add(c);
+    }
+
+    template <class ConnectionIdType>
+    void ConnectionStateIndex<ConnectionIdType>::removeFromPartition(Connection<ConnectionIdType> * c) {
+
+        assert(c->_statePartition >= 0);
+
+        std::vector<Connection<ConnectionIdType> *> & connections = _partitions[c->_statePartition].connections;
+
+        assert(connections[c->_statePartitionSlot] == c);
+
+        // Move last connection into slot of removed connection
+        Connection<ConnectionIdType> * last = connections.back();
+
+        connections[c->_statePartitionSlot] = last;
+        last->_statePartitionSlot = c->_statePartitionSlot;
+
+        connections.pop_back();
+
+        c->_statePartition = -1;
+    }
+
+    template <class ConnectionIdType>
+    template <typename T>
+    void ConnectionStateIndex<ConnectionIdType>::connectionsInState(std::vector<Connection<ConnectionIdType> *> & matches) const {
+
+        for(const Partition & p : _partitions) {
+
+            if(p.connections.empty())
+                continue;
+
+            // All connections in partition share inner state, so asking any one of them
+            // tells whether the partition is in T
+            if(!p.connections.front()-> template inState<T>())
+                continue;
+
+            matches.insert(matches.end(), p.connections.cbegin(), p.connections.cend());
+        }
+
+        // State of connections processing an event has to be taken from their state machine
+        for(Connection<ConnectionIdType> * c : _processing)
+            if(c-> template inState<T>())
+                matches.push_back(c);
+    }
+
+    template <class ConnectionIdType>
+    int ConnectionStateIndex<ConnectionIdType>::partitionOf(const std::type_index & state) {
+
+        for(uint i = 0;i < _partitions.size();i++)
+            if(_partitions[i].state == state)
+                return i;
+
+        _partitions.push_back(Partition(state));
+
+        return _partitions.size() - 1;
+    }
+
+}
+}
+}
@@ -0,0 +1,76 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_DETAIL_CONNECTIONSTATEINDEX_HPP
+#define JOYSTREAM_PROTOCOLSESSION_DETAIL_CONNECTIONSTATEINDEX_HPP
+
+#include <typeindex>
+#include <vector>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+    template <class ConnectionIdType>
+    class Connection;
+
+    // Partitions connections by the inner state of their state machine, so that
+    // finding all connections in a given state does not require visiting every connection.
+    // Connections keep the index up to date as their state machine transitions.
+    template <class ConnectionIdType>
+    class ConnectionStateIndex {
+
+    public:
+
+        // Add connection, in its current inner state
+        void add(Connection<ConnectionIdType> *);
+
+        // Remove connection
+        void remove(Connection<ConnectionIdType> *);
+
+        // Connection starts processing an event, during which its inner state may change
+        // and is only known to its state machine
+        void beginProcessing(Connection<ConnectionIdType> *);
+
+        // Connection finished processing event, and is filed under its new inner state
+        void endProcessing(Connection<ConnectionIdType> *);
+
+        // Appends all connections in state T, or any state nested in T, to given vector
+        template <typename T>
+        void connectionsInState(std::vector<Connection<ConnectionIdType> *> &) const;
+
+    private:
+
+        struct Partition {
+
+            Partition(const std::type_index & s) : state(s) {}
+
+            // Inner state of all connections in partition
+            std::type_index state;
+
+            std::vector<Connection<ConnectionIdType> *> connections;
+        };
+
+        // Index of partition for given inner state, created if missing
+        int partitionOf(const std::type_index &);
+
+        // Partitions are never removed, there is only a small fixed number of inner states,
+        // and keeping them allows transitions to not allocate once warmed up
+        std::vector<Partition> _partitions;
+
+        // Connections presently processing an event
+        std::vector<Connection<ConnectionIdType> *> _processing;
+
+        // Remove connection from its partition
+        void removeFromPartition(Connection<ConnectionIdType> *);
+    };
+
+}
+}
+}
+
+// Templated type defenitions
+#include <protocol_session/detail/ConnectionStateIndex.cpp>
+
+#endif // JOYSTREAM_PROTOCOLSESSION_DETAIL_CONNECTIONSTATEINDEX_HPP
@@ -0,0 +1,44 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_DETAIL_MEMORYUSAGE_HPP
+#define JOYSTREAM_PROTOCOLSESSION_DETAIL_MEMORYUSAGE_HPP
+
+#include <boost/dynamic_bitset.hpp>
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+    // Estimates of bytes held by containers, used for status::MemoryUsage
+
+    // Bookkeeping of each node of a std::map or std::set besides its value,
+    // as in the red-black tree of common standard libraries
+    static const uint64_t TreeNodeOverhead = 4 * sizeof(void *);
+
+    template <class T>
+    uint64_t memoryUsage(const std::vector<T> & v) {
+        return v.capacity() * sizeof(T);
+    }
+
+    template <class Block>
+    uint64_t memoryUsage(const boost::dynamic_bitset<Block> & b) {
+        return b.num_blocks() * sizeof(Block);
+    }
+
+    // Nodes only, not anything the values refer to
+    template <class K, class V>
+    uint64_t memoryUsage(const std::map<K, V> & m) {
+        return m.size() * (TreeNodeOverhead + sizeof(typename std::map<K, V>::value_type));
+    }
+
+}
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_DETAIL_MEMORYUSAGE_HPP
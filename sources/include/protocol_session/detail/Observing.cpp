@@ -10,6 +10,8 @@
 #include <protocol_session/detail/Buying.hpp>
 #include <protocol_session/detail/Selling.hpp>
 
+#include <memory>
+
 namespace joystream {
 namespace protocol_session {
 namespace detail {
@@ -28,13 +30,38 @@ namespace detail {
     template <class ConnectionIdType>
     uint Observing<ConnectionIdType>::addConnection(const ConnectionIdType & id, const SendMessageOnConnectionCallbacks &callbacks) {
 
-        // Create connection
+        // Do not accept new connection if session is stopped
+        if(_session->_state == SessionState::stopped)
+            throw exception::StateIncompatibleOperation("cannot create connection while session is stopped.");
+
+        // Create connection, peer can only be kept passive if session can make its callbacks later
         detail::Connection<ConnectionIdType> * connection = _session->createAndAddConnection(id, callbacks);
 
         // Choose mode on connection
         connection->processEvent(protocol_statemachine::event::ObserveModeStarted());
 
-        return _session->_connections.size();
+        return _session->_connections.size() + _passivePeers.size();
+    }
+
+    template <class ConnectionIdType>
+    uint Observing<ConnectionIdType>::addPassivePeer(const ConnectionIdType & id) {
+
+        // Do not accept new connection if session is stopped
+        if(_session->_state == SessionState::stopped)
+            throw exception::StateIncompatibleOperation("cannot create connection while session is stopped.");
+
+        // Check that connection is new, throw exception if not
+        if(_session->hasConnection(id))
+            throw exception::ConnectionAlreadyAddedException<ConnectionIdType>(id);
+
+        // Peer is kept passive until it does more than announce its mode,
+        // see processMessageOnPassivePeer
+        _passivePeers.insert(std::make_pair(id, protocol_statemachine::AnnouncedModeAndTerms()));
+
+        // Announce mode, as state machine does when observe mode is started
+        _session->_makeSendMessageOnConnectionCallbacks(id).observe(protocol_wire::Observe());
+
+        return _session->_connections.size() + _passivePeers.size();
     }
 
     template <class ConnectionIdType>
@@ -43,15 +70,92 @@ namespace detail {
         if(_session->_state == SessionState::stopped)
             throw exception::StateIncompatibleOperation("cannot remove connection while session is stopped, all connections are removed.");
 
-        if(!_session->hasConnection(id))
-            throw exception::ConnectionDoesNotExist<ConnectionIdType>(id);
+        auto itr = _passivePeers.find(id);
+
+        if(itr != _passivePeers.end())
+            _passivePeers.erase(itr);
+        else {
+
+            if(!_session->hasConnection(id))
+                throw exception::ConnectionDoesNotExist<ConnectionIdType>(id);
 
-        _session->destroyConnection(id);
+            _session->destroyConnection(id);
+        }
 
         // Notify client to remove connection
         _removedConnection(id, DisconnectCause::client);
     }
 
+    template <class ConnectionIdType>
+    template <class M>
+    void Observing<ConnectionIdType>::processMessageOnPassivePeer(const ConnectionIdType & id, const M & m) {
+
+        auto itr = _passivePeers.find(id);
+
+        assert(itr != _passivePeers.end());
+
+        if(recordAnnouncement(itr->second, m))
+            return;
+
+        // Peer has left observe-only phase
+        detail::Connection<ConnectionIdType> * connection = materialize(id);
+
+        connection->processMessage(m);
+
+        // ** DO NOT USE connection **, may have been deleted
+    }
+
+    template <class ConnectionIdType>
+    bool Observing<ConnectionIdType>::isPassivePeer(const ConnectionIdType & id) const {
+        return _passivePeers.count(id) > 0;
+    }
+
+    template <class ConnectionIdType>
+    uint Observing<ConnectionIdType>::numberOfPassivePeers() const {
+        return _passivePeers.size();
+    }
+
+    template <class ConnectionIdType>
+    void Observing<ConnectionIdType>::passivePeerIds(std::set<ConnectionIdType> & ids) const {
+
+        for(const auto & peer : _passivePeers)
+            ids.insert(peer.first);
+    }
+
+    template <class ConnectionIdType>
+    status::Connection<ConnectionIdType> Observing<ConnectionIdType>::passivePeerStatus(const ConnectionIdType & id) const {
+
+        auto itr = _passivePeers.find(id);
+
+        if(itr == _passivePeers.cend())
+            throw exception::ConnectionDoesNotExist<ConnectionIdType>(id);
+
+        // Status as a full connection in observe mode would report it
+        return status::Connection<ConnectionIdType>(id,
+                                                    status::CBStateMachine(typeid(protocol_statemachine::Observing),
+                                                                           itr->second,
+                                                                           paymentchannel::Payor(_session->network()),
+                                                                           paymentchannel::Payee(_session->network()),
+                                                                           boost::optional<std::chrono::milliseconds>()));
+    }
+
+    template <class ConnectionIdType>
+    uint64_t Observing<ConnectionIdType>::passivePeersMemoryUsage() const {
+        return detail::memoryUsage(_passivePeers);
+    }
+
+    template <class ConnectionIdType>
+    void Observing<ConnectionIdType>::leavingState() {
+
+        while(!_passivePeers.empty()) {
+
+            // Copy, as materializing erases the peer
+            ConnectionIdType id = _passivePeers.begin()->first;
+
+            materialize(id);
+        }
+    }
+
     template <class ConnectionIdType>
     void Observing<ConnectionIdType>::start() {
 
@@ -66,14 +170,23 @@ namespace detail {
         if(_session->state() == SessionState::stopped)
             throw exception::StateIncompatibleOperation("cannot stop while already stopped.");
 
+        // Disconnect passive peers
+        for(const auto & peer : _passivePeers)
+            _removedConnection(peer.first, DisconnectCause::client);
+
+        _passivePeers.clear();
+
         // Disconnect everyone: iteration safe deletion
         for(auto itr = _session->_connections.cbegin(); itr != _session->_connections.cend();) {
 
+            // Id stays valid after connection is destroyed, see ConnectionHandles
+            const ConnectionIdType & id = itr->second->connectionId();
+
             // Notify client to remove connection
-            _removedConnection(itr->first, DisconnectCause::client);
+            _removedConnection(id, DisconnectCause::client);
 
             // Destroy connection: iterator made invalid here
-            itr = _session->destroyConnection(itr->first);
+            itr = _session->destroyConnection(id);
         }
 
         // Update state
@@ -87,6 +200,88 @@ namespace detail {
         _session->_state = SessionState::paused;
     }
 
+    template <class ConnectionIdType>
+    bool Observing<ConnectionIdType>::recordAnnouncement(protocol_statemachine::AnnouncedModeAndTerms & announced, const protocol_wire::Observe &) {
+
+        announced.toObserve();
+        return true;
+    }
+
+    template <class ConnectionIdType>
+    bool Observing<ConnectionIdType>::recordAnnouncement(protocol_statemachine::AnnouncedModeAndTerms & announced, const protocol_wire::Buy & m) {
+
+        announced.toBuy(m.terms());
+        return true;
+    }
+
+    template <class ConnectionIdType>
+    bool Observing<ConnectionIdType>::recordAnnouncement(protocol_statemachine::AnnouncedModeAndTerms & announced, const protocol_wire::Sell & m) {
+
+        announced.toSell(m.terms(), m.index());
+        return true;
+    }
+
+    template <class ConnectionIdType>
+    template <class M>
+    bool Observing<ConnectionIdType>::recordAnnouncement(protocol_statemachine::AnnouncedModeAndTerms &, const M &) {
+        return false;
+    }
+
+    template <class ConnectionIdType>
+    detail::Connection<ConnectionIdType> * Observing<ConnectionIdType>::materialize(const ConnectionIdType & id) {
+
+        auto itr = _passivePeers.find(id);
+
+        assert(itr != _passivePeers.end());
+
+        protocol_statemachine::AnnouncedModeAndTerms announced = itr->second;
+
+        // Must be gone before connection with same id is added
+        _passivePeers.erase(itr);
+
+        SendMessageOnConnectionCallbacks callbacks = _session->_makeSendMessageOnConnectionCallbacks(id);
+
+        // Observe is only sent once mode has been chosen on connection below, as peer already has it
+        std::shared_ptr<bool> modeChosen = std::make_shared<bool>(false);
+        std::function<void(const protocol_wire::Observe &)> observe = callbacks.observe;
+
+        callbacks.observe = [modeChosen, observe](const protocol_wire::Observe & m) {
+            if(*modeChosen)
+                observe(m);
+        };
+
+        detail::Connection<ConnectionIdType> * connection = _session->createAndAddConnection(id, callbacks);
+
+        // Choose mode on connection
+        connection->processEvent(protocol_statemachine::event::ObserveModeStarted());
+
+        *modeChosen = true;
+
+        // Replay last announcement of peer
+        switch(announced.modeAnnounced()) {
+
+            case protocol_statemachine::ModeAnnounced::none:
+                break;
+
+            case protocol_statemachine::ModeAnnounced::observe:
+                connection->processMessage(protocol_wire::Observe());
+                break;
+
+            case protocol_statemachine::ModeAnnounced::sell:
+                connection->processMessage(protocol_wire::Sell(announced.sellModeTerms(), announced.index()));
+                break;
+
+            case protocol_statemachine::ModeAnnounced::buy:
+                connection->processMessage(protocol_wire::Buy(announced.buyModeTerms()));
+                break;
+
+            default:
+                assert(false);
+        }
+
+        return connection;
+    }
+
 }
 }
 }
@@ -9,6 +9,10 @@
 #define JOYSTREAM_PROTOCOLSESSION_OBSERVING_HPP
 
 #include <protocol_session/Session.hpp>
+#include <protocol_session/detail/MemoryUsage.hpp>
+
+#include <map>
+#include <set>
 
 namespace joystream {
 namespace protocol_session {
@@ -33,9 +37,37 @@ public:
     // Adds connection, and return the current number of connections
     uint addConnection(const ConnectionIdType &, const SendMessageOnConnectionCallbacks &);
 
+    // Adds passive peer, whose callbacks are made by session when needed, and return the current number of connections
+    uint addPassivePeer(const ConnectionIdType &);
+
     // Remove connection
     void removeConnection(const ConnectionIdType &);
 
+    // Message on passive peer: mode announcements are only recorded,
+    // any other message materializes a full connection which processes it
+    template<class M>
+    void processMessageOnPassivePeer(const ConnectionIdType &, const M &);
+
+    //// Passive peers
+
+    // Whether connection with given id is a passive peer, i.e. has no full connection
+    bool isPassivePeer(const ConnectionIdType &) const;
+
+    uint numberOfPassivePeers() const;
+
+    // Adds ids of all passive peers to given set
+    void passivePeerIds(std::set<ConnectionIdType> &) const;
+
+    status::Connection<ConnectionIdType> passivePeerStatus(const ConnectionIdType &) const;
+
+    // Bytes held by passive peers
+    uint64_t passivePeersMemoryUsage() const;
+
+    //// Change mode
+
+    // Materializes all passive peers, as other modes need a full connection per peer
+    void leavingState();
+
     //// Change state
 
     // Starts a stopped session by becoming fully operational
@@ -49,6 +81,19 @@ public:
 
 private:
 
+    // Record last mode and terms announced by passive peer, returns false if message is not an announcement
+    static bool recordAnnouncement(protocol_statemachine::AnnouncedModeAndTerms &, const protocol_wire::Observe &);
+    static bool recordAnnouncement(protocol_statemachine::AnnouncedModeAndTerms &, const protocol_wire::Buy &);
+    static bool recordAnnouncement(protocol_statemachine::AnnouncedModeAndTerms &, const protocol_wire::Sell &);
+
+    template<class M>
+    static bool recordAnnouncement(protocol_statemachine::AnnouncedModeAndTerms &, const M &);
+
+    // Replaces passive peer with a full connection in observe mode, which is
+    // told what the peer last announced, and returns the new connection.
+    // Peer was sent our announcement when added, so connection does not send it again.
+    detail::Connection<ConnectionIdType> * materialize(const ConnectionIdType &);
+
     //// Members
 
     // Reference to core of session
@@ -57,6 +102,10 @@ private:
     // Callback handlers
     RemovedConnectionCallbackHandler<ConnectionIdType> _removedConnection;
 
+    // Peers which so far have only announced their mode, and therefore are kept without a state machine
+    // or callbacks until they do anything else, with last mode and terms each announced.
+    // Disjoint from connections of session, and a tree so adding and removing is O(log n) with many peers.
+    std::map<ConnectionIdType, protocol_statemachine::AnnouncedModeAndTerms> _passivePeers;
 };
 
 }
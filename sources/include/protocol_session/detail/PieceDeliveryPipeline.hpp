@@ -3,8 +3,10 @@
 
 
 #include <boost/variant.hpp>
+#include <boost/circular_buffer.hpp>
+#include <climits>
+#include <cstdint>
 #include <memory>
-#include <deque>
 #include <vector>
 
 namespace joystream {
@@ -26,16 +28,42 @@ public:
 
   void paymentReceived();
 
-  std::vector<int> getNextBatchToLoad(int maxPiecesBeingServiced);
+  // Batches are written into the caller provided vector, which is cleared first,
+  // so that a caller reusing the vector does not allocate once warmed up.
+  // At most maxPieces are taken, e.g. to stay within a memory budget.
+  void getNextBatchToLoad(int maxPiecesBeingServiced, std::vector<int> & pieces, int maxPieces = INT_MAX);
 
-  std::vector<protocol_wire::PieceData> getNextBatchToSend(int maxPiecesUnpaidFor);
+  void getNextBatchToSend(int maxPiecesUnpaidFor, std::vector<protocol_wire::PieceData> & pieces);
+
+  // Next piece getNextBatchToSend would send, nullptr if none, for sending pieces one at a time
+  const protocol_wire::PieceData * nextToSend(int maxPiecesUnpaidFor) const;
+
+  // Takes piece given by nextToSend, returns false if there is none
+  bool takeNextToSend(int maxPiecesUnpaidFor, protocol_wire::PieceData & data);
+
+  // Total length of piece data loaded but not yet sent, kept as pieces come and go
+  uint64_t bytesBuffered() const;
+
+  // Number of pieces requested to be loaded which have not arrived
+  int piecesLoading() const;
+
+  // Whether piece at the front was sent, and its payment has not arrived
+  bool awaitingPayment() const;
+
+  // Drops data of all pieces ready to send, so they are loaded again when next batch to load is taken.
+  // Returns number of bytes released.
+  uint64_t evictBuffered();
+
+  // Bytes taken by slots of pipeline, not counting piece data
+  uint64_t memoryUsage() const;
 
 private:
 
   struct Piece {
+    Piece () : index(0) {}
     Piece (int i) : index(i) {}
 
-    const int index;
+    int index;
 
     // Initial state of the Piece - before a request is made to load it
     struct NotRequested {};
@@ -63,10 +91,14 @@ private:
     }
   };
 
-  // Double ended queue used (works better than a queue or vector) for both iteration
-  // to update elements not at the begining or end,
-  // and for fast efficient push/pop operations
-  std::deque<Piece> _pipeline;
+  // Ring buffer used for both iteration to update elements not at the begining or end,
+  // and for fast efficient push/pop operations. Unlike a deque it does not allocate
+  // and free blocks as pieces flow through, capacity is only doubled when full.
+  boost::circular_buffer<Piece> _pipeline;
+
+  uint64_t _bytesBuffered;
+
+  int _piecesLoading;
 };
 
 
@@ -0,0 +1,199 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#include <protocol_session/detail/PieceTable.hpp>
+#include <protocol_session/TorrentPieceInformation.hpp>
+
+#include <cassert>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+    template <class ConnectionIdType>
+    PieceTable<ConnectionIdType>::PieceTable()
+        : PieceTable(nullptr, 0, 0, 0, PieceAvailability()) {
+    }
+
+    template <class ConnectionIdType>
+    PieceTable<ConnectionIdType>::PieceTable(const ConnectionHandles<ConnectionIdType> * handles, unsigned int numberOfPieces, unsigned int pieceLength, unsigned int lastPieceLength, const PieceAvailability & downloaded)
+        : _handles(handles)
+        , _numberOfPieces(numberOfPieces)
+        , _states((numberOfPieces + 31) / 32, 0)
+        , _slots(numberOfPieces, 0)
+        , _pieceLength(pieceLength)
+        , _lastPieceLength(lastPieceLength) {
+
+        assert(downloaded.empty() || downloaded.size() == numberOfPieces);
+
+        _numberOfPiecesInState[(int)PieceState::unassigned] = numberOfPieces;
+        _numberOfPiecesInState[(int)PieceState::being_downloaded] = 0;
+        _numberOfPiecesInState[(int)PieceState::being_validated_and_stored] = 0;
+        _numberOfPiecesInState[(int)PieceState::downloaded] = 0;
+
+        for(auto i = downloaded.find_first();i != PieceAvailability::npos;i = downloaded.find_next(i))
+            setState(i, PieceState::downloaded);
+    }
+
+    template <class ConnectionIdType>
+    PieceTable<ConnectionIdType>::PieceTable(const ConnectionHandles<ConnectionIdType> * handles, const TorrentPieceInformation & information)
+        : PieceTable(handles,
+                     information.size(),
+                     information.empty() ? 0 : information.front().size(),
+                     information.empty() ? 0 : information.back().size(),
+                     PieceAvailability()) {
+
+        for(unsigned int i = 0;i < information.size();i++) {
+
+            if(information[i].downloaded())
+                setState(i, PieceState::downloaded);
+
+            // Keep sizes of irregular torrents
+            if(i + 1 < information.size() && information[i].size() != _pieceLength && _sizes.empty()) {
+
+                _sizes.reserve(information.size());
+
+                for(const PieceInformation & p : information)
+                    _sizes.push_back(p.size());
+            }
+        }
+    }
+
+    template <class ConnectionIdType>
+    uint64_t PieceTable<ConnectionIdType>::memoryUsage() const {
+        return detail::memoryUsage(_states) +
+               detail::memoryUsage(_slots) +
+               detail::memoryUsage(_sizes);
+    }
+
+    template <class ConnectionIdType>
+    unsigned int PieceTable<ConnectionIdType>::size() const {
+        return _numberOfPieces;
+    }
+
+    template <class ConnectionIdType>
+    Piece<ConnectionIdType> PieceTable<ConnectionIdType>::at(int index) const {
+        return Piece<ConnectionIdType>(index, state(index), connectionId(index), pieceSize(index));
+    }
+
+    template <class ConnectionIdType>
+    PieceState PieceTable<ConnectionIdType>::state(int index) const {
+        assert(index >= 0 && (unsigned int)index < _numberOfPieces);
+        return (PieceState)((_states[index >> 5] >> ((index & 31) * 2)) & 3);
+    }
+
+    template <class ConnectionIdType>
+    typename PieceTable<ConnectionIdType>::Handle PieceTable<ConnectionIdType>::handle(int index) const {
+
+        uint32_t slot = _slots[index];
+
+        return slot == 0 ? ConnectionHandles<ConnectionIdType>::NoHandle : slot - 1;
+    }
+
+    template <class ConnectionIdType>
+    ConnectionIdType PieceTable<ConnectionIdType>::connectionId(int index) const {
+
+        uint32_t slot = _slots[index];
+
+        return slot == 0 ? ConnectionIdType() : _handles->id(slot - 1);
+    }
+
+    template <class ConnectionIdType>
+    bool PieceTable<ConnectionIdType>::assignedTo(int index, Handle handle) const {
+        return _slots[index] != 0 && _slots[index] - 1 == handle;
+    }
+
+    template <class ConnectionIdType>
+    unsigned int PieceTable<ConnectionIdType>::pieceSize(int index) const {
+
+        if(!_sizes.empty())
+            return _sizes[index];
+
+        return (unsigned int)index + 1 == _numberOfPieces ? _lastPieceLength : _pieceLength;
+    }
+
+    template <class ConnectionIdType>
+    unsigned int PieceTable<ConnectionIdType>::numberOfPieces(PieceState state) const {
+        return _numberOfPiecesInState[(int)state];
+    }
+
+    template <class ConnectionIdType>
+    PieceAvailability PieceTable<ConnectionIdType>::piecesInState(PieceState state) const {
+
+        // Given state in every two bit field of a word
+        const uint64_t pattern = 0x5555555555555555ULL * (uint64_t)state;
+
+        PieceAvailability pieces;
+
+        for(unsigned int i = 0;i < _states.size();i += 2) {
+
+            uint64_t block = 0;
+
+            for(unsigned int j = 0;j < 2 && i + j < _states.size();j++) {
+
+                // Low bit of each field which matches
+                uint64_t x = _states[i + j] ^ pattern;
+                x = ~(x | (x >> 1)) & 0x5555555555555555ULL;
+
+                // Gather low bits into lower half
+                x = (x | (x >> 1)) & 0x3333333333333333ULL;
+                x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+                x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+                x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+                x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+
+                block |= x << (32 * j);
+            }
+
+            pieces.append(block);
+        }
+
+        // Drop fields past last piece
+        pieces.resize(_numberOfPieces);
+
+        return pieces;
+    }
+
+    template <class ConnectionIdType>
+    void PieceTable<ConnectionIdType>::assigned(int index, Handle handle) {
+
+        assert(state(index) == PieceState::unassigned);
+        assert(handle != ConnectionHandles<ConnectionIdType>::NoHandle);
+
+        setState(index, PieceState::being_downloaded);
+        _slots[index] = handle + 1;
+    }
+
+    template <class ConnectionIdType>
+    void PieceTable<ConnectionIdType>::downloaded(int index) {
+        setState(index, PieceState::downloaded);
+        _slots[index] = 0;
+    }
+
+    template <class ConnectionIdType>
+    void PieceTable<ConnectionIdType>::deAssign(int index) {
+        setState(index, PieceState::unassigned);
+        _slots[index] = 0;
+    }
+
+    template <class ConnectionIdType>
+    void PieceTable<ConnectionIdType>::arrived(int index) {
+        setState(index, PieceState::being_validated_and_stored);
+    }
+
+    template <class ConnectionIdType>
+    void PieceTable<ConnectionIdType>::setState(int index, PieceState state) {
+
+        uint64_t & word = _states[index >> 5];
+        unsigned int shift = (index & 31) * 2;
+
+        _numberOfPiecesInState[(word >> shift) & 3]--;
+        _numberOfPiecesInState[(int)state]++;
+
+        word = (word & ~((uint64_t)3 << shift)) | ((uint64_t)state << shift);
+    }
+
+}
+}
+}
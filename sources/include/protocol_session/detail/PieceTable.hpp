@@ -0,0 +1,118 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_DETAIL_PIECETABLE_HPP
+#define JOYSTREAM_PROTOCOLSESSION_DETAIL_PIECETABLE_HPP
+
+#include <protocol_session/detail/Piece.hpp>
+#include <protocol_session/detail/ConnectionHandles.hpp>
+#include <protocol_session/PieceAvailability.hpp>
+#include <protocol_session/PieceState.hpp>
+#include <protocol_session/detail/MemoryUsage.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace joystream {
+namespace protocol_session {
+
+class TorrentPieceInformation;
+
+namespace detail {
+
+    // State of all pieces of a torrent when buying, stored column wise so that
+    // million piece torrents fit in a few MB: states are packed two bits per piece,
+    // assigned connections are referred to by handle, with ids looked up in the
+    // handles of the session, and sizes are derived from the piece length unless
+    // pieces are irregular.
+    template <class ConnectionIdType>
+    class PieceTable {
+
+    public:
+
+        typedef typename ConnectionHandles<ConnectionIdType>::Handle Handle;
+
+        PieceTable();
+
+        // Pieces of given length, except last which has its own, with those in bitfield downloaded,
+        // assigned to connections with given handles, which must outlive table
+        PieceTable(const ConnectionHandles<ConnectionIdType> *, unsigned int, unsigned int, unsigned int, const PieceAvailability &);
+
+        PieceTable(const ConnectionHandles<ConnectionIdType> *, const TorrentPieceInformation &);
+
+        // Number of pieces
+        unsigned int size() const;
+
+        // Piece with given index, e.g. for piece picker of client
+        Piece<ConnectionIdType> at(int) const;
+
+        //// Getters
+
+        PieceState state(int) const;
+
+        // Handle of connection piece is assigned to, NoHandle if not assigned
+        Handle handle(int) const;
+
+        // Id of connection piece is assigned to, default id if not assigned
+        ConnectionIdType connectionId(int) const;
+
+        // Whether piece is assigned to connection with given handle
+        bool assignedTo(int, Handle) const;
+
+        unsigned int pieceSize(int) const;
+
+        // Number of pieces in given state, maintained on every transition
+        unsigned int numberOfPieces(PieceState) const;
+
+        // Bitmap of pieces in given state, built a word at a time
+        PieceAvailability piecesInState(PieceState) const;
+
+        // Bytes held by table
+        uint64_t memoryUsage() const;
+
+        //// Transitions, as for Piece
+
+        // Piece is assigned to connection with given handle
+        void assigned(int, Handle);
+
+        // Piece has been downloaded
+        void downloaded(int);
+
+        // Piece is no longer assigned to a connection
+        void deAssign(int);
+
+        // Piece has arrived, and is being stored and validated
+        void arrived(int);
+
+    private:
+
+        void setState(int, PieceState);
+
+        const ConnectionHandles<ConnectionIdType> * _handles;
+
+        unsigned int _numberOfPieces;
+
+        // Two bits per piece
+        std::vector<uint64_t> _states;
+
+        // Number of pieces in each state
+        unsigned int _numberOfPiecesInState[4];
+
+        // Handle of connection each piece is assigned to plus one, 0 when not assigned
+        std::vector<uint32_t> _slots;
+
+        // Length of all but last piece, used unless sizes are given per piece
+        unsigned int _pieceLength;
+        unsigned int _lastPieceLength;
+        std::vector<unsigned int> _sizes;
+    };
+
+}
+}
+}
+
+// Templated type defenitions
+#include <protocol_session/detail/PieceTable.cpp>
+
+#endif // JOYSTREAM_PROTOCOLSESSION_DETAIL_PIECETABLE_HPP
@@ -0,0 +1,100 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_DETAIL_PRIORITYINDEX_HPP
+#define JOYSTREAM_PROTOCOLSESSION_DETAIL_PRIORITYINDEX_HPP
+
+#include <protocol_session/PiecePriority.hpp>
+#include <protocol_session/PieceAvailability.hpp>
+
+#include <vector>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+// Priority and availability of every piece, and which pieces are candidates for picking.
+// A max tree over candidate ranks, priority first and rarity second, finds the lowest
+// index candidate with the highest rank in O(log n). It is updated in O(log n) on inclusion,
+// exclusion and availability change of a piece, and in time linear in the length of the
+// range when priority of a range changes. Searching among candidates in a filter scans
+// the filter while descending, which is O(n) at worst, e.g. when few candidates are in it.
+class PriorityIndex {
+
+public:
+
+  PriorityIndex();
+
+  // Given number of pieces, all with default priority and none included
+  void resize(int);
+
+  int size() const;
+
+  PiecePriority priority(int) const;
+
+  // Sets priority of pieces in range [begin, end)
+  void setPriority(int begin, int end, PiecePriority);
+
+  // Whether any piece has other than default priority
+  bool hasPriorities() const;
+
+  // Number of peers having given piece, rarer pieces rank higher among those of same priority
+  uint32_t availability(int) const;
+  void addAvailability(int);
+  void removeAvailability(int);
+
+  // Same for every piece in given availability, which is empty or covers all pieces
+  void addAvailability(const PieceAvailability &);
+  void removeAvailability(const PieceAvailability &);
+
+  // Add or remove given piece from candidates
+  void include(int);
+  void exclude(int);
+
+  // Lowest index candidate with highest priority, rarest first, or -1 if there are no candidates
+  int top() const;
+
+  // Same, among candidates in given filter, which covers all pieces. Descends
+  // only into subtrees which have a piece in filter and could beat best found so far.
+  int top(const PieceAvailability &) const;
+
+  // Bytes held by index
+  uint64_t memoryUsage() const;
+
+private:
+
+  // Value of leaf of given piece, or -1 if not included
+  int32_t leaf(int) const;
+
+  // Set leaves of pieces set in given availability, and recompute nodes above them
+  void updateLeaves(const PieceAvailability &);
+
+  // Leftmost leaf of highest rank below given node, covering pieces [begin, end), which is in
+  // filter and beats rank of best found so far
+  void search(int node, int begin, int end, const PieceAvailability &, int & best, int32_t & bestRank) const;
+
+  // Recompute all nodes above leaves of pieces in range [begin, end)
+  void updateAbove(int begin, int end);
+
+  // Number of leaves, a power of two
+  int _leaves;
+
+  std::vector<PiecePriority> _priorities;
+
+  std::vector<uint32_t> _availability;
+
+  PieceAvailability _included;
+
+  // Heap ordered tree with root at 1, each node is the highest rank among included
+  // pieces below it, or -1 if there are none
+  std::vector<int32_t> _tree;
+
+  int _numberOfPiecesWithPriority;
+};
+
+}
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_DETAIL_PRIORITYINDEX_HPP
@@ -8,6 +8,8 @@
 #include <protocol_session/detail/Seller.hpp>
 #include <protocol_session/detail/Connection.hpp>
 
+#include <algorithm>
+
 namespace joystream {
 namespace protocol_session {
 namespace detail {
@@ -15,26 +17,42 @@ namespace detail {
     template <class ConnectionIdType>
     Seller<ConnectionIdType>::Seller() :
         _connection(nullptr),
-        _numberOfPiecesAwaitingValidation(0) {
+        _generation(0),
+        _piecesAwaitingArrival(8),
+        _numberOfPiecesAwaitingValidation(0),
+        _requestedAt(8),
+        _numberOfValidPieces(0),
+        _numberOfInvalidPieces(0) {
     }
 
     template <class ConnectionIdType>
-    Seller<ConnectionIdType>::Seller(Connection<ConnectionIdType> * connection) :
+    Seller<ConnectionIdType>::Seller(Connection<ConnectionIdType> * connection, uint32_t generation) :
         _connection(connection),
-        _numberOfPiecesAwaitingValidation(0) {
+        _generation(generation),
+        _piecesAwaitingArrival(8),
+        _numberOfPiecesAwaitingValidation(0),
+        _requestedAt(8),
+        _numberOfValidPieces(0),
+        _numberOfInvalidPieces(0) {
     }
 
     template <class ConnectionIdType>
-    int Seller<ConnectionIdType>::requestPiece(int i) {
+    int Seller<ConnectionIdType>::requestPiece(int i, const std::chrono::high_resolution_clock::time_point & now) {
         if(isGone())
           throw std::runtime_error("Cannot request pieces from a disconnected seller");
 
         if (_piecesAwaitingArrival.size() == 0) {
-          _frontPieceEarliestExpectedArrival = std::chrono::high_resolution_clock::now();
+          _frontPieceEarliestExpectedArrival = now;
           _servicingStartedAt = _frontPieceEarliestExpectedArrival;
         }
 
-        _piecesAwaitingArrival.push(i);
+        if (_piecesAwaitingArrival.full()) {
+          _piecesAwaitingArrival.set_capacity(2 * _piecesAwaitingArrival.capacity());
+          _requestedAt.set_capacity(_piecesAwaitingArrival.capacity());
+        }
+
+        _piecesAwaitingArrival.push_back(i);
+        _requestedAt.push_back(now);
 
         // Send request
         _connection->processEvent(protocol_statemachine::event::RequestPiece(i));
@@ -43,7 +61,7 @@ namespace detail {
     }
 
     template <class ConnectionIdType>
-    int Seller<ConnectionIdType>::fullPieceArrived() {
+    int Seller<ConnectionIdType>::fullPieceArrived(unsigned int length, const std::chrono::high_resolution_clock::time_point & now) {
         // Can't happen if there is no connection
         assert(!isGone());
 
@@ -52,21 +70,37 @@ namespace detail {
 
         int index = _piecesAwaitingArrival.front();
 
-        _piecesAwaitingArrival.pop();
+        _piecesAwaitingArrival.pop_front();
 
         _numberOfPiecesAwaitingValidation++;
 
+        _bandwidth.delivered(length, now - _frontPieceEarliestExpectedArrival, now - _requestedAt.front());
+
+        _requestedAt.pop_front();
+
         if (_piecesAwaitingArrival.size() > 0) {
-          _frontPieceEarliestExpectedArrival = std::chrono::high_resolution_clock::now();
+          _frontPieceEarliestExpectedArrival = now;
         }
 
         return index;
     }
 
+    template <class ConnectionIdType>
+    void Seller<ConnectionIdType>::payForOutstandingPieces() {
+
+        _numberOfPiecesAwaitingValidation += _piecesAwaitingArrival.size();
+        _piecesAwaitingArrival.clear();
+        _requestedAt.clear();
+
+        while(_numberOfPiecesAwaitingValidation > 0)
+            pieceWasValid();
+    }
+
     template <class ConnectionIdType>
     void Seller<ConnectionIdType>::removed() {
         _connection = nullptr;
-        _piecesAwaitingArrival = std::queue<int>();
+        _piecesAwaitingArrival.clear();
+        _requestedAt.clear();
         _numberOfPiecesAwaitingValidation = 0;
     }
 
@@ -78,6 +112,7 @@ namespace detail {
           throw std::runtime_error("seller is not expecting piece validation result");
 
         _numberOfPiecesAwaitingValidation--;
+        _numberOfValidPieces++;
 
         _connection->processEvent(protocol_statemachine::event::SendPayment());
     }
@@ -90,6 +125,7 @@ namespace detail {
         throw std::runtime_error("seller is not expecting piece validation result");
 
       _numberOfPiecesAwaitingValidation--;
+      _numberOfInvalidPieces++;
 
       // Trigger callback to session and terminate state machine
       // After seller is removed it is no longer responsible to handle validation results
@@ -101,9 +137,59 @@ namespace detail {
         return _piecesAwaitingArrival.size() > 0 || _numberOfPiecesAwaitingValidation > 0;
     }
 
+    template <class ConnectionIdType>
+    bool Seller<ConnectionIdType>::hasDeliveredPiece() const {
+        return _bandwidth.hasEstimate();
+    }
+
+    template <class ConnectionIdType>
+    double Seller<ConnectionIdType>::piecesPerSecond() const {
+        return hasDeliveredPiece() ? 1 / std::max(_bandwidth.serviceTime().count(), 1e-6) : 0;
+    }
+
+    template <class ConnectionIdType>
+    const BandwidthEstimator & Seller<ConnectionIdType>::bandwidth() const {
+        return _bandwidth;
+    }
+
+    template <class ConnectionIdType>
+    uint Seller<ConnectionIdType>::numberOfValidPieces() const {
+        return _numberOfValidPieces;
+    }
+
+    template <class ConnectionIdType>
+    uint Seller<ConnectionIdType>::numberOfInvalidPieces() const {
+        return _numberOfInvalidPieces;
+    }
+
+    template <class ConnectionIdType>
+    std::chrono::high_resolution_clock::time_point Seller<ConnectionIdType>::expectedArrival(int position, const std::chrono::high_resolution_clock::time_point & now) const {
+        assert(hasDeliveredPiece());
+
+        auto from = _piecesAwaitingArrival.empty() ? now : _frontPieceEarliestExpectedArrival;
+
+        return from + std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>((position + 1) * _bandwidth.serviceTime());
+    }
+
+    template <class ConnectionIdType>
+    double Seller<ConnectionIdType>::score() const {
+
+        if(isGone() || !hasDeliveredPiece())
+            return 0;
+
+        // Share of validated pieces which were valid, sellers without history are given benefit of the doubt
+        double reliability = (_numberOfValidPieces + 1.0) / (_numberOfValidPieces + _numberOfInvalidPieces + 1.0);
+
+        return piecesPerSecond() * reliability / (1 + _connection->price());
+    }
+
     template <class ConnectionIdType>
     typename status::Seller<ConnectionIdType> Seller<ConnectionIdType>::status() const {
-        return status::Seller<ConnectionIdType>(_connection->connectionId());
+        return status::Seller<ConnectionIdType>(_connection->connectionId(),
+                                                piecesPerSecond(),
+                                                _bandwidth.bytesPerSecond(),
+                                                _bandwidth.latency(),
+                                                score());
     }
 
     template <class ConnectionIdType>
@@ -112,17 +198,27 @@ namespace detail {
     }
 
     template <class ConnectionIdType>
-    std::queue<int> Seller<ConnectionIdType>::piecesAwaitingArrival() const {
+    uint32_t Seller<ConnectionIdType>::generation() const {
+        return _generation;
+    }
+
+    template <class ConnectionIdType>
+    const boost::circular_buffer<int> & Seller<ConnectionIdType>::piecesAwaitingArrival() const {
       return _piecesAwaitingArrival;
     }
 
+    template <class ConnectionIdType>
+    int Seller<ConnectionIdType>::numberOfPiecesAwaitingArrival() const {
+      return _piecesAwaitingArrival.size();
+    }
+
     template <class ConnectionIdType>
     int Seller<ConnectionIdType>::numberOfPiecesAwaitingValidation() const {
       return _numberOfPiecesAwaitingValidation;
     }
 
     template <class ConnectionIdType>
-    bool Seller<ConnectionIdType>::servicingPieceHasTimedOut(const std::chrono::duration<double> & timeOutLimit) const{
+    bool Seller<ConnectionIdType>::servicingPieceHasTimedOut(const std::chrono::duration<double> & timeOutLimit, const std::chrono::high_resolution_clock::time_point & now) const{
 
         if(_piecesAwaitingArrival.size() == 0)
             return false;
@@ -130,9 +226,6 @@ namespace detail {
         if(timeOutLimit == std::chrono::duration<double>::zero())
             return false;
 
-        // Get current time
-        auto now = std::chrono::high_resolution_clock::now();
-
         // Allow seller short window of time before we really test for timeouts
         if ((now - _servicingStartedAt) < std::chrono::seconds(10)) {
           return false;
@@ -141,6 +234,13 @@ namespace detail {
         // Whether time limit was exceeded
         return (now - _frontPieceEarliestExpectedArrival) > timeOutLimit;
     }
+    template <class ConnectionIdType>
+    uint64_t Seller<ConnectionIdType>::memoryUsage() const {
+        return sizeof(Seller<ConnectionIdType>) +
+               _piecesAwaitingArrival.capacity() * sizeof(int) +
+               _requestedAt.capacity() * sizeof(std::chrono::high_resolution_clock::time_point);
+    }
+
 }
 }
 }
@@ -8,8 +8,13 @@
 #ifndef JOYSTREAM_PROTOCOLSESSION_SELLER_HPP
 #define JOYSTREAM_PROTOCOLSESSION_SELLER_HPP
 
+#include <protocol_session/detail/BandwidthEstimator.hpp>
+
+#include <boost/circular_buffer.hpp>
+
 #include <string>
 #include <cstdlib>
+#include <chrono>
 
 namespace joystream {
 namespace protocol_session {
@@ -29,20 +34,26 @@ namespace detail {
 
         Seller();
 
-        Seller(Connection<ConnectionIdType> *);
+        // Given generation tells seller apart from earlier sellers whose connection had the same handle
+        Seller(Connection<ConnectionIdType> *, uint32_t);
 
-        // Used to request a piece for from the peer, returns total number of pieces awaiting arrival
+        // Used to request a piece for from the peer at given time, returns total number of pieces awaiting arrival
         // Returned value helps caller to determine wether to make additional requests
-        int requestPiece(int i);
+        int requestPiece(int i, const std::chrono::high_resolution_clock::time_point &);
+
+        const boost::circular_buffer<int> & piecesAwaitingArrival() const;
 
-        std::queue<int> piecesAwaitingArrival() const;
+        int numberOfPiecesAwaitingArrival() const;
 
         int numberOfPiecesAwaitingValidation() const;
 
         // Update state to reflect that a recently arrived full piece from this peer is being verified
         // We expect the pieces to arrive in same order they were requested. Returns the expected index of the piece
-        // which arrived
-        int fullPieceArrived();
+        // which arrived. Given byte length of piece, and time of arrival, are fed to bandwidth estimate.
+        int fullPieceArrived(unsigned int, const std::chrono::high_resolution_clock::time_point &);
+
+        // Pay for all pieces requested or awaiting validation, without taking them as delivered
+        void payForOutstandingPieces();
 
         // Seller has been removed
         void removed();
@@ -56,6 +67,27 @@ namespace detail {
         // Returns true ff there are any pieces pending arrival or waiting to be validated
         bool isPossiblyOwedPayment() const;
 
+        //// Scoring
+
+        // Whether any piece has arrived from this seller, before which there is no score
+        bool hasDeliveredPiece() const;
+
+        // Rolling average of pieces delivered per second, measured from request (or previous arrival) to arrival
+        double piecesPerSecond() const;
+
+        // Rolling estimates of delivery rate and latency
+        const BandwidthEstimator & bandwidth() const;
+
+        uint numberOfValidPieces() const;
+        uint numberOfInvalidPieces() const;
+
+        // When a piece at given position in the queue of pieces awaiting arrival, or the next one
+        // requested when position is the queue length, is expected to arrive, given current time. Requires a delivered piece.
+        std::chrono::high_resolution_clock::time_point expectedArrival(int, const std::chrono::high_resolution_clock::time_point &) const;
+
+        // Value of seller relative to others: delivery rate, discounted by share of invalid pieces and by price
+        double score() const;
+
         // Status of seller
         status::Seller<ConnectionIdType> status() const;
 
@@ -63,15 +95,24 @@ namespace detail {
 
         bool isGone() const  { return _connection == nullptr; }
 
-        bool servicingPieceHasTimedOut(const std::chrono::duration<double> &) const;
+        uint32_t generation() const;
+
+        // Bytes held by seller, including itself
+        uint64_t memoryUsage() const;
+
+        // Whether piece at front of queue has taken longer than given limit to arrive, at given time
+        bool servicingPieceHasTimedOut(const std::chrono::duration<double> &, const std::chrono::high_resolution_clock::time_point &) const;
 
     private:
 
         // Connection identifier for seller
         Connection<ConnectionIdType> * _connection;
 
-        // Pieces we are expecting from peer in order they were requested
-        std::queue<int> _piecesAwaitingArrival;
+        uint32_t _generation;
+
+        // Pieces we are expecting from peer in order they were requested.
+        // Ring buffer is only grown when full, so request/arrival cycles do not allocate
+        boost::circular_buffer<int> _piecesAwaitingArrival;
 
         int _numberOfPiecesAwaitingValidation;
 
@@ -80,6 +121,14 @@ namespace detail {
         // This is used to determine if servicing the next piece has timed out.
         std::chrono::high_resolution_clock::time_point _frontPieceEarliestExpectedArrival;
 
+        // When each piece awaiting arrival was requested, parallel to _piecesAwaitingArrival
+        boost::circular_buffer<std::chrono::high_resolution_clock::time_point> _requestedAt;
+
+        BandwidthEstimator _bandwidth;
+
+        uint _numberOfValidPieces;
+        uint _numberOfInvalidPieces;
+
         // Point in time when requests began. This is reset when the queue is drained and requests restart
         // We use this reference point to allow a small window of time for the seller to service pieces
         // and can't be considered to be be timed out.
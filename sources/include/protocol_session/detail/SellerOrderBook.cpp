@@ -0,0 +1,75 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#include <protocol_session/detail/SellerOrderBook.hpp>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+    template <class ConnectionIdType>
+    SellerOrderBook<ConnectionIdType>::SellerOrderBook() {
+    }
+
+    template <class ConnectionIdType>
+    void SellerOrderBook<ConnectionIdType>::update(const ConnectionIdType & id, const protocol_wire::SellerTerms & terms) {
+
+        remove(id);
+
+        _terms.insert(std::make_pair(id, terms));
+        _byPrice.insert(std::make_pair(terms.minPrice(), id));
+    }
+
+    template <class ConnectionIdType>
+    void SellerOrderBook<ConnectionIdType>::remove(const ConnectionIdType & id) {
+
+        auto itr = _terms.find(id);
+
+        if(itr == _terms.end())
+            return;
+
+        _byPrice.erase(std::make_pair(itr->second.minPrice(), id));
+        _terms.erase(itr);
+    }
+
+    template <class ConnectionIdType>
+    void SellerOrderBook<ConnectionIdType>::clear() {
+        _terms.clear();
+        _byPrice.clear();
+    }
+
+    template <class ConnectionIdType>
+    const protocol_wire::SellerTerms * SellerOrderBook<ConnectionIdType>::terms(const ConnectionIdType & id) const {
+
+        auto itr = _terms.find(id);
+
+        return itr == _terms.cend() ? nullptr : &itr->second;
+    }
+
+    template <class ConnectionIdType>
+    void SellerOrderBook<ConnectionIdType>::compatibleSellers(const protocol_wire::BuyerTerms & buyerTerms,
+                                                              unsigned int maxNumberOfSellers,
+                                                              std::vector<ConnectionIdType> & sellers) const {
+
+        sellers.clear();
+
+        // Sellers asking more than we pay are never compatible, remaining terms are checked one by one
+        for(auto itr = _byPrice.cbegin();itr != _byPrice.cend() && itr->first <= buyerTerms.maxPrice();itr++) {
+
+            if(maxNumberOfSellers != 0 && sellers.size() == maxNumberOfSellers)
+                break;
+
+            if(buyerTerms.satisfiedBy(_terms.at(itr->second)))
+                sellers.push_back(itr->second);
+        }
+    }
+
+    template <class ConnectionIdType>
+    unsigned int SellerOrderBook<ConnectionIdType>::size() const {
+        return _terms.size();
+    }
+
+}
+}
+}
@@ -0,0 +1,62 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_DETAIL_SELLERORDERBOOK_HPP
+#define JOYSTREAM_PROTOCOLSESSION_DETAIL_SELLERORDERBOOK_HPP
+
+#include <protocol_wire/protocol_wire.hpp>
+
+#include <map>
+#include <set>
+#include <vector>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+    // Terms of peers currently announcing sell mode, ordered by price, so that
+    // compatible sellers are found without going through every connection.
+    // Kept up to date from announcements of peers.
+    template <class ConnectionIdType>
+    class SellerOrderBook {
+
+    public:
+
+        SellerOrderBook();
+
+        // Adds seller, or updates terms of existing seller
+        void update(const ConnectionIdType &, const protocol_wire::SellerTerms &);
+
+        // Removes seller, if present
+        void remove(const ConnectionIdType &);
+
+        void clear();
+
+        // Terms announced by given seller, nullptr if peer does not announce sell mode
+        const protocol_wire::SellerTerms * terms(const ConnectionIdType &) const;
+
+        // Sets given vector to the cheapest sellers with terms satisfied by given buyer terms,
+        // at most given number of them, where 0 means all
+        void compatibleSellers(const protocol_wire::BuyerTerms &, unsigned int, std::vector<ConnectionIdType> &) const;
+
+        // Number of sellers
+        unsigned int size() const;
+
+    private:
+
+        // Terms of each seller
+        std::map<ConnectionIdType, protocol_wire::SellerTerms> _terms;
+
+        // Sellers by minimum price
+        std::set<std::pair<uint64_t, ConnectionIdType>> _byPrice;
+    };
+
+}
+}
+}
+
+// Templated type defenitions
+#include <protocol_session/detail/SellerOrderBook.cpp>
+
+#endif // JOYSTREAM_PROTOCOLSESSION_DETAIL_SELLERORDERBOOK_HPP
@@ -12,6 +12,9 @@
 #include <protocol_session/detail/Observing.hpp>
 #include <protocol_session/detail/PieceDeliveryPipeline.hpp>
 
+#include <algorithm>
+#include <climits>
+
 namespace joystream {
 namespace protocol_session {
 namespace detail {
@@ -34,7 +37,14 @@ namespace detail {
         , _terms(terms)
         , _MAX_PIECE_INDEX(MAX_PIECE_INDEX)
         , _maxOutstandingPayments(4)
-        , _maxPiecesToPreload(2) {
+        , _maxPiecesToPreload(2)
+        , _numberOfSpeedTestsServed(0)
+        , _speedTestBytesServed(0)
+        , _removedBuyersThrottledTime(0)
+        , _bytesBuffered(0)
+        , _piecesLoading(0)
+        , _largestPieceLength(0)
+        , _bytesEvicted(0) {
 
         // Notify any existing peers
         for(auto itr : _session->_connections) {
@@ -111,21 +121,33 @@ namespace detail {
         if(_session->state() == SessionState::stopped)
           return;
 
+        if(data.length() > _largestPieceLength)
+          _largestPieceLength = data.length();
+
+        // Borrow the reusable buffer, see tryToLoadPieces
+        std::vector<detail::Connection<ConnectionIdType> *> servicing;
+        servicing.swap(_connectionsBuffer);
+
+        _session-> template connectionsInState<joystream::protocol_statemachine::ServicingPieceRequests>(servicing);
+
         // Go through all buyer connections we are servicing and fill their delivery pipeline
-        for(auto m : _session->_connections) {
-          detail::Connection<ConnectionIdType> * c = m.second;
+        for(detail::Connection<ConnectionIdType> * c : servicing) {
 
           // Make sure connection is still in appropriate state
           if(!c-> template inState<joystream::protocol_statemachine::ServicingPieceRequests>())
               continue;
 
-          c->pieceDeliveryPipeline().dataReady(index, data);
+          updatePipeline(c, [&data, index](PieceDeliveryPipeline & pipeline) { pipeline.dataReady(index, data); });
 
           // If we are started, then send off
           if(_session->state() == SessionState::started) {
               tryToSendPieces(c);
           }
         }
+
+        // Return buffer for reuse
+        servicing.clear();
+        _connectionsBuffer.swap(servicing);
     }
 
     template<class ConnectionIdType>
@@ -234,12 +256,12 @@ namespace detail {
 
         auto connection = _session->get(id);
 
-        const paymentchannel::Payee & payee = connection->payee();
-
-        _receivedValidPayment(id, payee.price(), payee.numberOfPaymentsMade(), payee.amountPaid());
+        _receivedValidPayment(id, connection->price(), connection->numberOfPayments(), connection->amountPaid());
 
         // assert that this payment should be for the piece at the front of the queue
-        connection->pieceDeliveryPipeline().paymentReceived();
+        updatePipeline(connection, [](PieceDeliveryPipeline & pipeline) { pipeline.paymentReceived(); });
+
+        uploadProgressed(connection);
 
         if (_session->state() == SessionState::started) {
             tryToSendPieces(connection);
@@ -298,6 +320,12 @@ namespace detail {
           throw protocol_statemachine::exception::StateMachineDeletedException();
         }
 
+        // Payload is served from shared buffer by send callback
+        _session->_speedTestPayloadPool->reserve(payloadSize);
+
+        _numberOfSpeedTestsServed++;
+        _speedTestBytesServed += payloadSize;
+
         connection->startingSpeedTest();
         connection->processEvent(protocol_statemachine::event::SendTestPayload());
         connection->endingSpeedTest();
@@ -312,6 +340,8 @@ namespace detail {
         // For each connection: Notify client to claim last payment made
         for(auto itr : _session->_connections)
             tryToClaimLastPayment(itr.second);
+
+        removeUploadFlows();
     }
 
     template<class ConnectionIdType>
@@ -328,16 +358,10 @@ namespace detail {
 
         //// if we are here, we are paused
 
-        // For each connection: iteration safe deletion
-        for(auto m : _session->_connections) {
-
-            detail::Connection<ConnectionIdType> * c = m.second;
-
-            // Waiting for piece to be loaded, which may have been aborted due to pause
-            if(c-> template inState<protocol_statemachine::ServicingPieceRequests>()) {
-                tryToSendPieces(c);
-                tryToLoadPieces(c);
-            }
+        // Waiting for piece to be loaded, which may have been aborted due to pause
+        for(detail::Connection<ConnectionIdType> * c : _session-> template connectionsInState<protocol_statemachine::ServicingPieceRequests>()) {
+            tryToSendPieces(c);
+            tryToLoadPieces(c);
         }
     }
 
@@ -350,7 +374,7 @@ namespace detail {
 
         // Disconnect everyone: iteration safe deletion
         for(auto it = _session->_connections.cbegin(); it != _session->_connections.cend();)
-            it = removeConnection(it->first, DisconnectCause::client);
+            it = removeConnection(it->second->connectionId(), DisconnectCause::client);
 
         // Update state
         _session->_state = SessionState::stopped;
@@ -370,7 +394,41 @@ namespace detail {
 
     template <class ConnectionIdType>
     void Selling<ConnectionIdType>::tick() {
-        // Nothing to do
+
+        if(_session->state() != SessionState::started)
+            return;
+
+        bool rateLimited = _session->_uploadRateLimitPolicy.isEnabled();
+        bool budgeted = _session->_bufferedPieceDataPolicy.isEnabled();
+
+        // Make room for buyers which are paying
+        if(budgeted)
+            evictStalledBuyers(_session->_getTime());
+
+        // Pieces held back by rate limits, and loads held back by buffered piece data budget
+        if(rateLimited || budgeted) {
+
+            std::vector<detail::Connection<ConnectionIdType> *> servicing;
+            servicing.swap(_connectionsBuffer);
+
+            _session-> template connectionsInState<joystream::protocol_statemachine::ServicingPieceRequests>(servicing);
+
+            for(detail::Connection<ConnectionIdType> * c : servicing) {
+
+                if(rateLimited && c-> template inState<joystream::protocol_statemachine::ServicingPieceRequests>())
+                    tryToSendPieces(c);
+
+                if(budgeted && c-> template inState<joystream::protocol_statemachine::ServicingPieceRequests>())
+                    tryToLoadPieces(c);
+            }
+
+            servicing.clear();
+            _connectionsBuffer.swap(servicing);
+        }
+
+        // Pieces held back when upload budget ran out
+        if(_uploadScheduler)
+            _uploadScheduler->run(_session->_getTime());
     }
 
     template<class ConnectionIdType>
@@ -386,7 +444,21 @@ namespace detail {
 
     template<class ConnectionIdType>
     status::Selling Selling<ConnectionIdType>::status() const {
-        return status::Selling(_terms);
+        std::chrono::high_resolution_clock::time_point now = _session->_getTime();
+
+        std::chrono::duration<double> buyerThrottledTime = _removedBuyersThrottledTime;
+
+        for(const auto & mapping : _session->_connections)
+            buyerThrottledTime += mapping.second->uploadLimit().throttledTime(now);
+
+        return status::Selling(_terms,
+                               _numberOfSpeedTestsServed,
+                               _speedTestBytesServed,
+                               _sessionUploadLimit.throttledTime(now),
+                               buyerThrottledTime,
+                               _bytesBuffered,
+                               _piecesLoading,
+                               _bytesEvicted);
     }
 
     template<class ConnectionIdType>
@@ -406,6 +478,14 @@ namespace detail {
         // Claim payment
         tryToClaimLastPayment(c);
 
+        removeUploadFlow(c);
+
+        _removedBuyersThrottledTime += c->uploadLimit().throttledTime(_session->_getTime());
+
+        // Data held for buyer goes with connection
+        _bytesBuffered -= c->pieceDeliveryPipeline().bytesBuffered();
+        _piecesLoading -= c->pieceDeliveryPipeline().piecesLoading();
+
         // Notify client to remove connection
         _removedConnection(id, cause);
 
@@ -419,12 +499,25 @@ namespace detail {
         assert(_session->state() == SessionState::started);
         assert(c-> template inState<joystream::protocol_statemachine::ServicingPieceRequests>());
 
-        auto piecesToLoad = c->pieceDeliveryPipeline().getNextBatchToLoad(_maxOutstandingPayments + _maxPiecesToPreload);
+        // Borrow the reusable buffer, a reentrant call from the client callback
+        // will find it empty and use its own
+        std::vector<int> piecesToLoad;
+        piecesToLoad.swap(_piecesToLoadBuffer);
+
+        int maxPieces = piecesToLoadWithinBudget(c, _session->_getTime());
+
+        updatePipeline(c, [this, maxPieces, &piecesToLoad](PieceDeliveryPipeline & pipeline) {
+          pipeline.getNextBatchToLoad(_maxOutstandingPayments + _maxPiecesToPreload, piecesToLoad, maxPieces);
+        });
 
         for (auto index : piecesToLoad) {
           _loadPieceForBuyer(c->connectionId(), index);
         }
 
+        // Return buffer for reuse
+        piecesToLoad.clear();
+        _piecesToLoadBuffer.swap(piecesToLoad);
+
     }
     template<class ConnectionIdType>
     void Selling<ConnectionIdType>::tryToSendPieces(detail::Connection<ConnectionIdType> * c) {
@@ -432,23 +525,266 @@ namespace detail {
       assert(_session->state() == SessionState::started);
       assert(c-> template inState<joystream::protocol_statemachine::ServicingPieceRequests>());
 
-      auto piecesToSend = c->pieceDeliveryPipeline().getNextBatchToSend(_maxOutstandingPayments);
+      // Upload budget is shared, so scheduler decides when pieces are sent
+      if(_session->_uploadScheduler) {
+        scheduleUpload(c);
+        return;
+      }
+
+      // Send one piece at a time, as long as rate limits allow
+      if(_session->_uploadRateLimitPolicy.isEnabled()) {
+
+        std::chrono::high_resolution_clock::time_point now = _session->_getTime();
+
+        protocol_wire::PieceData data;
+
+        for(const protocol_wire::PieceData * next = c->pieceDeliveryPipeline().nextToSend(_maxOutstandingPayments);
+            next != nullptr && uploadAllowed(c, next->length(), now);
+            next = c->pieceDeliveryPipeline().nextToSend(_maxOutstandingPayments)) {
+
+          updatePipeline(c, [this, &data](PieceDeliveryPipeline & pipeline) { pipeline.takeNextToSend(_maxOutstandingPayments, data); });
+
+          uploaded(c, data.length());
+          uploadProgressed(c);
+
+          //send piece
+          c->processEvent(joystream::protocol_statemachine::event::PieceLoaded(data));
+        }
+
+        return;
+      }
 
-      for (auto data : piecesToSend) {
+      // Borrow the reusable buffer, see tryToLoadPieces
+      std::vector<protocol_wire::PieceData> piecesToSend;
+      piecesToSend.swap(_piecesToSendBuffer);
+
+      updatePipeline(c, [this, &piecesToSend](PieceDeliveryPipeline & pipeline) { pipeline.getNextBatchToSend(_maxOutstandingPayments, piecesToSend); });
+
+      if(!piecesToSend.empty())
+        uploadProgressed(c);
+
+      for (const auto & data : piecesToSend) {
         //send piece
         c->processEvent(joystream::protocol_statemachine::event::PieceLoaded(data));
       }
 
+      // Return buffer for reuse, releasing references to piece data
+      piecesToSend.clear();
+      _piecesToSendBuffer.swap(piecesToSend);
+
     }
 
     template<class ConnectionIdType>
-    void Selling<ConnectionIdType>::tryToClaimLastPayment(detail::Connection<ConnectionIdType> * c) {
+    void Selling<ConnectionIdType>::scheduleUpload(detail::Connection<ConnectionIdType> * c) {
+
+      // Flows belong to the scheduler they were added to
+      if(_uploadScheduler != _session->_uploadScheduler) {
+        removeUploadFlows();
+        _uploadScheduler = _session->_uploadScheduler;
+      }
+
+      boost::optional<UploadScheduler::Flow> & flow = c->uploadFlow();
+
+      if(!flow) {
+
+        const ConnectionIdType id = c->connectionId();
+
+        flow = _uploadScheduler->add([this, id]() { return this->nextUploadSize(id); },
+                                     [this, id]() { this->uploadNextPiece(id); });
+      }
+
+      // Better paying buyers get a larger share
+      _uploadScheduler->setWeight(*flow, c->price());
+      _uploadScheduler->schedule(*flow);
+
+      // Keep reference, as sending may remove this session from scheduler
+      std::shared_ptr<UploadScheduler> scheduler = _uploadScheduler;
+
+      scheduler->run(_session->_getTime());
+    }
+
+    template<class ConnectionIdType>
+    uint32_t Selling<ConnectionIdType>::nextUploadSize(const ConnectionIdType & id) {
+
+      if(_session->state() != SessionState::started || !_session->hasConnection(id))
+        return 0;
+
+      detail::Connection<ConnectionIdType> * c = _session->get(id);
+
+      if(!c-> template inState<joystream::protocol_statemachine::ServicingPieceRequests>())
+        return 0;
+
+      const protocol_wire::PieceData * data = c->pieceDeliveryPipeline().nextToSend(_maxOutstandingPayments);
+
+      // Held back by rate limits, flow is scheduled again by tick
+      if(data == nullptr || !uploadAllowed(c, data->length(), _session->_getTime()))
+        return 0;
+
+      return data->length();
+    }
+
+    template<class ConnectionIdType>
+    void Selling<ConnectionIdType>::uploadNextPiece(const ConnectionIdType & id) {
 
-        // If at least one payment is made, then send claims notification
-        paymentchannel::Payee payee = c->payee();
+      // Scheduler only asks after nextUploadSize found a piece
+      detail::Connection<ConnectionIdType> * c = _session->get(id);
+
+      protocol_wire::PieceData data;
+      bool taken = false;
+
+      updatePipeline(c, [this, &data, &taken](PieceDeliveryPipeline & pipeline) { taken = pipeline.takeNextToSend(_maxOutstandingPayments, data); });
+
+      if(taken) {
+        uploaded(c, data.length());
+        uploadProgressed(c);
+        c->processEvent(joystream::protocol_statemachine::event::PieceLoaded(data));
+      }
+    }
+
+    template<class ConnectionIdType>
+    bool Selling<ConnectionIdType>::uploadAllowed(detail::Connection<ConnectionIdType> * c, uint32_t bytes, std::chrono::high_resolution_clock::time_point now) {
+
+      const UploadRateLimitPolicy & policy = _session->_uploadRateLimitPolicy;
+
+      if(!policy.isEnabled())
+        return true;
+
+      // Policy may have been changed since last send
+      detail::TokenBucket & buyerLimit = c->uploadLimit();
+
+      buyerLimit.setRate(policy.buyerBytesPerSecond(), policy.buyerBurst());
+      _sessionUploadLimit.setRate(policy.sessionBytesPerSecond(), policy.sessionBurst());
+
+      // Session limit is only asked when buyer limit allows, so it is not counted as throttled on behalf of a buyer
+      return buyerLimit.allows(bytes, now) && _sessionUploadLimit.allows(bytes, now);
+    }
+
+    template<class ConnectionIdType>
+    void Selling<ConnectionIdType>::uploaded(detail::Connection<ConnectionIdType> * c, uint32_t bytes) {
+
+      if(!_session->_uploadRateLimitPolicy.isEnabled())
+        return;
+
+      c->uploadLimit().spend(bytes);
+      _sessionUploadLimit.spend(bytes);
+    }
+
+    template<class ConnectionIdType>
+    template<class Operation>
+    void Selling<ConnectionIdType>::updatePipeline(detail::Connection<ConnectionIdType> * c, const Operation & operation) {
+
+      PieceDeliveryPipeline & pipeline = c->pieceDeliveryPipeline();
+
+      uint64_t bytesBuffered = pipeline.bytesBuffered();
+      int piecesLoading = pipeline.piecesLoading();
+
+      operation(pipeline);
+
+      _bytesBuffered = _bytesBuffered - bytesBuffered + pipeline.bytesBuffered();
+      _piecesLoading = _piecesLoading - piecesLoading + pipeline.piecesLoading();
+    }
+
+    template<class ConnectionIdType>
+    uint64_t Selling<ConnectionIdType>::bytesCommitted() const {
+      return _bytesBuffered + (uint64_t)_piecesLoading * _largestPieceLength;
+    }
+
+    template<class ConnectionIdType>
+    int Selling<ConnectionIdType>::piecesToLoadWithinBudget(detail::Connection<ConnectionIdType> * c, std::chrono::high_resolution_clock::time_point now) const {
+
+      const BufferedPieceDataPolicy & policy = _session->_bufferedPieceDataPolicy;
+
+      if(!policy.isEnabled())
+        return INT_MAX;
+
+      // Data evicted for a stalled buyer is loaded again once it pays
+      if(isStalled(c, now))
+        return 0;
+
+      uint64_t committed = bytesCommitted();
+
+      // Always allow a single piece when nothing is held, so a budget smaller
+      // than a piece, or not knowing piece size yet, does not stop uploading
+      if(committed == 0)
+        return 1;
+
+      if(_largestPieceLength == 0 || committed >= policy.maxBytes())
+        return 0;
+
+      return (int)std::min<uint64_t>((policy.maxBytes() - committed) / _largestPieceLength, INT_MAX);
+    }
+
+    template<class ConnectionIdType>
+    bool Selling<ConnectionIdType>::isStalled(detail::Connection<ConnectionIdType> * c, std::chrono::high_resolution_clock::time_point now) const {
+
+      if(!c->pieceDeliveryPipeline().awaitingPayment())
+        return false;
+
+      const boost::optional<std::chrono::high_resolution_clock::time_point> & lastUploadProgress = c->lastUploadProgress();
+
+      // Nothing sent while budget was in place
+      if(!lastUploadProgress)
+        return false;
+
+      return now - *lastUploadProgress >= _session->_bufferedPieceDataPolicy.stallTimeout();
+    }
+
+    template<class ConnectionIdType>
+    void Selling<ConnectionIdType>::uploadProgressed(detail::Connection<ConnectionIdType> * c) {
+
+      if(!_session->_bufferedPieceDataPolicy.isEnabled())
+        return;
+
+      c->lastUploadProgress() = _session->_getTime();
+    }
+
+    template<class ConnectionIdType>
+    void Selling<ConnectionIdType>::evictStalledBuyers(std::chrono::high_resolution_clock::time_point now) {
+
+      // Only when budget is used up, otherwise data is kept in case buyer resumes
+      if(bytesCommitted() < _session->_bufferedPieceDataPolicy.maxBytes())
+        return;
+
+      for(const auto & mapping : _session->_connections) {
+
+        detail::Connection<ConnectionIdType> * c = mapping.second;
+
+        if(c->pieceDeliveryPipeline().bytesBuffered() == 0 || !isStalled(c, now))
+          continue;
+
+        uint64_t released = c->pieceDeliveryPipeline().evictBuffered();
+
+        _bytesBuffered -= released;
+        _bytesEvicted += released;
+      }
+    }
+
+    template<class ConnectionIdType>
+    void Selling<ConnectionIdType>::removeUploadFlow(detail::Connection<ConnectionIdType> * c) {
+
+      boost::optional<UploadScheduler::Flow> & flow = c->uploadFlow();
+
+      if(!flow)
+        return;
+
+      _uploadScheduler->remove(*flow);
+      flow = boost::none;
+    }
+
+    template<class ConnectionIdType>
+    void Selling<ConnectionIdType>::removeUploadFlows() {
+
+      for(const auto & mapping : _session->_connections)
+        removeUploadFlow(mapping.second);
+    }
+
+    template<class ConnectionIdType>
+    void Selling<ConnectionIdType>::tryToClaimLastPayment(detail::Connection<ConnectionIdType> * c) {
 
-        if(payee.numberOfPaymentsMade() > 0)
-            _claimLastPayment(c->connectionId(), payee);
+        // If at least one payment is made, then send claims notification,
+        // only then is the payee copied out of the state machine
+        if(c->numberOfPayments() > 0)
+            _claimLastPayment(c->connectionId(), c->payee());
     }
 }
 }
@@ -9,6 +9,7 @@
 #define JOYSTREAM_PROTOCOL_SELLING_HPP
 
 #include <protocol_session/Session.hpp>
+#include <protocol_session/detail/TokenBucket.hpp>
 #include <protocol_wire/protocol_wire.hpp>
 
 namespace Coin {
@@ -132,11 +133,84 @@ private:
     // For now value is hardcoded to 2
     const int _maxPiecesToPreload;
 
+    // Buffers reused for batches taken from piece delivery pipelines,
+    // avoids allocating on every piece loaded and payment received
+    std::vector<int> _piecesToLoadBuffer;
+    std::vector<protocol_wire::PieceData> _piecesToSendBuffer;
+    std::vector<detail::Connection<ConnectionIdType> *> _connectionsBuffer;
+
+    // Speed tests served, and total size of their payloads
+    uint64_t _numberOfSpeedTestsServed;
+    uint64_t _speedTestBytesServed;
+
+    // Scheduler flows were added to, flow of each buyer is kept on its connection
+    std::shared_ptr<UploadScheduler> _uploadScheduler;
+
+    // Upload rate limit of session, limit of each buyer is kept on its connection, see UploadRateLimitPolicy
+    detail::TokenBucket _sessionUploadLimit;
+
+    // Time held back by limits of buyers which are gone
+    std::chrono::duration<double> _removedBuyersThrottledTime;
+
+    // Sums over piece delivery pipelines of all connections, see BufferedPieceDataPolicy
+    uint64_t _bytesBuffered;
+    int _piecesLoading;
+
+    // Largest piece loaded so far, used as size of pieces being loaded
+    uint32_t _largestPieceLength;
+
+    // Bytes dropped for stalled buyers
+    uint64_t _bytesEvicted;
+
     // Prepare given connection for deletion due to given cause, returns next valid iterator (e.g. end)
     typename detail::ConnectionMap<ConnectionIdType>::const_iterator removeConnection(const ConnectionIdType &, DisconnectCause);
 
     void tryToSendPieces(detail::Connection<ConnectionIdType> *);
 
+    //// Upload scheduling
+
+    // Have upload scheduler of session send pieces of given connection
+    void scheduleUpload(detail::Connection<ConnectionIdType> *);
+
+    // Scheduler calls these for flow of connection with given id
+    uint32_t nextUploadSize(const ConnectionIdType &);
+    void uploadNextPiece(const ConnectionIdType &);
+
+    // Drop flow of given connection, if any
+    void removeUploadFlow(detail::Connection<ConnectionIdType> *);
+
+    // Drop all flows, e.g. when leaving mode or scheduler was replaced
+    void removeUploadFlows();
+
+    //// Upload rate limits
+
+    // Whether rate limits allow sending given number of bytes to given buyer at given time
+    bool uploadAllowed(detail::Connection<ConnectionIdType> *, uint32_t, std::chrono::high_resolution_clock::time_point);
+
+    // Charge rate limits for bytes sent to given buyer
+    void uploaded(detail::Connection<ConnectionIdType> *, uint32_t);
+
+    //// Buffered piece data budget
+
+    // Runs given operation on piece delivery pipeline of connection, keeping sums over pipelines up to date
+    template<class Operation>
+    void updatePipeline(detail::Connection<ConnectionIdType> *, const Operation &);
+
+    // Bytes buffered, and expected to be buffered once pieces being loaded arrive
+    uint64_t bytesCommitted() const;
+
+    // Number of pieces which may be loaded for given connection within budget
+    int piecesToLoadWithinBudget(detail::Connection<ConnectionIdType> *, std::chrono::high_resolution_clock::time_point) const;
+
+    // Buyer is waiting to pay and has not made progress within stall timeout
+    bool isStalled(detail::Connection<ConnectionIdType> *, std::chrono::high_resolution_clock::time_point) const;
+
+    // Record that a piece was sent to, or a payment arrived from, given buyer
+    void uploadProgressed(detail::Connection<ConnectionIdType> *);
+
+    // Drop data held for stalled buyers
+    void evictStalledBuyers(std::chrono::high_resolution_clock::time_point);
+
     void tryToLoadPieces(detail::Connection<ConnectionIdType> *);
 
     // If at least one payment is made, then send claims notification
@@ -0,0 +1,70 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#ifndef JOYSTREAM_PROTOCOLSESSION_DETAIL_TOKENBUCKET_HPP
+#define JOYSTREAM_PROTOCOLSESSION_DETAIL_TOKENBUCKET_HPP
+
+#include <chrono>
+#include <cstdint>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+// Rate limit in bytes, refilled with time passed as given by caller. Also keeps
+// track of how long sending was held back, from the first refused send until the next allowed one.
+class TokenBucket {
+
+public:
+
+  // No limit
+  TokenBucket();
+
+  TokenBucket(uint64_t bytesPerSecond, uint64_t burst);
+
+  // Rate of 0 means no limit, tokens beyond new burst size are dropped
+  void setRate(uint64_t bytesPerSecond, uint64_t burst);
+
+  bool isLimited() const;
+
+  uint64_t bytesPerSecond() const;
+
+  uint64_t burst() const;
+
+  // Whether given number of bytes can be sent at given time, a send
+  // larger than the burst size is allowed once the bucket is full
+  bool allows(uint64_t, std::chrono::high_resolution_clock::time_point);
+
+  // Take tokens for bytes sent, may leave bucket in debt
+  void spend(uint64_t);
+
+  // Total time held back, up to given time
+  std::chrono::duration<double> throttledTime(std::chrono::high_resolution_clock::time_point) const;
+
+private:
+
+  void refill(std::chrono::high_resolution_clock::time_point);
+
+  uint64_t _bytesPerSecond;
+
+  uint64_t _burst;
+
+  // Negative when in debt
+  double _tokens;
+
+  // Last refill, if any
+  bool _refilled;
+  std::chrono::high_resolution_clock::time_point _lastRefill;
+
+  // Whether last call to allows refused, since when, and time held back before that
+  bool _throttled;
+  std::chrono::high_resolution_clock::time_point _throttledSince;
+  std::chrono::duration<double> _throttledTime;
+};
+
+}
+}
+}
+
+#endif // JOYSTREAM_PROTOCOLSESSION_DETAIL_TOKENBUCKET_HPP
@@ -15,5 +15,12 @@
 #include <protocol_session/Callbacks.hpp>
 #include <protocol_session/TorrentPieceInformation.hpp>
 #include <protocol_session/PieceInformation.hpp>
+#include <protocol_session/PieceAvailability.hpp>
+#include <protocol_session/PiecePriority.hpp>
+#include <protocol_session/SpeedTestPayloadPool.hpp>
+#include <protocol_session/BuyingCheckpoint.hpp>
+#include <protocol_session/UploadScheduler.hpp>
+#include <protocol_session/UploadRateLimitPolicy.hpp>
+#include <protocol_session/BufferedPieceDataPolicy.hpp>
 
 #endif // JOYSTREAM_PROTOCOL_SESSION_HPP
@@ -0,0 +1,86 @@
+#include <protocol_session/AllocationAccounting.hpp>
+
+namespace joystream {
+namespace protocol_session {
+
+  namespace {
+    // Plain thread local counters, so recording never allocates
+    thread_local uint64_t allocations = 0;
+    thread_local uint64_t deallocations = 0;
+    thread_local uint64_t bytesAllocated = 0;
+    thread_local bool counting = true;
+
+    bool installed = false;
+  }
+
+  AllocationStatistics::AllocationStatistics()
+    : allocations(0)
+    , deallocations(0)
+    , bytesAllocated(0) {
+  }
+
+  AllocationStatistics AllocationStatistics::operator-(const AllocationStatistics & o) const {
+    AllocationStatistics s;
+
+    s.allocations = allocations - o.allocations;
+    s.deallocations = deallocations - o.deallocations;
+    s.bytesAllocated = bytesAllocated - o.bytesAllocated;
+
+    return s;
+  }
+
+  bool AllocationAccounting::hooksInstalled() {
+    return installed;
+  }
+
+  AllocationStatistics AllocationAccounting::current() {
+    AllocationStatistics s;
+
+    s.allocations = allocations;
+    s.deallocations = deallocations;
+    s.bytesAllocated = bytesAllocated;
+
+    return s;
+  }
+
+  bool AllocationAccounting::isCounting() {
+    return counting;
+  }
+
+  void AllocationAccounting::recordAllocation(std::size_t size) {
+    if(!counting)
+      return;
+
+    allocations++;
+    bytesAllocated += size;
+  }
+
+  void AllocationAccounting::recordDeallocation() {
+    if(!counting)
+      return;
+
+    deallocations++;
+  }
+
+  void AllocationAccounting::markHooksInstalled() {
+    installed = true;
+  }
+
+  AllocationScope::AllocationScope()
+    : _start(AllocationAccounting::current()) {
+  }
+
+  AllocationStatistics AllocationScope::statistics() const {
+    return AllocationAccounting::current() - _start;
+  }
+
+  AllocationCounting::AllocationCounting(bool on)
+    : _previous(counting) {
+    counting = on;
+  }
+
+  AllocationCounting::~AllocationCounting() {
+    counting = _previous;
+  }
+}
+}
@@ -0,0 +1,69 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#include <protocol_session/detail/BandwidthEstimator.hpp>
+
+#include <algorithm>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+constexpr double BandwidthEstimator::_weight;
+
+BandwidthEstimator::BandwidthEstimator()
+  : _numberOfSamples(0)
+  , _bytesDelivered(0)
+  , _serviceTime(std::chrono::duration<double>::zero())
+  , _latency(std::chrono::duration<double>::zero())
+  , _bytesPerSecond(0) {
+}
+
+void BandwidthEstimator::delivered(uint64_t length, std::chrono::duration<double> serviceTime, std::chrono::duration<double> latency) {
+
+  // Clock resolution may make back to back arrivals appear instantaneous
+  double seconds = std::max(serviceTime.count(), 1e-6);
+  double rate = length / seconds;
+
+  if(_numberOfSamples == 0) {
+    _serviceTime = serviceTime;
+    _latency = latency;
+    _bytesPerSecond = rate;
+  } else {
+    _serviceTime = (1 - _weight) * _serviceTime + _weight * serviceTime;
+    _latency = (1 - _weight) * _latency + _weight * latency;
+    _bytesPerSecond = (1 - _weight) * _bytesPerSecond + _weight * rate;
+  }
+
+  _numberOfSamples++;
+  _bytesDelivered += length;
+}
+
+bool BandwidthEstimator::hasEstimate() const {
+  return _numberOfSamples > 0;
+}
+
+uint64_t BandwidthEstimator::numberOfSamples() const {
+  return _numberOfSamples;
+}
+
+uint64_t BandwidthEstimator::bytesDelivered() const {
+  return _bytesDelivered;
+}
+
+std::chrono::duration<double> BandwidthEstimator::serviceTime() const {
+  return _serviceTime;
+}
+
+std::chrono::duration<double> BandwidthEstimator::latency() const {
+  return _latency;
+}
+
+double BandwidthEstimator::bytesPerSecond() const {
+  return _bytesPerSecond;
+}
+
+}
+}
+}
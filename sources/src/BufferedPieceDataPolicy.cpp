@@ -0,0 +1,33 @@
+#include <protocol_session/BufferedPieceDataPolicy.hpp>
+
+
+namespace joystream {
+namespace protocol_session {
+
+  BufferedPieceDataPolicy::BufferedPieceDataPolicy() :
+    _maxBytes(0),
+    _stallTimeout(std::chrono::seconds(10)) {
+
+  }
+
+  bool BufferedPieceDataPolicy::isEnabled() const {
+    return _maxBytes != 0;
+  }
+
+  uint64_t BufferedPieceDataPolicy::maxBytes() const {
+    return _maxBytes;
+  }
+
+  std::chrono::seconds BufferedPieceDataPolicy::stallTimeout() const {
+    return _stallTimeout;
+  }
+
+  void BufferedPieceDataPolicy::setMaxBytes(uint64_t maxBytes) {
+    _maxBytes = maxBytes;
+  }
+
+  void BufferedPieceDataPolicy::setStallTimeout(std::chrono::seconds stallTimeout) {
+    _stallTimeout = stallTimeout;
+  }
+}
+}
@@ -0,0 +1,212 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#include <protocol_session/BuyingCheckpoint.hpp>
+#include <protocol_session/Exceptions.hpp>
+
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace joystream {
+namespace protocol_session {
+
+  namespace {
+
+    const char Magic[4] = {'J', 'S', 'B', 'C'};
+    const uint32_t Version = 1;
+
+    template <class T>
+    void write(std::ofstream & out, const T & value) {
+      out.write((const char *)&value, sizeof(T));
+    }
+
+    // Bounds checked reading from mapped file
+    class Reader {
+
+      public:
+
+        Reader(const char * data, size_t size) : _data(data), _size(size), _position(0) {}
+
+        template <class T>
+        T read() {
+          T value;
+          std::memcpy(&value, take(sizeof(T)), sizeof(T));
+          return value;
+        }
+
+        const char * take(size_t length) {
+
+          if(length > _size - _position)
+            throw exception::InvalidCheckpoint("truncated");
+
+          const char * start = _data + _position;
+          _position += length;
+
+          return start;
+        }
+
+      private:
+
+        const char * _data;
+        size_t _size;
+        size_t _position;
+    };
+
+    // Unmaps file when going out of scope
+    struct Mapping {
+
+      Mapping() : data(MAP_FAILED), size(0) {}
+
+      ~Mapping() {
+        if(data != MAP_FAILED)
+          munmap(data, size);
+      }
+
+      void * data;
+      size_t size;
+    };
+  }
+
+  BuyingCheckpoint::BuyingCheckpoint()
+    : numberOfPieces(0) {
+  }
+
+  void BuyingCheckpoint::save(const std::string & file) const {
+
+    if(downloaded.size() != numberOfPieces)
+      throw exception::InvalidCheckpoint("downloaded pieces do not match number of pieces");
+
+    std::ofstream out(file, std::ios::binary | std::ios::trunc);
+
+    if(!out)
+      throw std::runtime_error("Could not open " + file + " for writing.");
+
+    out.write(Magic, sizeof(Magic));
+    write(out, Version);
+    write(out, numberOfPieces);
+
+    // Widths are spelled out, as load reads them back
+    write(out, (uint64_t)terms.maxPrice());
+    write(out, (uint16_t)terms.maxLock());
+    write(out, (uint32_t)terms.minNumberOfSellers());
+    write(out, (uint64_t)terms.maxContractFeePerKb());
+
+    // Bitfield is written a block at a time
+    std::vector<PieceAvailability::block_type> blocks(downloaded.num_blocks());
+    boost::to_block_range(downloaded, blocks.begin());
+    out.write((const char *)blocks.data(), blocks.size() * sizeof(PieceAvailability::block_type));
+
+    write(out, (uint32_t)priorities.size());
+
+    for(const PriorityRange & range : priorities) {
+      write(out, (uint32_t)range.begin);
+      write(out, (uint32_t)range.end);
+      write(out, (PiecePriority)range.priority);
+    }
+
+    write(out, (uint32_t)speedTests.size());
+
+    for(const auto & mapping : speedTests) {
+      write(out, (uint32_t)mapping.first.size());
+      out.write(mapping.first.data(), mapping.first.size());
+      write(out, (int64_t)mapping.second.count());
+    }
+
+    if(!out)
+      throw std::runtime_error("Could not write checkpoint to " + file + ".");
+  }
+
+  BuyingCheckpoint BuyingCheckpoint::load(const std::string & file) {
+
+    int fd = open(file.c_str(), O_RDONLY);
+
+    if(fd < 0)
+      throw std::runtime_error("Could not open " + file + ".");
+
+    struct stat info;
+    Mapping mapping;
+
+    if(fstat(fd, &info) == 0 && info.st_size > 0) {
+      mapping.size = info.st_size;
+      mapping.data = mmap(nullptr, mapping.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    // Mapping stays valid after file is closed
+    close(fd);
+
+    if(mapping.data == MAP_FAILED)
+      throw exception::InvalidCheckpoint("could not map " + file);
+
+    Reader reader((const char *)mapping.data, mapping.size);
+
+    if(std::memcmp(reader.take(sizeof(Magic)), Magic, sizeof(Magic)) != 0)
+      throw exception::InvalidCheckpoint("not a checkpoint");
+
+    if(reader.read<uint32_t>() != Version)
+      throw exception::InvalidCheckpoint("unsupported version");
+
+    BuyingCheckpoint checkpoint;
+
+    checkpoint.numberOfPieces = reader.read<uint32_t>();
+
+    uint64_t maxPrice = reader.read<uint64_t>();
+    uint16_t maxLock = reader.read<uint16_t>();
+    uint32_t minNumberOfSellers = reader.read<uint32_t>();
+    uint64_t maxContractFeePerKb = reader.read<uint64_t>();
+
+    checkpoint.terms = protocol_wire::BuyerTerms(maxPrice, maxLock, minNumberOfSellers, maxContractFeePerKb);
+
+    // Number of pieces is only trusted once file is known to hold that many blocks, so a corrupt one cannot make us allocate
+    size_t numberOfBlocks = ((size_t)checkpoint.numberOfPieces + PieceAvailability::bits_per_block - 1) / PieceAvailability::bits_per_block;
+    size_t blocksLength = numberOfBlocks * sizeof(PieceAvailability::block_type);
+    const char * blocksData = reader.take(blocksLength);
+
+    checkpoint.downloaded.resize(checkpoint.numberOfPieces);
+
+    // Blocks follow a header which leaves them unaligned in mapping, so they are copied out rather than read in place
+    std::vector<PieceAvailability::block_type> blocks(numberOfBlocks);
+
+    if(blocksLength > 0)
+      std::memcpy(blocks.data(), blocksData, blocksLength);
+
+    boost::from_block_range(blocks.begin(), blocks.end(), checkpoint.downloaded);
+
+    uint32_t numberOfRanges = reader.read<uint32_t>();
+
+    for(uint32_t i = 0;i < numberOfRanges;i++) {
+
+      PriorityRange range;
+      range.begin = reader.read<uint32_t>();
+      range.end = reader.read<uint32_t>();
+      range.priority = reader.read<PiecePriority>();
+
+      if(range.begin > range.end || range.end > checkpoint.numberOfPieces)
+        throw exception::InvalidCheckpoint("priority range out of bounds");
+
+      if(range.priority > MaxPiecePriority)
+        throw exception::InvalidCheckpoint("priority out of range");
+
+      checkpoint.priorities.push_back(range);
+    }
+
+    uint32_t numberOfSpeedTests = reader.read<uint32_t>();
+
+    for(uint32_t i = 0;i < numberOfSpeedTests;i++) {
+
+      uint32_t length = reader.read<uint32_t>();
+      std::string id(reader.take(length), length);
+
+      checkpoint.speedTests[id] = std::chrono::milliseconds(reader.read<int64_t>());
+    }
+
+    return checkpoint;
+  }
+
+}
+}
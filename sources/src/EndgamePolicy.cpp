@@ -0,0 +1,51 @@
+#include <protocol_session/EndgamePolicy.hpp>
+
+
+namespace joystream {
+namespace protocol_session {
+
+  EndgamePolicy::EndgamePolicy() :
+    _enabled(false),
+    _maxPiecesRemaining(4),
+    _maxRequestsPerPiece(2),
+    _maxDuplicatePayments(8) {
+
+  }
+
+  bool EndgamePolicy::isEnabled() const {
+    return _enabled;
+  }
+
+  uint32_t EndgamePolicy::maxPiecesRemaining() const {
+    return _maxPiecesRemaining;
+  }
+
+  uint32_t EndgamePolicy::maxRequestsPerPiece() const {
+    return _maxRequestsPerPiece;
+  }
+
+  uint32_t EndgamePolicy::maxDuplicatePayments() const {
+    return _maxDuplicatePayments;
+  }
+
+  void EndgamePolicy::enable() {
+    _enabled = true;
+  }
+
+  void EndgamePolicy::disable() {
+    _enabled = false;
+  }
+
+  void EndgamePolicy::setMaxPiecesRemaining(uint32_t maxPiecesRemaining) {
+    _maxPiecesRemaining = maxPiecesRemaining;
+  }
+
+  void EndgamePolicy::setMaxRequestsPerPiece(uint32_t maxRequestsPerPiece) {
+    _maxRequestsPerPiece = maxRequestsPerPiece;
+  }
+
+  void EndgamePolicy::setMaxDuplicatePayments(uint32_t maxDuplicatePayments) {
+    _maxDuplicatePayments = maxDuplicatePayments;
+  }
+}
+}
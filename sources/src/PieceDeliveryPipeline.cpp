@@ -7,7 +7,10 @@ namespace joystream {
 namespace protocol_session {
 namespace detail {
 
-PieceDeliveryPipeline::PieceDeliveryPipeline () {
+PieceDeliveryPipeline::PieceDeliveryPipeline ()
+  : _pipeline(8)
+  , _bytesBuffered(0)
+  , _piecesLoading(0) {
 
 }
 
@@ -16,6 +19,9 @@ int PieceDeliveryPipeline::add(int index) {
   // This should be capped to the maximum number of payments that can be made on a paymnet channel
   // ignore all requests to add after this limit is reached. Alternatively we can have an internal counter
   // and cap the total number add operations allowed. Or just leave the responsibility to the user of the pipeline
+  if(_pipeline.full())
+    _pipeline.set_capacity(2 * _pipeline.capacity());
+
   _pipeline.push_back(Piece(index));
 
   return _pipeline.size();
@@ -31,6 +37,9 @@ int PieceDeliveryPipeline::dataReady(int index, const protocol_wire::PieceData &
     // was delayed, we recieve a polite payment, or just called in error. But we will not treat it as a critical error.
     //
     if (p.index == index && (p.inState<Piece::Loading>() || p.inState<Piece::NotRequested>())) {
+      if(p.inState<Piece::Loading>())
+        _piecesLoading--;
+
       // Update the piece state and save the piece data
       auto readyToSend = Piece::ReadyToSend();
 
@@ -38,6 +47,8 @@ int PieceDeliveryPipeline::dataReady(int index, const protocol_wire::PieceData &
 
       p.state = readyToSend;
 
+      _bytesBuffered += data.length();
+
       piecesUpdated++;
     }
   }
@@ -59,18 +70,27 @@ void PieceDeliveryPipeline::paymentReceived() {
   // when a buyer is doing a polite compensation before disconnectin the seller.
 
   // Piece at the front of the queue - remvove it no matter what state it is in.
+  auto readyToSend = boost::get<Piece::ReadyToSend>(&_pipeline.front().state);
+
+  if(readyToSend)
+    _bytesBuffered -= readyToSend->data.length();
+  else if(_pipeline.front().inState<Piece::Loading>())
+    _piecesLoading--;
+
   _pipeline.pop_front();
 }
 
-std::vector<int> PieceDeliveryPipeline::getNextBatchToLoad(int maxPiecesBeingServiced) {
+void PieceDeliveryPipeline::getNextBatchToLoad(int maxPiecesBeingServiced, std::vector<int> & pieces, int maxPieces) {
   int n = 0;
-  std::vector<int> pieces;
+  pieces.clear();
 
   for (Piece &p : _pipeline) {
     // We always try to service peices at the front of the queue in the order they were added
     // but we limit it so not to waste resources incase the buyer disappears.
     if (n++ > maxPiecesBeingServiced) break;
 
+    if ((int)pieces.size() >= maxPieces) break;
+
     // Piece should be waiting to be requested
     if(p.inState<Piece::NotRequested>()) {
 
@@ -78,16 +98,15 @@ std::vector<int> PieceDeliveryPipeline::getNextBatchToLoad(int maxPiecesBeingSer
 
       // Update the piece state
       p.state = Piece::Loading();
+
+      _piecesLoading++;
     }
   }
-
-  return pieces;
 }
 
-std::vector<protocol_wire::PieceData>
-  PieceDeliveryPipeline::getNextBatchToSend(int maxPiecesUnpaidFor) {
+void PieceDeliveryPipeline::getNextBatchToSend(int maxPiecesUnpaidFor, std::vector<protocol_wire::PieceData> & pieces) {
     int n = 0;
-    std::vector<protocol_wire::PieceData> pieces;
+    pieces.clear();
 
     for (Piece &p : _pipeline) {
       // We will only tolerate having a maximum of maxPiecesUnpaidFor pieces at anytime be delivered
@@ -106,6 +125,8 @@ std::vector<protocol_wire::PieceData>
 
         pieces.push_back(readyToSend->data);
 
+        _bytesBuffered -= readyToSend->data.length();
+
         // Update the piece state
         p.state = Piece::WaitingForPayment();
 
@@ -113,8 +134,89 @@ std::vector<protocol_wire::PieceData>
         assert(p.inState<Piece::WaitingForPayment>());
       }
     }
+}
+
+uint64_t PieceDeliveryPipeline::bytesBuffered() const {
+  return _bytesBuffered;
+}
+
+int PieceDeliveryPipeline::piecesLoading() const {
+  return _piecesLoading;
+}
+
+bool PieceDeliveryPipeline::awaitingPayment() const {
+  // Pieces are sent in order, so any piece waiting for payment is at the front
+  return !_pipeline.empty() && _pipeline.front().inState<Piece::WaitingForPayment>();
+}
+
+uint64_t PieceDeliveryPipeline::evictBuffered() {
+  uint64_t released = 0;
+
+  for (Piece &p : _pipeline) {
+
+    auto readyToSend = boost::get<Piece::ReadyToSend>(&p.state);
+
+    if(readyToSend) {
+
+      released += readyToSend->data.length();
+
+      p.state = Piece::NotRequested();
+    }
+  }
+
+  _bytesBuffered -= released;
+
+  return released;
+}
+
+uint64_t PieceDeliveryPipeline::memoryUsage() const {
+  return _pipeline.capacity() * sizeof(Piece);
+}
+
+const protocol_wire::PieceData * PieceDeliveryPipeline::nextToSend(int maxPiecesUnpaidFor) const {
+  int n = 0;
+
+  for (const Piece &p : _pipeline) {
+    // Same limits as getNextBatchToSend
+    if (n++ > maxPiecesUnpaidFor) break;
+
+    if(p.inState<Piece::NotRequested>() || p.inState<Piece::Loading>())
+      break;
+
+    auto readyToSend = boost::get<Piece::ReadyToSend>(&p.state);
+
+    if(readyToSend)
+      return &readyToSend->data;
+  }
+
+  return nullptr;
+}
+
+bool PieceDeliveryPipeline::takeNextToSend(int maxPiecesUnpaidFor, protocol_wire::PieceData & data) {
+  int n = 0;
+
+  for (Piece &p : _pipeline) {
+    if (n++ > maxPiecesUnpaidFor) break;
+
+    if(p.inState<Piece::NotRequested>() || p.inState<Piece::Loading>())
+      break;
+
+    auto readyToSend = boost::get<Piece::ReadyToSend>(&p.state);
+
+    if(readyToSend) {
+
+      data = readyToSend->data;
+
+      _bytesBuffered -= data.length();
+
+      // Update the piece state
+      p.state = Piece::WaitingForPayment();
+
+      return true;
+    }
+  }
 
-    return pieces;
+  return false;
 }
 
 }
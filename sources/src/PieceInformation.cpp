@@ -10,9 +10,10 @@
 namespace joystream {
 namespace protocol_session {
 
-PieceInformation::PieceInformation(unsigned int size, bool downloaded)
+PieceInformation::PieceInformation(unsigned int size, bool downloaded, PiecePriority priority)
     :  _size(size)
-    , _downloaded(downloaded) {
+    , _downloaded(downloaded)
+    , _priority(priority) {
 }
 
 unsigned int PieceInformation::size() const {
@@ -31,5 +32,13 @@ void PieceInformation::setDownloaded(bool downloaded) {
     _downloaded = downloaded;
 }
 
+PiecePriority PieceInformation::priority() const {
+    return _priority;
+}
+
+void PieceInformation::setPriority(PiecePriority priority) {
+    _priority = priority;
+}
+
 }
 }
@@ -0,0 +1,151 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#include <protocol_session/PieceVerifier.hpp>
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+namespace joystream {
+namespace protocol_session {
+
+  PieceVerifier::PieceVerifier(Algorithm algorithm,
+                               const std::string & digests,
+                               unsigned int numberOfThreads,
+                               const std::function<void()> & resultsReady)
+    : _algorithm(algorithm)
+    , _digests(digests)
+    , _resultsReady(resultsReady)
+    , _numberOfPendingPieces(0)
+    , _stopping(false) {
+
+    if(_digests.size() % digestLength(algorithm) != 0)
+      throw std::runtime_error("Length of digests is not a multiple of digest length.");
+
+    if(numberOfThreads == 0)
+      numberOfThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    for(unsigned int i = 0;i < numberOfThreads;i++)
+      _workers.push_back(std::thread(&PieceVerifier::work, this));
+  }
+
+  PieceVerifier::~PieceVerifier() {
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+
+    _jobAvailable.notify_all();
+
+    for(std::thread & worker : _workers)
+      worker.join();
+  }
+
+  unsigned int PieceVerifier::digestLength(Algorithm algorithm) {
+    switch(algorithm) {
+      case Algorithm::sha1: return 20;
+      case Algorithm::sha256: return 32;
+    }
+
+    assert(false);
+    return 0;
+  }
+
+  unsigned int PieceVerifier::numberOfPieces() const {
+    return _digests.size() / digestLength(_algorithm);
+  }
+
+  unsigned int PieceVerifier::numberOfThreads() const {
+    return _workers.size();
+  }
+
+  void PieceVerifier::submit(int index, const protocol_wire::PieceData & data, uint32_t connection, uint32_t generation) {
+
+    if(index < 0 || index >= (int)numberOfPieces())
+      throw std::runtime_error("No digest for piece.");
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _jobs.push_back(Job(index, data, connection, generation));
+      _numberOfPendingPieces++;
+    }
+
+    _jobAvailable.notify_one();
+  }
+
+  void PieceVerifier::takeResults(std::vector<Result> & results) {
+
+    results.clear();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // Swap rather than copy, so both buffers keep their capacity
+    results.swap(_results);
+
+    _numberOfPendingPieces -= results.size();
+  }
+
+  unsigned int PieceVerifier::numberOfPendingPieces() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _numberOfPendingPieces;
+  }
+
+  bool PieceVerifier::verify(int index, const char * data, unsigned int length) const {
+
+    if(index < 0 || index >= (int)numberOfPieces())
+      throw std::runtime_error("No digest for piece.");
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestSize = 0;
+
+    const EVP_MD * md = (_algorithm == Algorithm::sha1) ? EVP_sha1() : EVP_sha256();
+
+    if(EVP_Digest(data, length, digest, &digestSize, md, nullptr) != 1)
+      return false;
+
+    assert(digestSize == digestLength(_algorithm));
+
+    return std::memcmp(digest, _digests.data() + index * digestSize, digestSize) == 0;
+  }
+
+  void PieceVerifier::work() {
+
+    while(true) {
+
+      Job job;
+
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        _jobAvailable.wait(lock, [this] { return _stopping || !_jobs.empty(); });
+
+        if(_stopping)
+          return;
+
+        job = _jobs.front();
+        _jobs.pop_front();
+      }
+
+      Result result(job.index, verify(job.index, job.data.piece().get(), job.data.length()), job.connection, job.generation, job.data);
+
+      // Release data before result is visible, so buffer is only kept alive by result
+      job = Job();
+
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _results.push_back(result);
+      }
+
+      if(_resultsReady)
+        _resultsReady();
+    }
+  }
+
+}
+}
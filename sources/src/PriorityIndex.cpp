@@ -0,0 +1,221 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#include <protocol_session/detail/PriorityIndex.hpp>
+#include <protocol_session/detail/MemoryUsage.hpp>
+
+#include <algorithm>
+#include <cassert>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+// Rarity occupies bits below priority in rank of a piece
+const int RarityBits = 24;
+const uint32_t MaxRarity = (1 << RarityBits) - 1;
+
+PriorityIndex::PriorityIndex()
+  : _leaves(1)
+  , _tree(2, -1)
+  , _numberOfPiecesWithPriority(0) {
+}
+
+void PriorityIndex::resize(int numberOfPieces) {
+
+  _leaves = 1;
+  while(_leaves < numberOfPieces)
+    _leaves *= 2;
+
+  _priorities.assign(numberOfPieces, DefaultPiecePriority);
+  _availability.assign(numberOfPieces, 0);
+  _included.clear();
+  _included.resize(numberOfPieces);
+  _tree.assign(2 * _leaves, -1);
+  _numberOfPiecesWithPriority = 0;
+}
+
+int PriorityIndex::size() const {
+  return _priorities.size();
+}
+
+PiecePriority PriorityIndex::priority(int index) const {
+  return _priorities[index];
+}
+
+void PriorityIndex::setPriority(int begin, int end, PiecePriority priority) {
+  assert(0 <= begin && begin <= end && end <= size());
+
+  if(begin == end)
+    return;
+
+  for(int i = begin;i < end;i++) {
+
+    if(_priorities[i] != DefaultPiecePriority)
+      _numberOfPiecesWithPriority--;
+
+    if(priority != DefaultPiecePriority)
+      _numberOfPiecesWithPriority++;
+
+    _priorities[i] = priority;
+    _tree[_leaves + i] = leaf(i);
+  }
+
+  updateAbove(begin, end);
+}
+
+bool PriorityIndex::hasPriorities() const {
+  return _numberOfPiecesWithPriority > 0;
+}
+
+uint32_t PriorityIndex::availability(int index) const {
+  return _availability[index];
+}
+
+void PriorityIndex::addAvailability(int index) {
+  _availability[index]++;
+  _tree[_leaves + index] = leaf(index);
+  updateAbove(index, index + 1);
+}
+
+void PriorityIndex::removeAvailability(int index) {
+  assert(_availability[index] > 0);
+  _availability[index]--;
+  _tree[_leaves + index] = leaf(index);
+  updateAbove(index, index + 1);
+}
+
+void PriorityIndex::addAvailability(const PieceAvailability & availability) {
+  assert(availability.empty() || (int)availability.size() == size());
+
+  for(auto i = availability.find_first();i != PieceAvailability::npos;i = availability.find_next(i))
+    _availability[i]++;
+
+  updateLeaves(availability);
+}
+
+void PriorityIndex::removeAvailability(const PieceAvailability & availability) {
+  assert(availability.empty() || (int)availability.size() == size());
+
+  for(auto i = availability.find_first();i != PieceAvailability::npos;i = availability.find_next(i)) {
+    assert(_availability[i] > 0);
+    _availability[i]--;
+  }
+
+  updateLeaves(availability);
+}
+
+void PriorityIndex::include(int index) {
+  _included.set(index);
+  _tree[_leaves + index] = leaf(index);
+  updateAbove(index, index + 1);
+}
+
+void PriorityIndex::exclude(int index) {
+  _included.reset(index);
+  _tree[_leaves + index] = leaf(index);
+  updateAbove(index, index + 1);
+}
+
+int PriorityIndex::top() const {
+
+  if(_tree[1] < 0)
+    return -1;
+
+  // Descend towards leftmost leaf holding the maximum
+  int node = 1;
+
+  while(node < _leaves)
+    node = (_tree[2 * node] == _tree[node]) ? 2 * node : 2 * node + 1;
+
+  return node - _leaves;
+}
+
+int PriorityIndex::top(const PieceAvailability & filter) const {
+  assert((int)filter.size() == size());
+
+  int best = -1;
+  int32_t bestRank = -1;
+
+  search(1, 0, _leaves, filter, best, bestRank);
+
+  return best;
+}
+
+int32_t PriorityIndex::leaf(int index) const {
+
+  if(!_included.test(index))
+    return -1;
+
+  assert(_priorities[index] <= MaxPiecePriority);
+
+  uint32_t rarity = MaxRarity - std::min(_availability[index], MaxRarity);
+
+  return ((int32_t)_priorities[index] << RarityBits) | rarity;
+}
+
+void PriorityIndex::updateLeaves(const PieceAvailability & availability) {
+
+  auto first = availability.find_first();
+
+  if(first == PieceAvailability::npos)
+    return;
+
+  auto last = first;
+
+  for(auto i = first;i != PieceAvailability::npos;i = availability.find_next(i)) {
+    _tree[_leaves + i] = leaf(i);
+    last = i;
+  }
+
+  updateAbove(first, last + 1);
+}
+
+void PriorityIndex::search(int node, int begin, int end, const PieceAvailability & filter, int & best, int32_t & bestRank) const {
+
+  // Nothing included below beats best so far, ties go to lower index which was visited first
+  if(_tree[node] <= bestRank)
+    return;
+
+  // Nothing in filter below
+  auto first = (begin == 0) ? filter.find_first() : filter.find_next(begin - 1);
+
+  if(first == PieceAvailability::npos || (int)first >= end)
+    return;
+
+  if(node >= _leaves) {
+    best = begin;
+    bestRank = _tree[node];
+    return;
+  }
+
+  int middle = begin + (end - begin) / 2;
+
+  search(2 * node, begin, middle, filter, best, bestRank);
+  search(2 * node + 1, middle, end, filter, best, bestRank);
+}
+
+void PriorityIndex::updateAbove(int begin, int end) {
+
+  // Parents of a range of nodes are a range, so recompute level by level
+  int low = (_leaves + begin) / 2;
+  int high = (_leaves + end - 1) / 2;
+
+  while(low >= 1) {
+
+    for(int node = low;node <= high;node++)
+      _tree[node] = std::max(_tree[2 * node], _tree[2 * node + 1]);
+
+    low /= 2;
+    high /= 2;
+  }
+}
+
+uint64_t PriorityIndex::memoryUsage() const {
+  return detail::memoryUsage(_priorities) + detail::memoryUsage(_availability) + detail::memoryUsage(_included) + detail::memoryUsage(_tree);
+}
+
+}
+}
+}
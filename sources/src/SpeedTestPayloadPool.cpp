@@ -0,0 +1,41 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#include <protocol_session/SpeedTestPayloadPool.hpp>
+
+namespace joystream {
+namespace protocol_session {
+
+  SpeedTestPayloadPool::SpeedTestPayloadPool()
+    : _capacity(0) {
+  }
+
+  void SpeedTestPayloadPool::reserve(uint32_t size) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    grow(size);
+  }
+
+  SpeedTestPayloadPool::Payload SpeedTestPayloadPool::get(uint32_t size) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    grow(size);
+    return Payload(_buffer, size);
+  }
+
+  uint32_t SpeedTestPayloadPool::capacity() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _capacity;
+  }
+
+  void SpeedTestPayloadPool::grow(uint32_t size) {
+
+    if(size <= _capacity)
+      return;
+
+    // Payloads handed out keep the old buffer alive
+    _buffer = std::shared_ptr<const char>(new char[size](), std::default_delete<const char[]>());
+    _capacity = size;
+  }
+
+}
+}
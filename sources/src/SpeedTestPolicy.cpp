@@ -9,7 +9,8 @@ namespace protocol_session {
     _maxTimeToRespond(std::chrono::seconds(5)),
     _enabled(true),
     _maxPayloadSize(2000000),
-    _disconnectIfSlow(false) {
+    _disconnectIfSlow(false),
+    _maxConcurrentTests(4) {
 
   }
 
@@ -33,6 +34,10 @@ namespace protocol_session {
     return _disconnectIfSlow;
   }
 
+  unsigned int SpeedTestPolicy::maxConcurrentTests() const {
+    return _maxConcurrentTests;
+  }
+
   void SpeedTestPolicy::setPayloadSize(uint32_t payloadSize) {
     _payloadSize = payloadSize;
   }
@@ -56,5 +61,9 @@ namespace protocol_session {
   void SpeedTestPolicy::setDisconnectIfSlow(bool disconnectIfSlow) {
     _disconnectIfSlow = disconnectIfSlow;
   }
+
+  void SpeedTestPolicy::setMaxConcurrentTests(unsigned int maxConcurrentTests) {
+    _maxConcurrentTests = maxConcurrentTests;
+  }
 }
 }
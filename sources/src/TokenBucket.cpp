@@ -0,0 +1,100 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#include <protocol_session/detail/TokenBucket.hpp>
+
+#include <algorithm>
+
+namespace joystream {
+namespace protocol_session {
+namespace detail {
+
+TokenBucket::TokenBucket()
+  : TokenBucket(0, 0) {
+}
+
+TokenBucket::TokenBucket(uint64_t bytesPerSecond, uint64_t burst)
+  : _bytesPerSecond(bytesPerSecond)
+  , _burst(burst)
+  , _tokens(burst)
+  , _refilled(false)
+  , _throttled(false)
+  , _throttledTime(0) {
+}
+
+void TokenBucket::setRate(uint64_t bytesPerSecond, uint64_t burst) {
+
+  // Bucket starts out full when limit is first set
+  if(_bytesPerSecond == 0 && bytesPerSecond != 0)
+    _tokens = burst;
+
+  _bytesPerSecond = bytesPerSecond;
+  _burst = burst;
+  _tokens = std::min(_tokens, (double)_burst);
+}
+
+bool TokenBucket::isLimited() const {
+  return _bytesPerSecond != 0;
+}
+
+uint64_t TokenBucket::bytesPerSecond() const {
+  return _bytesPerSecond;
+}
+
+uint64_t TokenBucket::burst() const {
+  return _burst;
+}
+
+bool TokenBucket::allows(uint64_t bytes, std::chrono::high_resolution_clock::time_point now) {
+
+  bool allowed = true;
+
+  if(isLimited()) {
+    refill(now);
+    allowed = _tokens >= (double)std::min(bytes, _burst);
+  }
+
+  if(!allowed && !_throttled) {
+    _throttled = true;
+    _throttledSince = now;
+  } else if(allowed && _throttled) {
+    _throttled = false;
+    _throttledTime += std::max(now - _throttledSince, std::chrono::high_resolution_clock::duration::zero());
+  }
+
+  return allowed;
+}
+
+void TokenBucket::spend(uint64_t bytes) {
+
+  if(isLimited())
+    _tokens -= bytes;
+}
+
+std::chrono::duration<double> TokenBucket::throttledTime(std::chrono::high_resolution_clock::time_point now) const {
+
+  if(_throttled && now > _throttledSince)
+    return _throttledTime + (now - _throttledSince);
+  else
+    return _throttledTime;
+}
+
+void TokenBucket::refill(std::chrono::high_resolution_clock::time_point now) {
+
+  if(_refilled && now > _lastRefill) {
+
+    std::chrono::duration<double> elapsed = now - _lastRefill;
+
+    _tokens = std::min(_tokens + elapsed.count() * _bytesPerSecond, (double)_burst);
+  }
+
+  if(!_refilled || now > _lastRefill)
+    _lastRefill = now;
+
+  _refilled = true;
+}
+
+}
+}
+}
@@ -0,0 +1,45 @@
+#include <protocol_session/UploadRateLimitPolicy.hpp>
+
+
+namespace joystream {
+namespace protocol_session {
+
+  UploadRateLimitPolicy::UploadRateLimitPolicy() :
+    _sessionBytesPerSecond(0),
+    _sessionBurst(4*1024*1024),
+    _buyerBytesPerSecond(0),
+    _buyerBurst(1024*1024) {
+
+  }
+
+  bool UploadRateLimitPolicy::isEnabled() const {
+    return _sessionBytesPerSecond != 0 || _buyerBytesPerSecond != 0;
+  }
+
+  uint64_t UploadRateLimitPolicy::sessionBytesPerSecond() const {
+    return _sessionBytesPerSecond;
+  }
+
+  uint64_t UploadRateLimitPolicy::sessionBurst() const {
+    return _sessionBurst;
+  }
+
+  uint64_t UploadRateLimitPolicy::buyerBytesPerSecond() const {
+    return _buyerBytesPerSecond;
+  }
+
+  uint64_t UploadRateLimitPolicy::buyerBurst() const {
+    return _buyerBurst;
+  }
+
+  void UploadRateLimitPolicy::setSessionRate(uint64_t bytesPerSecond, uint64_t burst) {
+    _sessionBytesPerSecond = bytesPerSecond;
+    _sessionBurst = burst;
+  }
+
+  void UploadRateLimitPolicy::setBuyerRate(uint64_t bytesPerSecond, uint64_t burst) {
+    _buyerBytesPerSecond = bytesPerSecond;
+    _buyerBurst = burst;
+  }
+}
+}
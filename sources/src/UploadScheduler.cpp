@@ -0,0 +1,190 @@
+/**
+ * Copyright (C) JoyStream - All Rights Reserved
+ */
+
+#include <protocol_session/UploadScheduler.hpp>
+
+#include <algorithm>
+#include <cassert>
+
+namespace joystream {
+namespace protocol_session {
+
+  UploadScheduler::UploadScheduler(uint64_t bytesPerSecond, uint64_t burst, uint32_t quantum)
+    : _budget(bytesPerSecond, burst)
+    , _quantum(quantum)
+    , _running(false)
+    , _bytesSent(0)
+    , _numberOfFlows(0) {
+    assert(_quantum > 0);
+  }
+
+  UploadScheduler::Flow UploadScheduler::add(const NextPieceSize & nextPieceSize, const SendNextPiece & sendNextPiece) {
+
+    Flow flow;
+
+    if(_free.empty()) {
+      flow = _flows.size();
+      _flows.push_back(FlowState());
+    } else {
+      flow = _free.back();
+      _free.pop_back();
+    }
+
+    FlowState & state = _flows[flow];
+
+    state = FlowState();
+    state.inUse = true;
+    state.nextPieceSize = nextPieceSize;
+    state.sendNextPiece = sendNextPiece;
+
+    _numberOfFlows++;
+
+    return flow;
+  }
+
+  void UploadScheduler::remove(Flow flow) {
+
+    assert(flow < _flows.size() && _flows[flow].inUse);
+
+    if(_flows[flow].scheduled)
+      _scheduled.erase(std::find(_scheduled.begin(), _scheduled.end(), flow));
+
+    _numberOfFlows--;
+
+    // Callbacks may be running, e.g. a send which removed its own connection, so
+    // slot is released when run is done
+    if(_running) {
+      _flows[flow].inUse = false;
+      _flows[flow].scheduled = false;
+      _removedWhileRunning.push_back(flow);
+      return;
+    }
+
+    // Release callbacks, and whatever they hold on to
+    _flows[flow] = FlowState();
+    _free.push_back(flow);
+  }
+
+  void UploadScheduler::setWeight(Flow flow, uint64_t weight) {
+
+    assert(flow < _flows.size() && _flows[flow].inUse);
+
+    _flows[flow].weight = std::max(weight, (uint64_t)1);
+  }
+
+  void UploadScheduler::schedule(Flow flow) {
+
+    assert(flow < _flows.size() && _flows[flow].inUse);
+
+    FlowState & state = _flows[flow];
+
+    if(state.scheduled)
+      return;
+
+    state.scheduled = true;
+    _scheduled.push_back(flow);
+  }
+
+  void UploadScheduler::run(std::chrono::high_resolution_clock::time_point now) {
+
+    if(_running)
+      return;
+
+    _running = true;
+
+    // Quantum of each flow is relative to the lowest weight among those scheduled
+    uint64_t minWeight = UINT64_MAX;
+
+    for(Flow flow : _scheduled)
+      minWeight = std::min(minWeight, _flows[flow].weight);
+
+    while(!_scheduled.empty()) {
+
+      Flow flow = _scheduled.front();
+      FlowState & state = _flows[flow];
+
+      if(!state.visited) {
+
+        // Flow scheduled by a send callback may have lower weight
+        minWeight = std::min(minWeight, state.weight);
+
+        state.deficit += (uint64_t)((double)_quantum * state.weight / minWeight);
+        state.visited = true;
+      }
+
+      uint32_t size = state.nextPieceSize();
+
+      // Nothing left to send, so flow does not keep its deficit
+      if(size == 0) {
+
+        state.scheduled = false;
+        state.visited = false;
+        state.deficit = 0;
+        _scheduled.pop_front();
+
+        continue;
+      }
+
+      // Out of budget, flow is served first when run again
+      if(!_budget.allows(size, now))
+        break;
+
+      // Deficit is used up, move on to next flow
+      if(state.deficit < size) {
+
+        state.visited = false;
+        _scheduled.pop_front();
+        _scheduled.push_back(flow);
+
+        continue;
+      }
+
+      state.deficit -= size;
+
+      _budget.spend(size);
+
+      _bytesSent += size;
+
+      // Sending may remove this or other flows, or add flows which moves all of them,
+      // which is why callback is copied and state is not used past here
+      SendNextPiece sendNextPiece = state.sendNextPiece;
+      sendNextPiece();
+    }
+
+    _running = false;
+
+    for(Flow flow : _removedWhileRunning) {
+      _flows[flow] = FlowState();
+      _free.push_back(flow);
+    }
+
+    _removedWhileRunning.clear();
+  }
+
+  void UploadScheduler::setRate(uint64_t bytesPerSecond, uint64_t burst) {
+    _budget.setRate(bytesPerSecond, burst);
+  }
+
+  uint64_t UploadScheduler::bytesPerSecond() const {
+    return _budget.bytesPerSecond();
+  }
+
+  std::chrono::duration<double> UploadScheduler::throttledTime(std::chrono::high_resolution_clock::time_point now) const {
+    return _budget.throttledTime(now);
+  }
+
+  uint64_t UploadScheduler::bytesSent() const {
+    return _bytesSent;
+  }
+
+  unsigned int UploadScheduler::numberOfFlows() const {
+    return _numberOfFlows;
+  }
+
+  unsigned int UploadScheduler::numberOfScheduledFlows() const {
+    return _scheduled.size();
+  }
+
+}
+}
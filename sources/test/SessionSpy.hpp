@@ -31,9 +31,14 @@ public:
     Callback hook() {
         return [this](Args... args) -> void {
             this->push_back(Frame<Args...>(args...));
+
+            if(this->onCall)
+                this->onCall(args...);
         };
     }
 
+    // Run after each call is recorded, e.g. to have client react from within callback
+    Callback onCall;
 };
 
 // Callback slot where the underlying callback has return value, i.e. is a 'function'
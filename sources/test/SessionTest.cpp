@@ -455,6 +455,72 @@ void SessionTest::exchangeDataForPayment(ID peer, uint N, paymentchannel::Payor
     }
 }
 
+TorrentPieceInformation SessionTest::missingPieces(uint numberOfPieces, uint pieceSize) {
+    TorrentPieceInformation information;
+
+    for(uint i = 0;i < numberOfPieces;i++)
+        information.push_back(PieceInformation(pieceSize, false));
+
+    return information;
+}
+
+std::vector<SessionTest::SellerPeer> SessionTest::toBuyModeWithSellers(const TorrentPieceInformation & information, const std::vector<protocol_wire::SellerTerms> & sellerTerms) {
+    protocol_wire::BuyerTerms buyerTerms(24, 200, sellerTerms.size(), 400);
+
+    std::vector<SellerPeer> sellers;
+
+    for(const protocol_wire::SellerTerms & terms : sellerTerms) {
+        assert(buyerTerms.satisfiedBy(terms));
+
+        ID id = sellers.size();
+        sellers.push_back(SellerPeer(id, terms, 543 + id, session->network()));
+    }
+
+    toBuyMode(buyerTerms, information);
+
+    return sellers;
+}
+
+void SessionTest::takeSellersToExchange(std::vector<SellerPeer> & sellers, const std::function<void(SellerPeer &)> & beforeJoining) {
+
+    // Add connections and announce seller terms, which are good enough
+    for(SellerPeer & peer : sellers) {
+        addAndRespondToSpeedTest(peer);
+        assertSellerInvited(peer);
+    }
+
+    spy->reset();
+
+    if(beforeJoining)
+        for(SellerPeer & peer : sellers)
+            beforeJoining(peer);
+
+    // Have peers join
+    for(SellerPeer & peer : sellers)
+        session->processMessageOnConnection(peer.id, peer.setJoiningContract());
+
+    /// Start download
+
+    // Setup
+    std::vector<BuyerSellerRelationship> v;
+    for(const SellerPeer & peer : sellers)
+        v.push_back(BuyerSellerRelationship(StartDownloadConnectionInformation(peer.terms, v.size(), 9999999, Coin::KeyPair(nextPrivateKey()), nextPrivateKey().toPublicKey().toPubKeyHash()), peer));
+
+    Coin::Transaction contractTx = simpleContract(v, session->network());
+
+    for(SellerPeer & peer : sellers)
+        peer.assertContractValidity(contractTx);
+
+    PeerToStartDownloadInformationMap<ID> map = downloadInformationMap(v);
+
+    // Start download
+    session->startDownloading(contractTx, map, nextPiecePicker);
+
+    // make sure contract was announced to only relevant peers
+    for(SellerPeer & peer : sellers)
+        peer.contractAnnounced();
+}
+
 void SessionTest::add(SellerPeer & peer) {
     addConnection(peer.id);
     peer.spy = spy->connectionSpies.at(peer.id);
@@ -537,31 +603,11 @@ bool SessionTest::hasPendingFullPieceRequest(const std::vector<SellerPeer> & pee
 }
 
 void SessionTest::takeSingleSellerToExchange(SellerPeer & peer) {
-    // Add connection and announce seller terms
-    addAndRespondToSpeedTest(peer);
-    assertSellerInvited(peer);
-    spy->reset();
-
-    // Have peer join
-    session->processMessageOnConnection(peer.id, peer.setJoiningContract());
+    std::vector<SellerPeer> sellers({peer});
 
-    // no need to wait due to policy
-
-    /// Start download
-
-    // Setup
-    auto v = { BuyerSellerRelationship(StartDownloadConnectionInformation(peer.terms,  0, 9999999, Coin::KeyPair(nextPrivateKey()), nextPrivateKey().toPublicKey().toPubKeyHash()), peer)};
-    Coin::Transaction contractTx = simpleContract(v, session->network());
-    peer.assertContractValidity(contractTx);
-    PeerToStartDownloadInformationMap<ID> map = downloadInformationMap(v);
-
-    // Start download
-    session->startDownloading(contractTx, map, nextPiecePicker);
-
-    // make sure contract was announced to only relevant peers
-    peer.contractAnnounced();
+    takeSellersToExchange(sellers);
 
-    ////////peer.assertContractValidity(tx);
+    peer = sellers.front();
 }
 
 /**
@@ -580,7 +626,7 @@ void SessionTest::assertSellerInvited(const SellerPeer & peer) {
 }
 
 
-int SessionTest::nextPiecePicker(const std::vector<detail::Piece<ID>>* pieces) {
+int SessionTest::nextPiecePicker(const detail::PieceTable<ID>* pieces) {
   for(uint32_t i = 0;i < pieces->size();i++)
     if(pieces->at(i).state() == PieceState::unassigned)
       return i;
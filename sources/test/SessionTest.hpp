@@ -236,6 +236,18 @@ public:
         return map;
     }
 
+    // Information for torrent with given number of pieces of given size, none of which are downloaded
+    static TorrentPieceInformation missingPieces(uint, uint = 0);
+
+    // Session to buy mode for torrent with given pieces, requiring a seller for each of given seller terms,
+    // which buyer terms are satisfied by. Returns sellers with given terms, and ids 0, 1, ...
+    std::vector<SellerPeer> toBuyModeWithSellers(const TorrentPieceInformation &,
+                                                 const std::vector<protocol_wire::SellerTerms> & = {protocol_wire::SellerTerms(22, 134, 10, 88, 32)});
+
+    // Takes started buying session to downloading from given sellers: each is added, passes speed test and is invited,
+    // then given routine is run on each, e.g. to set piece availability, before they join and the contract is announced to them
+    void takeSellersToExchange(std::vector<SellerPeer> &, const std::function<void(SellerPeer &)> & = std::function<void(SellerPeer &)>());
+
     void add(SellerPeer &);
     void addAndRespondToSpeedTest(SellerPeer &);
     void respondToSpeedTestRequest(SellerPeer &, uint32_t);
@@ -246,7 +258,7 @@ public:
     void takeSingleSellerToExchange(SellerPeer &);
     void assertSellerInvited(const SellerPeer &);
 
-    static int nextPiecePicker(const std::vector<detail::Piece<ID>>* pieces);
+    static int nextPiecePicker(const detail::PieceTable<ID>* pieces);
 };
 
 #endif // TEST_HPP
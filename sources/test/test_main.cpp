@@ -3,11 +3,40 @@
 #include <SessionTest.hpp>
 #include <SessionSpy.hpp>
 
+#include <protocol_session/AllocationHooks.hpp>
+#include <protocol_session/detail/PieceDeliveryPipeline.hpp>
+#include <protocol_session/detail/PriorityIndex.hpp>
+#include <protocol_session/detail/BandwidthEstimator.hpp>
+#include <protocol_session/detail/ConnectionHandles.hpp>
+#include <protocol_session/detail/SellerOrderBook.hpp>
+#include <protocol_session/detail/TokenBucket.hpp>
+#include <protocol_session/detail/MemoryUsage.hpp>
+
+#include <openssl/evp.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+#include <unistd.h>
+
 using namespace joystream;
 using namespace joystream::protocol_session;
 
 #define TEST_PRIVATE_KEY "0102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f20"
 
+// Path of a new empty file in temporary directory, to be removed by caller
+std::string temporaryFile() {
+    char path[] = "/tmp/protocol_session_test_XXXXXX";
+
+    int fd = mkstemp(path);
+    EXPECT_GE(fd, 0);
+    close(fd);
+
+    return path;
+}
+
 TEST_F(SessionTest, observing)
 {
     init(Coin::Network::testnet3);
@@ -48,6 +77,120 @@ TEST_F(SessionTest, observing)
     cleanup();
 }
 
+TEST_F(SessionTest, observing_keeps_passive_peers_compact)
+{
+    init(Coin::Network::testnet3);
+
+    toObserveMode();
+    firstStart();
+
+    // Send callbacks are made by session only when needed, and count our Observe announcements
+    std::map<ID, int> observesSent;
+    session->setMakeSendMessageOnConnectionCallbacks([&observesSent](const ID & id) {
+        SendMessageOnConnectionCallbacks callbacks;
+        callbacks.observe = [&observesSent, id](const protocol_wire::Observe &) { observesSent[id]++; };
+        callbacks.buy = [](const protocol_wire::Buy &) {};
+        return callbacks;
+    });
+
+    const uint numberOfPeers = 100;
+
+    for(ID id = 0; id < numberOfPeers; id++)
+        EXPECT_EQ(session->addConnection(id), id + 1);
+
+    EXPECT_THROW(session->addConnection(7), exception::ConnectionAlreadyAddedException<ID>);
+    EXPECT_EQ(session->connectionIds().size(), numberOfPeers);
+    EXPECT_EQ(observesSent.size(), numberOfPeers);
+
+    // No full connection was made, see observing_adds_and_removes_many_passive_peers for heap used
+    EXPECT_EQ(session->memoryUsage().connections, 0);
+
+    // Announcement is only recorded
+    session->processMessageOnConnection(3, protocol_wire::Sell(protocol_wire::SellerTerms(1,2,3,4,5), 1337));
+    EXPECT_EQ(session->connectionStatus(3).machine.announcedModeAndTermsFromPeer.modeAnnounced(), protocol_statemachine::ModeAnnounced::sell);
+    EXPECT_EQ(session->memoryUsage().connections, 0);
+
+    // Leaving observe mode materializes all peers, which are not sent Observe again
+    toBuyMode(protocol_wire::BuyerTerms(), TorrentPieceInformation());
+
+    EXPECT_EQ(session->memoryUsage().passivePeers, 0);
+    EXPECT_EQ(session->connectionIds().size(), numberOfPeers);
+    EXPECT_EQ(session->connectionStatus(3).machine.announcedModeAndTermsFromPeer.modeAnnounced(), protocol_statemachine::ModeAnnounced::sell);
+
+    for(auto mapping : observesSent)
+        EXPECT_EQ(mapping.second, 1);
+
+    cleanup();
+}
+
+TEST_F(SessionTest, observing_adds_and_removes_many_passive_peers)
+{
+    ASSERT_TRUE(AllocationAccounting::hooksInstalled());
+
+    init(Coin::Network::testnet3);
+
+    toObserveMode();
+    firstStart();
+
+    session->setMakeSendMessageOnConnectionCallbacks([](const ID &) {
+        SendMessageOnConnectionCallbacks callbacks;
+        callbacks.observe = [](const protocol_wire::Observe &) {};
+        return callbacks;
+    });
+
+    // Swarm sized peer set, added in scrambled order so peers are not just appended
+    const uint numberOfPeers = 100000;
+    std::vector<ID> ids;
+
+    for(ID id = 0; id < numberOfPeers; id++)
+        ids.push_back((id * 7919) % numberOfPeers);
+
+    AllocationScope scope;
+
+    for(const ID & id : ids)
+        session->addConnection(id);
+
+    AllocationStatistics statistics = scope.statistics();
+
+    // Heap used is one tree node per peer with its id and last announcement, a few MB for the swarm
+    uint64_t perPeer = detail::TreeNodeOverhead + sizeof(std::pair<const ID, protocol_statemachine::AnnouncedModeAndTerms>);
+
+    EXPECT_EQ(statistics.allocations, (uint64_t)numberOfPeers);
+    EXPECT_LE(statistics.bytesAllocated, numberOfPeers * perPeer);
+    EXPECT_LT(statistics.bytesAllocated, 16u * 1024 * 1024);
+
+    // Which is what session reports
+    EXPECT_EQ(session->memoryUsage().passivePeers, statistics.bytesAllocated);
+    EXPECT_EQ(session->memoryUsage().connections, 0);
+
+    EXPECT_EQ(session->connectionIds().size(), numberOfPeers);
+    EXPECT_TRUE(session->hasConnection(numberOfPeers - 1));
+
+    // Announcement on one of many is recorded
+    session->processMessageOnConnection(4242, protocol_wire::Sell(protocol_wire::SellerTerms(1,2,3,4,5), 1));
+    EXPECT_EQ(session->connectionStatus(4242).machine.announcedModeAndTermsFromPeer.modeAnnounced(), protocol_statemachine::ModeAnnounced::sell);
+
+    // Remove every other peer, in the order they were added
+    for(const ID & id : ids)
+        if(id % 2 == 0)
+            session->removeConnection(id);
+
+    EXPECT_EQ(spy->removedConnectionCallbackSlot.size(), numberOfPeers / 2);
+    EXPECT_EQ(session->connectionIds().size(), numberOfPeers / 2);
+    EXPECT_FALSE(session->hasConnection(4242));
+    EXPECT_TRUE(session->hasConnection(4243));
+    EXPECT_THROW(session->connectionStatus(4242), exception::ConnectionDoesNotExist<ID>);
+
+    // Stopping drops the rest
+    spy->reset();
+    session->stop();
+
+    EXPECT_EQ(spy->removedConnectionCallbackSlot.size(), numberOfPeers / 2);
+    EXPECT_EQ(session->memoryUsage().passivePeers, 0);
+
+    cleanup();
+}
+
 TEST_F(SessionTest, selling_basic)
 {
     init(Coin::Network::testnet3);
@@ -376,6 +519,313 @@ TEST_F(SessionTest, selling_buyer_disappears)
     cleanup();
 }
 
+TEST_F(SessionTest, selling_evicts_buyer_which_stopped_paying)
+{
+    init(Coin::Network::testnet3);
+
+    std::chrono::seconds timePassed(0);
+
+    session->setTimeGetter([&timePassed]() {
+        return std::chrono::high_resolution_clock::time_point::min() + timePassed;
+    });
+
+    // Room for two pieces
+    BufferedPieceDataPolicy policy;
+    policy.setMaxBytes(8);
+    policy.setStallTimeout(std::chrono::seconds(10));
+    session->setBufferedPieceDataPolicy(policy);
+
+    protocol_wire::SellerTerms sellerTerms(22, 134, 10, 88, 32);
+    protocol_wire::BuyerTerms buyerTerms(24, 200, 2, 400);
+    Coin::PrivateKey payorContractSk = Coin::PrivateKey::fromRawHex(TEST_PRIVATE_KEY);
+    protocol_wire::Ready ready(1123,
+                               Coin::typesafeOutPoint(Coin::TransactionId::fromRPCByteOrder(std::string("97a27e013e66bec6cb6704cfcaa5b62d4fc6894658f570ed7d15353835cf3547")), 55),
+                               payorContractSk.toPublicKey(),
+                               Coin::RedeemScriptHash::fromRawHash(uchar_vector("03a3fac91cac4a5c9ec870b444c4890ec7d68671")));
+
+    ID paying = 0;
+    ID stalling = 1;
+    protocol_wire::PieceData data = protocol_wire::PieceData::fromHex("01020304");
+
+    toSellMode(sellerTerms, 20);
+    firstStart();
+
+    Coin::PublicKey payeeContractPk;
+    Coin::RedeemScriptHash payeeFinalScriptHash;
+    addBuyerAndGoToReadyForPieceRequest(paying, buyerTerms, ready, payeeContractPk, payeeFinalScriptHash);
+    paymentchannel::Payor payor = getPayor(sellerTerms, ready, payorContractSk, payeeContractPk, payeeFinalScriptHash, Coin::Network::testnet3);
+
+    Coin::PublicKey stallingContractPk;
+    Coin::RedeemScriptHash stallingFinalScriptHash;
+    addBuyerAndGoToReadyForPieceRequest(stalling, buyerTerms, protocol_wire::Ready(), stallingContractPk, stallingFinalScriptHash);
+
+    // Stalling buyer is sent as many pieces as it may leave unpaid, and never pays
+    for(int index = 10;index < 15;index++) {
+        receiveValidFullPieceRequest(stalling, index);
+        sendFullPiece(stalling, data, index);
+    }
+
+    // Next two pieces are loaded, and held until it pays, which uses up the budget
+    for(int index = 15;index < 17;index++) {
+        receiveValidFullPieceRequest(stalling, index);
+        session->pieceLoaded(data, index);
+
+        EXPECT_TRUE(spy->blank());
+    }
+
+    EXPECT_EQ(session->status().selling.bufferedPieceData, 8u);
+    EXPECT_EQ(session->status().selling.piecesBeingLoaded, 0);
+
+    // Paying buyer has to wait for room
+    session->processMessageOnConnection(paying, protocol_wire::RequestFullPiece(0));
+    EXPECT_EQ((int)spy->loadPieceForBuyerCallbackSlot.size(), 0);
+
+    // Nothing is dropped before stall timeout
+    timePassed += std::chrono::seconds(5);
+    session->tick();
+
+    EXPECT_EQ((int)spy->loadPieceForBuyerCallbackSlot.size(), 0);
+    EXPECT_EQ(session->status().selling.evictedPieceData, 0u);
+
+    // Data held for stalling buyer is dropped, and only the paying buyer's piece is loaded
+    timePassed += std::chrono::seconds(5);
+    session->tick();
+
+    EXPECT_EQ((int)spy->loadPieceForBuyerCallbackSlot.size(), 1);
+    EXPECT_EQ(spy->loadPieceForBuyerCallbackSlot.front(), std::make_tuple(paying, 0u));
+    EXPECT_EQ(session->status().selling.evictedPieceData, 8u);
+    EXPECT_EQ(session->status().selling.bufferedPieceData, 0u);
+    EXPECT_EQ(session->status().selling.piecesBeingLoaded, 1);
+    spy->reset();
+
+    sendFullPiece(paying, data, 0);
+    session->processMessageOnConnection(paying, protocol_wire::Payment(payor.makePayment()));
+    EXPECT_TRUE(spy->blank());
+
+    // With one piece loading, and a later one loaded ahead of it
+    receiveValidFullPieceRequest(paying, 1);
+    receiveValidFullPieceRequest(paying, 2);
+    session->pieceLoaded(data, 2);
+
+    EXPECT_TRUE(spy->blank());
+    EXPECT_EQ(session->status().selling.bufferedPieceData, 4u);
+    EXPECT_EQ(session->status().selling.piecesBeingLoaded, 1);
+
+    // Sums over pipelines are released with connections
+    session->removeConnection(paying);
+    session->removeConnection(stalling);
+    spy->reset();
+
+    EXPECT_EQ(session->status().selling.bufferedPieceData, 0u);
+    EXPECT_EQ(session->status().selling.piecesBeingLoaded, 0);
+    EXPECT_EQ(session->status().selling.evictedPieceData, 8u);
+
+    cleanup();
+}
+
+TEST_F(SessionTest, selling_sessions_share_upload_scheduler)
+{
+    std::chrono::seconds timePassed(0);
+
+    auto getTime = [&timePassed]() {
+        return std::chrono::high_resolution_clock::time_point::min() + timePassed;
+    };
+
+    // Room for two pieces per second, shared by sessions of two torrents
+    std::shared_ptr<UploadScheduler> scheduler = std::make_shared<UploadScheduler>(8, 8, 4);
+
+    protocol_wire::SellerTerms sellerTerms(22, 134, 10, 88, 32);
+    protocol_wire::BuyerTerms buyerTerms(24, 200, 2, 400);
+    protocol_wire::PieceData data = protocol_wire::PieceData::fromHex("01020304");
+
+    ID firstBuyer = 0;
+    ID secondBuyer = 1;
+
+    // Helpers drive the session and spy of the fixture, so each torrent is made current in turn
+    init(Coin::Network::testnet3);
+    Session<ID> * firstSession = session;
+    SessionSpy<ID> * firstSpy = spy;
+
+    init(Coin::Network::testnet3);
+    Session<ID> * secondSession = session;
+    SessionSpy<ID> * secondSpy = spy;
+
+    auto use = [this](Session<ID> * s, SessionSpy<ID> * sp) {
+        session = s;
+        spy = sp;
+    };
+
+    Coin::PublicKey payeeContractPk;
+    Coin::RedeemScriptHash payeeFinalScriptHash;
+
+    use(firstSession, firstSpy);
+    session->setTimeGetter(getTime);
+    session->setUploadScheduler(scheduler);
+    toSellMode(sellerTerms, 20);
+    firstStart();
+    addBuyerAndGoToReadyForPieceRequest(firstBuyer, buyerTerms, protocol_wire::Ready(), payeeContractPk, payeeFinalScriptHash);
+
+    use(secondSession, secondSpy);
+    session->setTimeGetter(getTime);
+    session->setUploadScheduler(scheduler);
+    toSellMode(sellerTerms, 20);
+    firstStart();
+    addBuyerAndGoToReadyForPieceRequest(secondBuyer, buyerTerms, protocol_wire::Ready(), payeeContractPk, payeeFinalScriptHash);
+
+    // Each session sends one piece, which uses up the budget
+    use(firstSession, firstSpy);
+    receiveValidFullPieceRequest(firstBuyer, 0);
+    sendFullPiece(firstBuyer, data, 0);
+
+    use(secondSession, secondSpy);
+    receiveValidFullPieceRequest(secondBuyer, 0);
+    sendFullPiece(secondBuyer, data, 0);
+
+    EXPECT_EQ(scheduler->bytesSent(), 8u);
+    EXPECT_EQ(scheduler->numberOfFlows(), 2u);
+
+    // Next piece of each is held back
+    use(firstSession, firstSpy);
+    receiveValidFullPieceRequest(firstBuyer, 1);
+    session->pieceLoaded(data, 1);
+    EXPECT_TRUE(spy->blank());
+
+    use(secondSession, secondSpy);
+    receiveValidFullPieceRequest(secondBuyer, 1);
+    session->pieceLoaded(data, 1);
+    EXPECT_TRUE(spy->blank());
+
+    EXPECT_EQ(scheduler->numberOfScheduledFlows(), 2u);
+
+    // Once budget is refilled, tick of either session sends the held pieces of both
+    timePassed += std::chrono::seconds(1);
+    firstSession->tick();
+
+    EXPECT_EQ((int)firstSpy->connectionSpies.at(firstBuyer)->sendFullPieceCallbackSlot.size(), 1);
+    EXPECT_EQ((int)secondSpy->connectionSpies.at(secondBuyer)->sendFullPieceCallbackSlot.size(), 1);
+    EXPECT_EQ(scheduler->bytesSent(), 16u);
+    EXPECT_EQ(scheduler->numberOfScheduledFlows(), 0u);
+
+    // Flows are dropped with the buyers
+    firstSession->removeConnection(firstBuyer);
+    secondSession->removeConnection(secondBuyer);
+
+    EXPECT_EQ(scheduler->numberOfFlows(), 0u);
+
+    delete firstSession;
+    delete firstSpy;
+
+    cleanup();
+}
+
+TEST_F(SessionTest, selling_buyer_removed_while_upload_scheduler_sends)
+{
+    init(Coin::Network::testnet3);
+
+    std::shared_ptr<UploadScheduler> scheduler = std::make_shared<UploadScheduler>();
+    session->setUploadScheduler(scheduler);
+
+    protocol_wire::SellerTerms sellerTerms(22, 134, 10, 88, 32);
+    protocol_wire::BuyerTerms buyerTerms(24, 200, 2, 400);
+    protocol_wire::PieceData data = protocol_wire::PieceData::fromHex("01020304");
+
+    ID failing = 0;
+    ID other = 1;
+
+    toSellMode(sellerTerms, 20);
+    firstStart();
+
+    Coin::PublicKey payeeContractPk;
+    Coin::RedeemScriptHash payeeFinalScriptHash;
+    addBuyerAndGoToReadyForPieceRequest(failing, buyerTerms, protocol_wire::Ready(), payeeContractPk, payeeFinalScriptHash);
+    addBuyerAndGoToReadyForPieceRequest(other, buyerTerms, protocol_wire::Ready(), payeeContractPk, payeeFinalScriptHash);
+
+    // Client drops connection when sending piece fails, and another torrent adds flows to the
+    // shared scheduler, which moves the flows of the scheduler while it is sending
+    const unsigned int flowsAdded = 16;
+
+    spy->connectionSpies.at(failing)->sendFullPieceCallbackSlot.onCall = [this, failing, scheduler, flowsAdded](const protocol_wire::FullPiece &) {
+
+        session->removeConnection(failing);
+
+        for(unsigned int i = 0;i < flowsAdded;i++)
+            scheduler->add([]() { return 0u; }, []() {});
+    };
+
+    receiveValidFullPieceRequest(failing, 0);
+    session->pieceLoaded(data, 0);
+
+    EXPECT_EQ((int)spy->connectionSpies.at(failing)->sendFullPieceCallbackSlot.size(), 1);
+    EXPECT_FALSE(session->hasConnection(failing));
+    EXPECT_EQ((int)spy->removedConnectionCallbackSlot.size(), 1);
+    EXPECT_EQ(scheduler->numberOfFlows(), flowsAdded + 1);
+    spy->reset();
+
+    // Scheduler keeps serving remaining buyer
+    receiveValidFullPieceRequest(other, 1);
+    sendFullPiece(other, data, 1);
+
+    EXPECT_EQ(scheduler->bytesSent(), 8u);
+
+    cleanup();
+}
+
+TEST_F(SessionTest, selling_holds_back_pieces_over_buyer_upload_limit)
+{
+    init(Coin::Network::testnet3);
+
+    std::chrono::milliseconds timePassed(0);
+
+    session->setTimeGetter([&timePassed]() {
+        return std::chrono::high_resolution_clock::time_point::min() + timePassed;
+    });
+
+    // One piece per second to each buyer, no limit on session as a whole
+    UploadRateLimitPolicy policy;
+    policy.setBuyerRate(4, 4);
+    session->setUploadRateLimitPolicy(policy);
+
+    protocol_wire::SellerTerms sellerTerms(22, 134, 10, 88, 32);
+    protocol_wire::BuyerTerms buyerTerms(24, 200, 2, 400);
+    protocol_wire::PieceData data = protocol_wire::PieceData::fromHex("01020304");
+
+    ID buyer = 0;
+
+    toSellMode(sellerTerms, 20);
+    firstStart();
+
+    Coin::PublicKey payeeContractPk;
+    Coin::RedeemScriptHash payeeFinalScriptHash;
+    addBuyerAndGoToReadyForPieceRequest(buyer, buyerTerms, protocol_wire::Ready(), payeeContractPk, payeeFinalScriptHash);
+
+    // First piece fits in burst
+    receiveValidFullPieceRequest(buyer, 0);
+    sendFullPiece(buyer, data, 0);
+
+    // Second is held back, also when ticking before limit allows it
+    receiveValidFullPieceRequest(buyer, 1);
+    session->pieceLoaded(data, 1);
+    EXPECT_TRUE(spy->blank());
+
+    timePassed += std::chrono::milliseconds(500);
+    session->tick();
+    EXPECT_TRUE(spy->blank());
+
+    // Released by tick once limit is refilled
+    timePassed += std::chrono::milliseconds(500);
+    session->tick();
+
+    ConnectionSpy<ID> * c = spy->connectionSpies.at(buyer);
+
+    EXPECT_EQ((int)c->sendFullPieceCallbackSlot.size(), 1);
+    EXPECT_EQ(std::get<0>(c->sendFullPieceCallbackSlot.front()).pieceData(), data);
+
+    EXPECT_NEAR(session->status().selling.buyerThrottledTime.count(), 1.0, 1e-6);
+    EXPECT_EQ(session->status().selling.sessionThrottledTime.count(), 0);
+
+    cleanup();
+}
+
 TEST_F(SessionTest, buying_basic)
 {
     init(Coin::Network::testnet3);
@@ -532,90 +982,567 @@ TEST_F(SessionTest, buying)
     cleanup();
 }
 
-TEST_F(SessionTest, buying_seller_has_interrupted_contract)
+TEST_F(SessionTest, buying_from_seller_with_partial_availability)
 {
     init(Coin::Network::testnet3);
 
-    // min #sellers = 1
-    protocol_wire::BuyerTerms buyerTerms(24, 200, 1, 400);
+    uint totalNumberOfPieces = 30;
+    std::vector<SellerPeer> sellers = toBuyModeWithSellers(missingPieces(totalNumberOfPieces),
+                                                           {protocol_wire::SellerTerms(22, 134, 10, 88, 32),
+                                                            protocol_wire::SellerTerms(4, 13, 11, 88, 32)});
+    SellerPeer & first = sellers[0];
+    SellerPeer & second = sellers[1];
 
-    SellerPeer first(0, protocol_wire::SellerTerms(22, 134, 10, 88, 32),5634, session->network());
+    // Start session
+    firstStart();
 
-    assert(buyerTerms.satisfiedBy(first.terms));
+    // First seller has three pieces, second seller only has two of them,
+    // which makes piece 25 the rarest, even though it has the highest index
+    takeSellersToExchange(sellers, [this, totalNumberOfPieces](SellerPeer & peer) {
 
-    /**
-    // To buy mode
-    std::shared_ptr<Coin::UnspentOutput> utxo(
-      new Coin::UnspentP2SHOutput(Coin::KeyPair::generate(),
-                                  uchar_vector(),
-                                  uchar_vector(),
-                                  Coin::typesafeOutPoint(Coin::TransactionId::fromRPCByteOrder(std::string("97a27e013e66bec6cb6704cfcaa5b62d4fc6894658f570ed7d15353835cf3547")),
-                                                         55),
-                                  34561)
-    );
+        PieceAvailability availability(totalNumberOfPieces);
+        availability.set(7);
+        availability.set(21);
 
-    Coin::UnspentOutputSet funding({utxo});
-    */
+        if(peer.id == 0)
+            availability.set(25);
 
-    // minTimeBeforeBuildingContract = 0
-    // servicingPieceTimeOutLimit = 2
+        session->setPieceAvailability(peer.id, availability);
+    });
 
-    uint totalNumberOfPieces = 30;
-    TorrentPieceInformation information;
-    for(uint i = 0;i < totalNumberOfPieces;i++)
-        information.push_back(PieceInformation(0, (i % 2) == 0)); // every even index piece is missing
+    // Availability must cover whole torrent
+    EXPECT_THROW(session->setPieceAvailability(first.id, PieceAvailability(3)), exception::InvalidPieceAvailability);
+    EXPECT_THROW(session->peerHasPiece(first.id, totalNumberOfPieces), exception::InvalidPieceAvailability);
 
-    ////
+    // First seller was asked for only the pieces it has, even though more requests are allowed,
+    // rarest first, and then by index
+    std::vector<int> requested;
+    for(auto request : first.spy->sendRequestFullPieceCallbackSlot)
+        requested.push_back(std::get<0>(request).pieceIndex());
 
-    toBuyMode(buyerTerms, information);
+    EXPECT_EQ(requested, std::vector<int>({25, 7, 21}));
 
-    // Start session
-    firstStart();
+    // Nothing was left for second seller
+    EXPECT_TRUE(second.spy->sendRequestFullPieceCallbackSlot.empty());
 
-    // Take seller to exchange
-    takeSingleSellerToExchange(first);
+    cleanup();
+}
 
-    // Service all piece requests from buyer until done
-    completeExchange(first);
+TEST_F(SessionTest, buying_piece_priorities)
+{
+    init(Coin::Network::testnet3);
 
-    EXPECT_TRUE(hasPendingFullPieceRequest({first}));
+    protocol_wire::BuyerTerms terms(24, 200, 1, 400);
+    TorrentPieceInformation information = missingPieces(30);
 
-    spy->reset();
+    // Session stays without mode when a priority is out of range
+    information[2].setPriority(MaxPiecePriority + 1);
 
-    // Peer interrupts contract by resending terms
-    session->processMessageOnConnection(first.id, protocol_wire::Buy());
+    EXPECT_THROW(spy->toMonitoredBuyMode(terms, information), exception::InvalidPiecePriority);
+    EXPECT_EQ(session->mode(), SessionMode::not_set);
 
-    // assert removal
-    assertConnectionRemoved(first.id, DisconnectCause::seller_has_interrupted_contract);
+    information[2].setPriority(1);
+    toBuyMode(terms, information);
 
-    // extra check that no other callback was made
-    EXPECT_TRUE(spy->onlyCalledRemovedConnection());
+    EXPECT_EQ(session->piecePriority(2), 1);
+    EXPECT_EQ(session->piecePriority(3), DefaultPiecePriority);
 
-    spy->reset();
+    session->setPiecePriority(10, 20, MaxPiecePriority);
+
+    EXPECT_EQ(session->piecePriority(9), DefaultPiecePriority);
+    EXPECT_EQ(session->piecePriority(10), MaxPiecePriority);
+    EXPECT_EQ(session->piecePriority(19), MaxPiecePriority);
+    EXPECT_EQ(session->piecePriority(20), DefaultPiecePriority);
+
+    // Bad updates are rejected, leaving priorities as they were
+    EXPECT_THROW(session->setPiecePriority(0, 1, MaxPiecePriority + 1), exception::InvalidPiecePriority);
+    EXPECT_THROW(session->setPiecePriority(20, 10, MaxPiecePriority), exception::InvalidPieceRange);
+    EXPECT_THROW(session->setPiecePriority(0, 31, MaxPiecePriority), exception::InvalidPieceRange);
+
+    EXPECT_EQ(session->piecePriority(0), DefaultPiecePriority);
+    EXPECT_EQ(session->piecePriority(20), DefaultPiecePriority);
 
     cleanup();
 }
 
-TEST_F(SessionTest, buying_seller_sent_invalid_piece)
+TEST_F(SessionTest, buying_endgame)
 {
     init(Coin::Network::testnet3);
 
-    // min #sellers = 1
-    protocol_wire::BuyerTerms buyerTerms(24, 200, 1, 400);
-    SellerPeer first(0, protocol_wire::SellerTerms(22, 134, 10, 88, 32), 543, session->network());
+    // Only last two pieces are missing
+    TorrentPieceInformation information = missingPieces(30);
+    for(uint i = 0;i < information.size() - 2;i++)
+        information[i] = PieceInformation(0, true);
 
-    assert(buyerTerms.satisfiedBy(first.terms));
+    std::vector<SellerPeer> sellers = toBuyModeWithSellers(information,
+                                                           {protocol_wire::SellerTerms(22, 134, 10, 88, 32),
+                                                            protocol_wire::SellerTerms(4, 13, 11, 88, 32)});
+    SellerPeer & first = sellers[0];
+    SellerPeer & second = sellers[1];
 
-    /**
-    // To buy mode
-    std::shared_ptr<Coin::UnspentOutput> utxo(
-      new Coin::UnspentP2SHOutput(Coin::KeyPair::generate(),
-                                  uchar_vector(),
-                                  uchar_vector(),
-                                  Coin::typesafeOutPoint(Coin::TransactionId::fromRPCByteOrder(std::string("97a27e013e66bec6cb6704cfcaa5b62d4fc6894658f570ed7d15353835cf3547")),
-                                                         55),
-                                  34561)
-    );
+    EndgamePolicy policy;
+    policy.enable();
+    session->setEndgamePolicy(policy);
+
+    // Start session
+    firstStart();
+
+    takeSellersToExchange(sellers);
+
+    // First seller was assigned both pieces, and second seller was asked for the same ones
+    EXPECT_EQ((int)first.spy->sendRequestFullPieceCallbackSlot.size(), 2);
+    EXPECT_EQ((int)second.spy->sendRequestFullPieceCallbackSlot.size(), 2);
+
+    std::set<int> requested;
+    for(auto request : second.spy->sendRequestFullPieceCallbackSlot)
+        requested.insert(std::get<0>(request).pieceIndex());
+
+    EXPECT_EQ(requested, std::set<int>({28, 29}));
+
+    // Copy from second seller arrives first, and is handed to client
+    protocol_wire::PieceData data = protocol_wire::PieceData::fromHex("179017230471923470");
+    session->processMessageOnConnection(second.id, protocol_wire::FullPiece(data));
+
+    EXPECT_EQ((int)spy->fullPieceArrivedCallbackSlot.size(), 1);
+    EXPECT_EQ(std::get<0>(spy->fullPieceArrivedCallbackSlot.front()), second.id);
+    EXPECT_EQ((int)second.spy->sendPaymentCallbackSlot.size(), 1);
+    spy->fullPieceArrivedCallbackSlot.clear();
+
+    // Late copy from first seller is paid for, but client is not notified
+    session->processMessageOnConnection(first.id, protocol_wire::FullPiece(data));
+
+    EXPECT_TRUE(spy->fullPieceArrivedCallbackSlot.empty());
+    EXPECT_EQ((int)first.spy->sendPaymentCallbackSlot.size(), 1);
+
+    cleanup();
+}
+
+TEST_F(SessionTest, buying_streaming)
+{
+    init(Coin::Network::testnet3);
+
+    // Playback takes a second per piece
+    uint totalNumberOfPieces = 30;
+    std::vector<SellerPeer> sellers = toBuyModeWithSellers(missingPieces(totalNumberOfPieces, 1000));
+    SellerPeer & first = sellers.front();
+
+    EXPECT_THROW(session->startStreaming(0, 0), exception::InvalidStreamingParameters);
+    EXPECT_THROW(session->startStreaming(0, 1000, std::chrono::seconds(0)), exception::InvalidStreamingParameters);
+    EXPECT_THROW(session->startStreaming(totalNumberOfPieces, 1000), exception::InvalidStreamingParameters);
+
+    // Failed attempts left streaming off, so a valid playhead is still rejected
+    EXPECT_THROW(session->updatePlayhead(0), exception::InvalidStreamingParameters);
+
+    session->startStreaming(20, 1000);
+
+    // Start session
+    firstStart();
+
+    takeSellersToExchange(sellers);
+
+    // Pieces were requested in playback order from playhead, rather than by piece picker
+    std::vector<int> requested;
+    for(auto request : first.spy->sendRequestFullPieceCallbackSlot)
+        requested.push_back(std::get<0>(request).pieceIndex());
+
+    EXPECT_EQ(requested, std::vector<int>({20, 21, 22, 23}));
+
+    cleanup();
+}
+
+TEST_F(SessionTest, buying_streaming_rescues_piece_at_risk_of_missing_deadline)
+{
+    init(Coin::Network::testnet3);
+
+    std::chrono::seconds timePassed(0);
+    session->setTimeGetter([&timePassed]() {
+        return std::chrono::high_resolution_clock::time_point::min() + timePassed;
+    });
+
+    std::vector<SellerPeer> sellers = toBuyModeWithSellers(missingPieces(5, 1000),
+                                                           {protocol_wire::SellerTerms(22, 134, 10, 88, 32),
+                                                            protocol_wire::SellerTerms(22, 134, 10, 88, 32)});
+    SellerPeer & first = sellers[0];
+    SellerPeer & second = sellers[1];
+
+    // Playback takes two seconds per piece, so piece i is due at 2i seconds,
+    // and a single rescue is allowed within the critical window
+    session->startStreaming(0, 500, std::chrono::seconds(10), 1);
+
+    // Start session
+    firstStart();
+
+    takeSellersToExchange(sellers);
+
+    // Unmeasured first seller was given pieces 0-3, and second seller the last one
+    EXPECT_EQ((int)first.spy->sendRequestFullPieceCallbackSlot.size(), 4);
+    ASSERT_EQ((int)second.spy->sendRequestFullPieceCallbackSlot.size(), 1);
+    EXPECT_EQ(std::get<0>(second.spy->sendRequestFullPieceCallbackSlot.back()).pieceIndex(), 4);
+
+    protocol_wire::PieceData data = protocol_wire::PieceData::fromHex("179017230471923470");
+
+    // Second seller delivers in a second, first seller takes three, so deadlines of pieces 0 and 1 pass
+    timePassed = std::chrono::seconds(1);
+    session->processMessageOnConnection(second.id, protocol_wire::FullPiece(data));
+
+    timePassed = std::chrono::seconds(3);
+    session->processMessageOnConnection(first.id, protocol_wire::FullPiece(data));
+
+    // Idle second seller is asked for piece 2, which first seller would deliver at 9s,
+    // rather than by its deadline at 4s. Piece 3 is at risk as well, but budget is used up.
+    session->tick();
+
+    ASSERT_EQ((int)second.spy->sendRequestFullPieceCallbackSlot.size(), 2);
+    EXPECT_EQ(std::get<0>(second.spy->sendRequestFullPieceCallbackSlot.back()).pieceIndex(), 2);
+    EXPECT_EQ((int)first.spy->sendRequestFullPieceCallbackSlot.size(), 4);
+
+    // Rescued copy arrives by deadline, and is handed to client
+    spy->fullPieceArrivedCallbackSlot.clear();
+
+    timePassed = std::chrono::seconds(4);
+    session->processMessageOnConnection(second.id, protocol_wire::FullPiece(data));
+
+    ASSERT_EQ((int)spy->fullPieceArrivedCallbackSlot.size(), 1);
+    EXPECT_EQ(std::get<0>(spy->fullPieceArrivedCallbackSlot.front()), second.id);
+    EXPECT_EQ(std::get<2>(spy->fullPieceArrivedCallbackSlot.front()), 2);
+
+    // No further rescue was made
+    EXPECT_EQ((int)second.spy->sendRequestFullPieceCallbackSlot.size(), 2);
+
+    cleanup();
+}
+
+TEST_F(SessionTest, buying_with_asynchronous_validation)
+{
+    init(Coin::Network::testnet3);
+
+    std::vector<SellerPeer> sellers = toBuyModeWithSellers(missingPieces(30));
+    SellerPeer & first = sellers.front();
+
+    std::vector<std::pair<ID, int>> toValidate;
+    session->setPieceValidator([&toValidate](const ID & id, const protocol_wire::PieceData &, int index) {
+        toValidate.push_back(std::make_pair(id, index));
+    });
+
+    // Start session
+    firstStart();
+
+    takeSellersToExchange(sellers);
+
+    ConnectionSpy<ID> * c = first.spy;
+    int requested = std::get<0>(c->sendRequestFullPieceCallbackSlot.front()).pieceIndex();
+    c->sendRequestFullPieceCallbackSlot.clear();
+
+    // Piece arrives, and is handed to validator rather than client callback
+    session->processMessageOnConnection(first.id, protocol_wire::FullPiece(protocol_wire::PieceData::fromHex("179017230471923470")));
+
+    EXPECT_TRUE(spy->fullPieceArrivedCallbackSlot.empty());
+    ASSERT_EQ((int)toValidate.size(), 1);
+    EXPECT_EQ(toValidate.front(), std::make_pair(first.id, requested));
+
+    // Seller is not paid yet, but was sent a new request to keep pipeline full
+    EXPECT_TRUE(c->sendPaymentCallbackSlot.empty());
+    EXPECT_EQ((int)c->sendRequestFullPieceCallbackSlot.size(), 1);
+
+    // Piece is paid for once validated
+    session->pieceValidated(first.id, requested, true);
+
+    EXPECT_EQ((int)c->sendPaymentCallbackSlot.size(), 1);
+
+    cleanup();
+}
+
+TEST_F(SessionTest, buying_pages_piece_status)
+{
+    init(Coin::Network::testnet3);
+
+    const int numberOfPieces = 30;
+
+    std::vector<SellerPeer> sellers = toBuyModeWithSellers(missingPieces(numberOfPieces),
+                                                           {protocol_wire::SellerTerms(22, 134, 10, 88, 32),
+                                                            protocol_wire::SellerTerms(22, 134, 10, 88, 32)});
+    SellerPeer & first = sellers[0];
+
+    session->setPieceValidator([](const ID &, const protocol_wire::PieceData &, int) {});
+
+    // Pages through all pieces, and checks them against the bitmaps and counts of session
+    auto pageThroughPieces = [this, numberOfPieces]() {
+
+        std::vector<status::Piece<ID>> pieces;
+
+        for(int begin = 0;begin < numberOfPieces;begin += 7) {
+
+            std::vector<status::Piece<ID>> page = session->pieceStatus(begin, std::min(begin + 7, numberOfPieces));
+
+            EXPECT_EQ((int)page.size(), std::min(7, numberOfPieces - begin));
+
+            pieces.insert(pieces.end(), page.begin(), page.end());
+        }
+
+        std::map<PieceState, unsigned int> counts;
+
+        for(int i = 0;i < numberOfPieces;i++) {
+            EXPECT_EQ(pieces[i].index, i);
+            counts[pieces[i].state]++;
+        }
+
+        for(PieceState state : {PieceState::unassigned, PieceState::being_downloaded, PieceState::being_validated_and_stored, PieceState::downloaded}) {
+
+            PieceAvailability inState = session->piecesInState(state);
+
+            EXPECT_EQ((int)inState.size(), numberOfPieces);
+            EXPECT_EQ(inState.count(), counts[state]);
+
+            for(int i = 0;i < numberOfPieces;i++)
+                EXPECT_EQ(inState[i], pieces[i].state == state);
+        }
+
+        status::PieceCounts pieceCounts = session->status().buying.pieceCounts;
+
+        EXPECT_EQ(pieceCounts.unassigned, counts[PieceState::unassigned]);
+        EXPECT_EQ(pieceCounts.beingDownloaded, counts[PieceState::being_downloaded]);
+        EXPECT_EQ(pieceCounts.beingValidatedAndStored, counts[PieceState::being_validated_and_stored]);
+        EXPECT_EQ(pieceCounts.downloaded, counts[PieceState::downloaded]);
+
+        return pieces;
+    };
+
+    // Nothing is assigned before downloading starts
+    std::vector<status::Piece<ID>> pieces = pageThroughPieces();
+
+    EXPECT_EQ(session->piecesInState(PieceState::unassigned).count(), (unsigned int)numberOfPieces);
+
+    firstStart();
+
+    takeSellersToExchange(sellers);
+
+    // Requested pieces are assigned to the sellers they were requested from
+    pieces = pageThroughPieces();
+
+    unsigned int numberOfRequests = 0;
+
+    for(const SellerPeer & seller : sellers) {
+
+        EXPECT_GT((int)seller.spy->sendRequestFullPieceCallbackSlot.size(), 0);
+
+        for(const auto & frame : seller.spy->sendRequestFullPieceCallbackSlot) {
+
+            int requested = std::get<0>(frame).pieceIndex();
+
+            EXPECT_EQ(pieces[requested].state, PieceState::being_downloaded);
+            EXPECT_EQ(pieces[requested].connectionId, seller.id);
+
+            numberOfRequests++;
+        }
+    }
+
+    EXPECT_EQ(session->status().buying.pieceCounts.beingDownloaded, numberOfRequests);
+
+    int requested = std::get<0>(first.spy->sendRequestFullPieceCallbackSlot.front()).pieceIndex();
+    first.spy->sendRequestFullPieceCallbackSlot.clear();
+
+    // Piece which arrived stays with its seller while being validated
+    session->processMessageOnConnection(first.id, protocol_wire::FullPiece(protocol_wire::PieceData::fromHex("179017230471923470")));
+
+    pieces = pageThroughPieces();
+
+    EXPECT_EQ(pieces[requested].state, PieceState::being_validated_and_stored);
+    EXPECT_EQ(pieces[requested].connectionId, first.id);
+
+    // Downloaded once client has validated and stored it
+    session->pieceValidated(first.id, requested, true);
+    session->pieceDownloaded(requested);
+
+    pieces = pageThroughPieces();
+
+    EXPECT_EQ(pieces[requested].state, PieceState::downloaded);
+    EXPECT_EQ(session->status().buying.pieceCounts.downloaded, 1u);
+
+    // Empty page, and bad ranges
+    EXPECT_TRUE(session->pieceStatus(numberOfPieces, numberOfPieces).empty());
+    EXPECT_THROW(session->pieceStatus(-1, 2), exception::InvalidPieceRange);
+    EXPECT_THROW(session->pieceStatus(10, 5), exception::InvalidPieceRange);
+    EXPECT_THROW(session->pieceStatus(0, numberOfPieces + 1), exception::InvalidPieceRange);
+
+    cleanup();
+}
+
+TEST_F(SessionTest, buying_with_asynchronous_validation_while_paused)
+{
+    init(Coin::Network::testnet3);
+
+    std::vector<SellerPeer> sellers = toBuyModeWithSellers(missingPieces(30));
+    SellerPeer & first = sellers.front();
+
+    std::vector<int> toValidate;
+    session->setPieceValidator([&toValidate](const ID &, const protocol_wire::PieceData &, int index) {
+        toValidate.push_back(index);
+    });
+
+    // Start session
+    firstStart();
+
+    takeSellersToExchange(sellers);
+
+    ConnectionSpy<ID> * c = first.spy;
+    session->processMessageOnConnection(first.id, protocol_wire::FullPiece(protocol_wire::PieceData::fromHex("179017230471923470")));
+    ASSERT_EQ((int)toValidate.size(), 1);
+
+    pause();
+
+    // Validation finishing while paused is not lost, seller is paid
+    session->pieceValidated(first.id, toValidate.front(), true);
+
+    EXPECT_EQ((int)c->sendPaymentCallbackSlot.size(), 1);
+
+    // After resuming, pieces keep being validated and paid for
+    session->start();
+    EXPECT_EQ(session->state(), SessionState::started);
+
+    session->processMessageOnConnection(first.id, protocol_wire::FullPiece(protocol_wire::PieceData::fromHex("179017230471923470")));
+    ASSERT_EQ((int)toValidate.size(), 2);
+
+    session->pieceValidated(first.id, toValidate.back(), true);
+
+    EXPECT_EQ((int)c->sendPaymentCallbackSlot.size(), 2);
+
+    cleanup();
+}
+
+TEST_F(SessionTest, buying_with_piece_verifier)
+{
+    init(Coin::Network::testnet3);
+
+    std::vector<SellerPeer> sellers = toBuyModeWithSellers(missingPieces(30));
+    SellerPeer & first = sellers.front();
+
+    // Every piece has same content
+    protocol_wire::PieceData data = protocol_wire::PieceData::fromHex("179017230471923470");
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLength;
+    EVP_Digest(data.piece().get(), data.length(), digest, &digestLength, EVP_sha1(), nullptr);
+
+    std::string digests;
+    for(int i = 0;i < 30;i++)
+        digests.append((const char *)digest, digestLength);
+
+    auto verifier = std::make_shared<PieceVerifier>(PieceVerifier::Algorithm::sha1, digests, 1);
+    session->setPieceVerifier(verifier);
+
+    // Start session
+    firstStart();
+
+    takeSellersToExchange(sellers);
+
+    ConnectionSpy<ID> * c = first.spy;
+    int requested = std::get<0>(c->sendRequestFullPieceCallbackSlot.front()).pieceIndex();
+
+    // Piece arrives, and goes to verifier rather than client
+    session->processMessageOnConnection(first.id, protocol_wire::FullPiece(data));
+
+    EXPECT_TRUE(spy->fullPieceArrivedCallbackSlot.empty());
+    EXPECT_TRUE(c->sendPaymentCallbackSlot.empty());
+
+    while(verifier->numberOfPendingPieces() > 0 && spy->fullPieceArrivedCallbackSlot.empty()) {
+        session->processVerifiedPieces();
+        std::this_thread::yield();
+    }
+
+    // Verified piece is handed to client, and then paid for
+    ASSERT_EQ((int)spy->fullPieceArrivedCallbackSlot.size(), 1);
+    EXPECT_EQ(std::get<0>(spy->fullPieceArrivedCallbackSlot.front()), first.id);
+    EXPECT_EQ(std::get<1>(spy->fullPieceArrivedCallbackSlot.front()), data);
+    EXPECT_EQ(std::get<2>(spy->fullPieceArrivedCallbackSlot.front()), requested);
+    EXPECT_EQ((int)c->sendPaymentCallbackSlot.size(), 1);
+
+    cleanup();
+}
+
+TEST_F(SessionTest, buying_seller_has_interrupted_contract)
+{
+    init(Coin::Network::testnet3);
+
+    // min #sellers = 1
+    protocol_wire::BuyerTerms buyerTerms(24, 200, 1, 400);
+
+    SellerPeer first(0, protocol_wire::SellerTerms(22, 134, 10, 88, 32),5634, session->network());
+
+    assert(buyerTerms.satisfiedBy(first.terms));
+
+    /**
+    // To buy mode
+    std::shared_ptr<Coin::UnspentOutput> utxo(
+      new Coin::UnspentP2SHOutput(Coin::KeyPair::generate(),
+                                  uchar_vector(),
+                                  uchar_vector(),
+                                  Coin::typesafeOutPoint(Coin::TransactionId::fromRPCByteOrder(std::string("97a27e013e66bec6cb6704cfcaa5b62d4fc6894658f570ed7d15353835cf3547")),
+                                                         55),
+                                  34561)
+    );
+
+    Coin::UnspentOutputSet funding({utxo});
+    */
+
+    // minTimeBeforeBuildingContract = 0
+    // servicingPieceTimeOutLimit = 2
+
+    uint totalNumberOfPieces = 30;
+    TorrentPieceInformation information;
+    for(uint i = 0;i < totalNumberOfPieces;i++)
+        information.push_back(PieceInformation(0, (i % 2) == 0)); // every even index piece is missing
+
+    ////
+
+    toBuyMode(buyerTerms, information);
+
+    // Start session
+    firstStart();
+
+    // Take seller to exchange
+    takeSingleSellerToExchange(first);
+
+    // Service all piece requests from buyer until done
+    completeExchange(first);
+
+    EXPECT_TRUE(hasPendingFullPieceRequest({first}));
+
+    spy->reset();
+
+    // Peer interrupts contract by resending terms
+    session->processMessageOnConnection(first.id, protocol_wire::Buy());
+
+    // assert removal
+    assertConnectionRemoved(first.id, DisconnectCause::seller_has_interrupted_contract);
+
+    // extra check that no other callback was made
+    EXPECT_TRUE(spy->onlyCalledRemovedConnection());
+
+    spy->reset();
+
+    cleanup();
+}
+
+TEST_F(SessionTest, buying_seller_sent_invalid_piece)
+{
+    init(Coin::Network::testnet3);
+
+    // min #sellers = 1
+    protocol_wire::BuyerTerms buyerTerms(24, 200, 1, 400);
+    SellerPeer first(0, protocol_wire::SellerTerms(22, 134, 10, 88, 32), 543, session->network());
+
+    assert(buyerTerms.satisfiedBy(first.terms));
+
+    /**
+    // To buy mode
+    std::shared_ptr<Coin::UnspentOutput> utxo(
+      new Coin::UnspentP2SHOutput(Coin::KeyPair::generate(),
+                                  uchar_vector(),
+                                  uchar_vector(),
+                                  Coin::typesafeOutPoint(Coin::TransactionId::fromRPCByteOrder(std::string("97a27e013e66bec6cb6704cfcaa5b62d4fc6894658f570ed7d15353835cf3547")),
+                                                         55),
+                                  34561)
+    );
     Coin::UnspentOutputSet funding({utxo});
     */
 
@@ -758,6 +1685,927 @@ TEST_F(SessionTest, seller_slow_to_respond_to_test_payload)
   cleanup();
 }
 
+TEST_F(SessionTest, speed_tests_are_limited_and_cheapest_first)
+{
+  init(Coin::Network::testnet3);
+
+  SpeedTestPolicy speedTestPolicy;
+  speedTestPolicy.setMaxConcurrentTests(1);
+  session->setSpeedTestPolicy(speedTestPolicy);
+
+  auto expectedPayloadSize = speedTestPolicy.payloadSize();
+
+  // min #sellers = 1
+  protocol_wire::BuyerTerms buyerTerms(24, 200, 1, 400);
+
+  SellerPeer first(0, protocol_wire::SellerTerms(22, 134, 10, 88, 32),5634, session->network());
+  SellerPeer second(1, protocol_wire::SellerTerms(22, 134, 10, 88, 32),5634, session->network());
+  SellerPeer third(2, protocol_wire::SellerTerms(20, 134, 10, 88, 32),5634, session->network());
+
+  toBuyMode(buyerTerms, TorrentPieceInformation());
+
+  // Start session
+  firstStart();
+
+  add(first);
+  add(second);
+  add(third);
+
+  // Only first seller is being tested
+  EXPECT_EQ((int)first.spy->sendSpeedTestRequestCallbackSlot.size(), 1);
+  EXPECT_EQ((int)second.spy->sendSpeedTestRequestCallbackSlot.size(), 0);
+  EXPECT_EQ((int)third.spy->sendSpeedTestRequestCallbackSlot.size(), 0);
+
+  respondToSpeedTestRequest(first, expectedPayloadSize);
+
+  assertSellerInvited(first);
+
+  // Cheaper seller is tested next
+  EXPECT_EQ((int)second.spy->sendSpeedTestRequestCallbackSlot.size(), 0);
+  EXPECT_EQ((int)third.spy->sendSpeedTestRequestCallbackSlot.size(), 1);
+
+  // Last seller is tested once slot is freed by removal
+  session->removeConnection(third.id);
+
+  EXPECT_EQ((int)second.spy->sendSpeedTestRequestCallbackSlot.size(), 1);
+
+  cleanup();
+}
+
+TEST_F(SessionTest, buying_prefers_faster_seller)
+{
+    init(Coin::Network::testnet3);
+
+    std::chrono::seconds timePassed(0);
+    session->setTimeGetter([&timePassed]() {
+        return std::chrono::high_resolution_clock::time_point::min() + timePassed;
+    });
+
+    std::vector<SellerPeer> sellers = toBuyModeWithSellers(missingPieces(30),
+                                                           {protocol_wire::SellerTerms(22, 134, 10, 88, 32),
+                                                            protocol_wire::SellerTerms(22, 134, 10, 88, 32)});
+    SellerPeer & first = sellers[0];
+    SellerPeer & second = sellers[1];
+
+    // Start session
+    firstStart();
+
+    takeSellersToExchange(sellers);
+
+    // Unmeasured sellers are given full pipelines
+    EXPECT_EQ((int)first.spy->sendRequestFullPieceCallbackSlot.size(), 4);
+    EXPECT_EQ((int)second.spy->sendRequestFullPieceCallbackSlot.size(), 4);
+
+    protocol_wire::FullPiece piece(protocol_wire::PieceData::fromHex("179017230471923470"));
+
+    // First seller takes a second per piece, second seller takes four
+    timePassed += std::chrono::seconds(1);
+    session->processMessageOnConnection(first.id, piece);
+
+    for(int i = 0;i < 4;i++) {
+        timePassed += std::chrono::seconds(i == 0 ? 3 : 4);
+        session->processMessageOnConnection(second.id, piece);
+    }
+
+    auto status = session->status().buying.sellers;
+
+    EXPECT_DOUBLE_EQ(status.at(first.id).piecesPerSecond, 1);
+    EXPECT_DOUBLE_EQ(status.at(second.id).piecesPerSecond, 0.25);
+    EXPECT_GT(status.at(first.id).score, status.at(second.id).score);
+
+    // Faster seller had its pipeline refilled, while slower one was only given
+    // a single new piece once it had delivered all it was asked for
+    EXPECT_EQ((int)first.spy->sendPaymentCallbackSlot.size(), 1);
+    EXPECT_EQ((int)first.spy->sendRequestFullPieceCallbackSlot.size(), 5);
+
+    EXPECT_EQ((int)second.spy->sendPaymentCallbackSlot.size(), 4);
+    EXPECT_EQ((int)second.spy->sendRequestFullPieceCallbackSlot.size(), 5);
+
+    cleanup();
+}
+
+TEST_F(SessionTest, buying_resumes_from_checkpoint)
+{
+    init(Coin::Network::testnet3);
+
+    std::vector<SellerPeer> sellers = toBuyModeWithSellers(missingPieces(30));
+
+    // Start session
+    firstStart();
+
+    // Seller passes speed test, and some pieces are downloaded elsewhere
+    addAndRespondToSpeedTest(sellers.front());
+    assertSellerInvited(sellers.front());
+
+    session->pieceDownloaded(3);
+    session->pieceDownloaded(5);
+    session->setPiecePriority(10, 20, MaxPiecePriority);
+
+    std::string file = temporaryFile();
+
+    session->checkpoint().save(file);
+
+    cleanup();
+
+    // Restart with fresh session for same torrent
+    init(Coin::Network::testnet3);
+
+    sellers = toBuyModeWithSellers(missingPieces(30));
+
+    BuyingCheckpoint checkpoint = BuyingCheckpoint::load(file);
+
+    std::remove(file.c_str());
+
+    // Checkpoint with a bad priority is rejected before any of it is applied
+    BuyingCheckpoint bad = checkpoint;
+    bad.priorities.push_back(BuyingCheckpoint::PriorityRange(0, 1, MaxPiecePriority + 1));
+
+    EXPECT_THROW(session->restore(bad), exception::InvalidCheckpoint);
+    EXPECT_TRUE(session->piecesInState(PieceState::downloaded).none());
+
+    session->restore(checkpoint);
+
+    PieceAvailability downloaded(30);
+    downloaded.set(3);
+    downloaded.set(5);
+
+    EXPECT_EQ(session->piecesInState(PieceState::downloaded), downloaded);
+    EXPECT_EQ(session->status().buying.pieceCounts.downloaded, 2u);
+    EXPECT_EQ(session->status().buying.pieceCounts.unassigned, 28u);
+
+    EXPECT_EQ(session->piecePriority(9), DefaultPiecePriority);
+    EXPECT_EQ(session->piecePriority(10), MaxPiecePriority);
+    EXPECT_EQ(session->piecePriority(19), MaxPiecePriority);
+    EXPECT_EQ(session->piecePriority(20), DefaultPiecePriority);
+
+    firstStart();
+
+    // Known seller is invited without being tested again
+    SellerPeer & seller = sellers.front();
+    add(seller);
+
+    EXPECT_TRUE(seller.spy->sendSpeedTestRequestCallbackSlot.empty());
+    assertSellerInvited(seller);
+
+    cleanup();
+}
+
+TEST_F(SessionTest, buying_disconnects_slow_sellers)
+{
+    init(Coin::Network::testnet3);
+
+    std::chrono::seconds timePassed(0);
+    session->setTimeGetter([&timePassed]() {
+        return std::chrono::high_resolution_clock::time_point::min() + timePassed;
+    });
+
+    std::vector<SellerPeer> sellers = toBuyModeWithSellers(missingPieces(30),
+                                                           {protocol_wire::SellerTerms(22, 134, 10, 88, 32),
+                                                            protocol_wire::SellerTerms(22, 134, 10, 88, 32)});
+    SellerPeer & first = sellers[0];
+    SellerPeer & second = sellers[1];
+
+    // Start session
+    firstStart();
+
+    takeSellersToExchange(sellers);
+
+    protocol_wire::FullPiece piece(protocol_wire::PieceData::fromHex("179017230471923470"));
+
+    // First seller takes a second per piece, second seller takes four
+    for(int i = 1;i <= 12;i++) {
+        timePassed += std::chrono::seconds(1);
+        session->processMessageOnConnection(first.id, piece);
+
+        if(i % 4 == 0)
+            session->processMessageOnConnection(second.id, piece);
+    }
+
+    spy->reset();
+
+    // Nobody is slower than limit
+    session->disconnectSlowSellers(std::chrono::seconds(5));
+
+    EXPECT_TRUE(spy->removedConnectionCallbackSlot.empty());
+
+    // Second seller still has a piece outstanding
+    EXPECT_EQ(session->pieceStatus(7, 8).front().state, PieceState::being_downloaded);
+    EXPECT_EQ(session->pieceStatus(7, 8).front().connectionId, second.id);
+
+    // Both are slower than limit, but best seller is kept
+    session->disconnectSlowSellers(std::chrono::milliseconds(500));
+
+    assertConnectionRemoved(second.id, DisconnectCause::seller_is_too_slow);
+    EXPECT_EQ((int)spy->removedConnectionCallbackSlot.size(), 1);
+    EXPECT_TRUE(session->hasConnection(first.id));
+    EXPECT_EQ((int)session->status().buying.sellers.size(), 1);
+
+    // Outstanding piece of slow seller is given to first seller once it has room
+    EXPECT_EQ(session->pieceStatus(7, 8).front().state, PieceState::unassigned);
+
+    first.spy->sendRequestFullPieceCallbackSlot.clear();
+
+    timePassed += std::chrono::seconds(1);
+    session->processMessageOnConnection(first.id, piece);
+
+    ASSERT_EQ((int)first.spy->sendRequestFullPieceCallbackSlot.size(), 1);
+    EXPECT_EQ(std::get<0>(first.spy->sendRequestFullPieceCallbackSlot.front()).pieceIndex(), 7);
+    EXPECT_EQ(session->pieceStatus(7, 8).front().connectionId, first.id);
+
+    cleanup();
+}
+
+// State machine allocations are only left out of counts when built with this flag, see AllocationAccounting
+#ifdef JOYSTREAM_PROTOCOLSESSION_COUNT_ALLOCATIONS
+TEST_F(SessionTest, buying_steady_state_does_not_allocate)
+{
+    ASSERT_TRUE(AllocationAccounting::hooksInstalled());
+
+    init(Coin::Network::testnet3);
+
+    std::vector<SellerPeer> sellers = toBuyModeWithSellers(missingPieces(2000));
+    SellerPeer & first = sellers.front();
+
+    // Start session
+    firstStart();
+
+    takeSellersToExchange(sellers);
+
+    protocol_wire::FullPiece piece(protocol_wire::PieceData::fromHex("179017230471923470"));
+
+    // Arrival of a requested piece, which is validated, paid for and replaced by a new request.
+    // Client callback frames are dropped right away, so spy does not grow.
+    auto arrival = [&]() {
+        session->processMessageOnConnection(first.id, piece);
+        spy->fullPieceArrivedCallbackSlot.clear();
+    };
+
+    // Warm up buffers
+    for(int i = 0;i < 20;i++)
+        arrival();
+
+    AllocationScope scope;
+
+    for(int i = 0;i < 1000;i++)
+        arrival();
+
+    // Only allocations of this library: those of state machine, e.g. for transitions and signing payments, are not counted
+    EXPECT_EQ(scope.statistics().allocations, (uint64_t)0);
+
+    cleanup();
+}
+
+TEST_F(SessionTest, selling_steady_state_does_not_allocate)
+{
+    ASSERT_TRUE(AllocationAccounting::hooksInstalled());
+
+    init(Coin::Network::testnet3);
+
+    protocol_wire::SellerTerms sellerTerms(22, 134, 10, 88, 32);
+    protocol_wire::BuyerTerms buyerTerms(24, 200, 2, 400);
+    Coin::PrivateKey payorContractSk = Coin::PrivateKey::fromRawHex(TEST_PRIVATE_KEY);
+
+    // Enough value to pay for every piece
+    protocol_wire::Ready ready(100000,
+                               Coin::typesafeOutPoint(Coin::TransactionId::fromRPCByteOrder(std::string("97a27e013e66bec6cb6704cfcaa5b62d4fc6894658f570ed7d15353835cf3547")), 55),
+                               payorContractSk.toPublicKey(),
+                               Coin::RedeemScriptHash::fromRawHash(uchar_vector("03a3fac91cac4a5c9ec870b444c4890ec7d68671")));
+
+    ID buyer = 0;
+    int numberOfPieces = 1020;
+    protocol_wire::PieceData data = protocol_wire::PieceData::fromHex("01020304");
+
+    toSellMode(sellerTerms, numberOfPieces);
+    firstStart();
+
+    Coin::PublicKey payeeContractPk;
+    Coin::RedeemScriptHash payeeFinalScriptHash;
+    addBuyerAndGoToReadyForPieceRequest(buyer, buyerTerms, ready, payeeContractPk, payeeFinalScriptHash);
+    paymentchannel::Payor payor = getPayor(sellerTerms, ready, payorContractSk, payeeContractPk, payeeFinalScriptHash, Coin::Network::testnet3);
+
+    ConnectionSpy<ID> * c = spy->connectionSpies.at(buyer);
+
+    // Messages from buyer are made up front, as signing payments allocates
+    std::vector<protocol_wire::RequestFullPiece> requests;
+    std::vector<protocol_wire::Payment> payments;
+
+    for(int i = 0;i < numberOfPieces;i++) {
+        requests.push_back(protocol_wire::RequestFullPiece(i));
+        payments.push_back(protocol_wire::Payment(payor.makePayment()));
+    }
+
+    // Request of a piece, which is loaded, sent and paid for.
+    // Client callback frames are dropped right away, so spy does not grow.
+    auto exchange = [&](int i) {
+        session->processMessageOnConnection(buyer, requests[i]);
+        spy->loadPieceForBuyerCallbackSlot.clear();
+
+        session->pieceLoaded(data, i);
+        c->sendFullPieceCallbackSlot.clear();
+
+        session->processMessageOnConnection(buyer, payments[i]);
+    };
+
+    // Warm up buffers
+    for(int i = 0;i < 20;i++)
+        exchange(i);
+
+    AllocationScope scope;
+
+    for(int i = 20;i < numberOfPieces;i++)
+        exchange(i);
+
+    AllocationStatistics statistics = scope.statistics();
+
+    // As for buying, allocations of state machine are not counted
+    EXPECT_EQ(statistics.allocations, (uint64_t)0);
+
+    // Every piece was sent and paid for
+    EXPECT_EQ(session->status().selling.bufferedPieceData, 0u);
+    EXPECT_TRUE(session->hasConnection(buyer));
+
+    cleanup();
+}
+#endif
+
+TEST(PieceDeliveryPipelineTest, steady_state_does_not_allocate)
+{
+    ASSERT_TRUE(AllocationAccounting::hooksInstalled());
+
+    detail::PieceDeliveryPipeline pipeline;
+
+    std::vector<int> piecesToLoad;
+    std::vector<protocol_wire::PieceData> piecesToSend;
+
+    protocol_wire::PieceData data(boost::shared_array<char>(new char[16]), 16);
+
+    // One request, load, send and payment cycle per piece, as when servicing a buyer
+    auto cycle = [&](int index) {
+        pipeline.add(index);
+
+        pipeline.getNextBatchToLoad(6, piecesToLoad);
+        EXPECT_EQ(piecesToLoad.size(), (size_t)1);
+
+        EXPECT_EQ(pipeline.dataReady(index, data), 1);
+
+        pipeline.getNextBatchToSend(4, piecesToSend);
+        EXPECT_EQ(piecesToSend.size(), (size_t)1);
+
+        pipeline.paymentReceived();
+    };
+
+    // Warm up buffers
+    for(int i = 0;i < 4;i++)
+        cycle(i);
+
+    AllocationScope scope;
+
+    for(int i = 4;i < 1000;i++)
+        cycle(i);
+
+    // Allocations made while counting is turned off are not seen
+    {
+        AllocationCounting counting(false);
+        std::unique_ptr<int> p(new int(0));
+    }
+
+    EXPECT_TRUE(AllocationAccounting::isCounting());
+    EXPECT_EQ(scope.statistics().allocations, (uint64_t)0);
+}
+
+TEST(PieceDeliveryPipelineTest, counts_buffered_bytes)
+{
+    detail::PieceDeliveryPipeline pipeline;
+
+    std::vector<int> piecesToLoad;
+    protocol_wire::PieceData data(boost::shared_array<char>(new char[16]), 16);
+
+    pipeline.add(0);
+    pipeline.add(1);
+    pipeline.add(2);
+
+    pipeline.getNextBatchToLoad(6, piecesToLoad);
+
+    pipeline.dataReady(0, data);
+    pipeline.dataReady(1, data);
+    pipeline.dataReady(2, data);
+
+    EXPECT_EQ(pipeline.bytesBuffered(), 48u);
+
+    // Sent pieces no longer hold their data
+    EXPECT_TRUE(pipeline.takeNextToSend(4, data));
+    EXPECT_EQ(pipeline.bytesBuffered(), 32u);
+
+    pipeline.paymentReceived();
+    EXPECT_EQ(pipeline.bytesBuffered(), 32u);
+
+    // Polite payment for piece which was never sent drops its data
+    pipeline.paymentReceived();
+    EXPECT_EQ(pipeline.bytesBuffered(), 16u);
+
+    EXPECT_GT(pipeline.memoryUsage(), 0u);
+}
+
+TEST(PieceDeliveryPipelineTest, evicted_pieces_are_loaded_again)
+{
+    detail::PieceDeliveryPipeline pipeline;
+
+    std::vector<int> piecesToLoad;
+    protocol_wire::PieceData data(boost::shared_array<char>(new char[16]), 16);
+
+    pipeline.add(0);
+    pipeline.add(1);
+    pipeline.add(2);
+
+    // Loads are capped by budget
+    pipeline.getNextBatchToLoad(6, piecesToLoad, 2);
+    EXPECT_EQ(piecesToLoad, std::vector<int>({0, 1}));
+    EXPECT_EQ(pipeline.piecesLoading(), 2);
+
+    pipeline.dataReady(0, data);
+    pipeline.dataReady(1, data);
+    EXPECT_EQ(pipeline.piecesLoading(), 0);
+
+    EXPECT_TRUE(pipeline.takeNextToSend(0, data));
+    EXPECT_TRUE(pipeline.awaitingPayment());
+
+    // Only data not yet sent is dropped
+    EXPECT_EQ(pipeline.evictBuffered(), 16u);
+    EXPECT_EQ(pipeline.bytesBuffered(), 0u);
+
+    pipeline.getNextBatchToLoad(6, piecesToLoad);
+    EXPECT_EQ(piecesToLoad, std::vector<int>({1, 2}));
+    EXPECT_EQ(pipeline.piecesLoading(), 2);
+
+    pipeline.paymentReceived();
+    EXPECT_FALSE(pipeline.awaitingPayment());
+}
+
+TEST(PriorityIndexTest, picks_lowest_index_with_highest_priority)
+{
+    detail::PriorityIndex index;
+    index.resize(100);
+
+    EXPECT_EQ(index.top(), -1);
+
+    for(int i = 0;i < 100;i++)
+        index.include(i);
+
+    EXPECT_FALSE(index.hasPriorities());
+    EXPECT_EQ(index.top(), 0);
+
+    // Raise a range, e.g. a selected file
+    index.setPriority(40, 60, MaxPiecePriority);
+    EXPECT_TRUE(index.hasPriorities());
+    EXPECT_EQ(index.top(), 40);
+
+    index.exclude(40);
+    EXPECT_EQ(index.top(), 41);
+
+    // Lowered pieces come last
+    index.setPriority(0, 10, 0);
+    index.setPriority(40, 60, DefaultPiecePriority);
+    EXPECT_TRUE(index.hasPriorities());
+    EXPECT_EQ(index.top(), 10);
+
+    index.setPriority(0, 10, DefaultPiecePriority);
+    EXPECT_FALSE(index.hasPriorities());
+    EXPECT_EQ(index.top(), 0);
+
+    for(int i = 0;i < 100;i++)
+        index.exclude(i);
+
+    EXPECT_EQ(index.top(), -1);
+}
+
+TEST(PriorityIndexTest, picks_rarest_among_filtered_candidates)
+{
+    detail::PriorityIndex index;
+    index.resize(100);
+
+    for(int i = 0;i < 100;i++)
+        index.include(i);
+
+    // Seller has every other piece above 50
+    PieceAvailability has(100);
+    for(int i = 51;i < 100;i += 2)
+        has.set(i);
+
+    EXPECT_EQ(index.top(has), 51);
+
+    // Everyone else has low pieces
+    PieceAvailability others(100);
+    others.set(0, 60, true);
+    index.addAvailability(others);
+    index.addAvailability(others);
+
+    EXPECT_EQ(index.availability(10), 2u);
+    EXPECT_EQ(index.top(), 60);
+    EXPECT_EQ(index.top(has), 61);
+
+    // Rarity only breaks ties among same priority
+    index.setPriority(53, 54, MaxPiecePriority);
+    EXPECT_EQ(index.top(has), 53);
+
+    index.exclude(53);
+    index.addAvailability(61);
+    EXPECT_EQ(index.availability(61), 1u);
+    EXPECT_EQ(index.top(has), 63);
+
+    index.removeAvailability(others);
+    index.removeAvailability(others);
+    index.removeAvailability(61);
+    EXPECT_EQ(index.top(), 0);
+    EXPECT_EQ(index.top(has), 51);
+
+    // Nothing in filter is a candidate
+    PieceAvailability none(100);
+    none.set(53);
+    EXPECT_EQ(index.top(none), -1);
+}
+
+TEST(PieceVerifierTest, verifies_pieces_on_workers)
+{
+    // Pieces filled with their own index, and digests where every third one is wrong
+    const int numberOfPieces = 64;
+    const unsigned int pieceLength = 1 << 16;
+
+    std::vector<protocol_wire::PieceData> pieces;
+    std::string digests;
+
+    for(int i = 0;i < numberOfPieces;i++) {
+        boost::shared_array<char> data(new char[pieceLength]);
+        std::memset(data.get(), i, pieceLength);
+        pieces.push_back(protocol_wire::PieceData(data, pieceLength));
+
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digestLength;
+        EVP_Digest(data.get(), pieceLength, digest, &digestLength, EVP_sha1(), nullptr);
+
+        if(i % 3 == 0)
+            digest[0] ^= 1;
+
+        digests.append((const char *)digest, digestLength);
+    }
+
+    PieceVerifier verifier(PieceVerifier::Algorithm::sha1, digests, 4);
+
+    EXPECT_EQ(verifier.numberOfPieces(), (unsigned int)numberOfPieces);
+    EXPECT_EQ(verifier.numberOfThreads(), 4u);
+    EXPECT_THROW(verifier.submit(numberOfPieces, pieces[0]), std::runtime_error);
+    EXPECT_THROW(verifier.verify(-1, pieces[0].piece().get(), pieceLength), std::runtime_error);
+    EXPECT_THROW(verifier.verify(numberOfPieces, pieces[0].piece().get(), pieceLength), std::runtime_error);
+
+    // Connection and generation of each piece are handed back with result
+    for(int i = 0;i < numberOfPieces;i++)
+        verifier.submit(i, pieces[i], 1000 + i, i / 2);
+
+    std::map<int, PieceVerifier::Result> results;
+    std::vector<PieceVerifier::Result> batch;
+
+    while(verifier.numberOfPendingPieces() > 0) {
+        verifier.takeResults(batch);
+
+        for(auto result : batch)
+            results[result.index] = result;
+
+        std::this_thread::yield();
+    }
+
+    ASSERT_EQ((int)results.size(), numberOfPieces);
+
+    for(int i = 0;i < numberOfPieces;i++) {
+        EXPECT_EQ(results[i].valid, i % 3 != 0);
+        EXPECT_EQ(results[i].connection, (uint32_t)(1000 + i));
+        EXPECT_EQ(results[i].generation, (uint32_t)(i / 2));
+        EXPECT_EQ(results[i].data.piece(), pieces[i].piece());
+    }
+}
+
+TEST(BandwidthEstimatorTest, tracks_recent_deliveries)
+{
+    detail::BandwidthEstimator estimator;
+
+    EXPECT_FALSE(estimator.hasEstimate());
+    EXPECT_EQ(estimator.bytesPerSecond(), 0);
+
+    // First delivery sets estimate
+    estimator.delivered(1000, std::chrono::seconds(1), std::chrono::seconds(2));
+
+    EXPECT_TRUE(estimator.hasEstimate());
+    EXPECT_DOUBLE_EQ(estimator.bytesPerSecond(), 1000);
+    EXPECT_DOUBLE_EQ(estimator.serviceTime().count(), 1);
+    EXPECT_DOUBLE_EQ(estimator.latency().count(), 2);
+
+    // Later deliveries weigh in by a quarter
+    estimator.delivered(1000, std::chrono::milliseconds(500), std::chrono::seconds(2));
+
+    EXPECT_DOUBLE_EQ(estimator.bytesPerSecond(), 0.75 * 1000 + 0.25 * 2000);
+    EXPECT_DOUBLE_EQ(estimator.serviceTime().count(), 0.75 * 1 + 0.25 * 0.5);
+
+    // Seller slowing down is picked up within a few pieces
+    for(int i = 0;i < 10;i++)
+        estimator.delivered(1000, std::chrono::seconds(10), std::chrono::seconds(10));
+
+    EXPECT_GT(estimator.serviceTime().count(), 9);
+    EXPECT_LT(estimator.bytesPerSecond(), 200);
+    EXPECT_EQ(estimator.numberOfSamples(), 12u);
+    EXPECT_EQ(estimator.bytesDelivered(), 12000u);
+}
+
+TEST(SpeedTestPayloadPoolTest, payloads_share_one_buffer)
+{
+    SpeedTestPayloadPool pool;
+
+    pool.reserve(1000);
+    EXPECT_EQ(pool.capacity(), 1000u);
+
+    SpeedTestPayloadPool::Payload small = pool.get(10), medium = pool.get(1000);
+
+    EXPECT_EQ(small.size, 10u);
+    EXPECT_EQ(small.data.get(), medium.data.get());
+
+    // Growing replaces buffer, but payloads handed out keep theirs
+    SpeedTestPayloadPool::Payload large = pool.get(5000);
+
+    EXPECT_EQ(pool.capacity(), 5000u);
+    EXPECT_NE(large.data.get(), medium.data.get());
+    EXPECT_EQ(medium.data.use_count(), 2);
+
+    for(uint32_t i = 0;i < large.size;i++)
+        ASSERT_EQ(large.data.get()[i], 0);
+
+    EXPECT_EQ(pool.get(2000).data.get(), large.data.get());
+}
+
+TEST(PieceTableTest, packs_states_and_derives_sizes)
+{
+    PieceAvailability downloaded(100);
+    downloaded.set(0);
+    downloaded.set(63);
+
+    detail::ConnectionHandles<ID> handles;
+    auto seven = handles.add(7), eight = handles.add(8);
+
+    detail::PieceTable<ID> pieces(&handles, 100, 16384, 100, downloaded);
+
+    EXPECT_EQ(pieces.size(), 100u);
+    EXPECT_EQ(pieces.state(0), PieceState::downloaded);
+    EXPECT_EQ(pieces.state(63), PieceState::downloaded);
+    EXPECT_EQ(pieces.state(64), PieceState::unassigned);
+    EXPECT_EQ(pieces.pieceSize(98), 16384u);
+    EXPECT_EQ(pieces.pieceSize(99), 100u);
+
+    pieces.assigned(32, seven);
+    pieces.assigned(33, eight);
+    pieces.arrived(33);
+
+    EXPECT_EQ(pieces.state(32), PieceState::being_downloaded);
+    EXPECT_EQ(pieces.state(33), PieceState::being_validated_and_stored);
+    EXPECT_EQ(pieces.state(31), PieceState::unassigned);
+    EXPECT_TRUE(pieces.assignedTo(32, seven));
+    EXPECT_FALSE(pieces.assignedTo(33, seven));
+    EXPECT_EQ(pieces.handle(33), eight);
+    EXPECT_EQ(pieces.at(33).connectionId(), 8u);
+
+    // Unassigned pieces carry default id, but no handle
+    EXPECT_EQ(pieces.at(31).connectionId(), ID());
+    EXPECT_EQ(pieces.handle(31), detail::ConnectionHandles<ID>::NoHandle);
+    EXPECT_FALSE(pieces.assignedTo(31, detail::ConnectionHandles<ID>::NoHandle));
+
+    pieces.deAssign(32);
+    pieces.downloaded(33);
+
+    EXPECT_EQ(pieces.state(32), PieceState::unassigned);
+    EXPECT_EQ(pieces.state(33), PieceState::downloaded);
+    EXPECT_FALSE(pieces.assignedTo(33, eight));
+
+    EXPECT_EQ(pieces.numberOfPieces(PieceState::downloaded), 3u);
+    EXPECT_EQ(pieces.numberOfPieces(PieceState::unassigned), 97u);
+    EXPECT_EQ(pieces.numberOfPieces(PieceState::being_validated_and_stored), 0u);
+
+    PieceAvailability bitmap = pieces.piecesInState(PieceState::downloaded);
+
+    EXPECT_EQ(bitmap.size(), 100u);
+    EXPECT_EQ(bitmap.count(), 3u);
+    EXPECT_TRUE(bitmap.test(0) && bitmap.test(33) && bitmap.test(63));
+    EXPECT_EQ(pieces.piecesInState(PieceState::unassigned).count(), 97u);
+
+    // Irregular piece sizes are kept
+    TorrentPieceInformation information;
+    information.push_back(PieceInformation(10, false));
+    information.push_back(PieceInformation(20, true));
+    information.push_back(PieceInformation(5, false));
+
+    detail::PieceTable<ID> irregular(&handles, information);
+
+    EXPECT_EQ(irregular.pieceSize(1), 20u);
+    EXPECT_EQ(irregular.pieceSize(2), 5u);
+    EXPECT_EQ(irregular.state(1), PieceState::downloaded);
+}
+
+TEST(ConnectionHandlesTest, reuses_handles_only_when_asked)
+{
+    detail::ConnectionHandles<std::string> handles;
+
+    auto first = handles.add("first");
+    auto second = handles.add("second");
+
+    EXPECT_EQ(handles.id(first), "first");
+    EXPECT_EQ(handles.size(), 2u);
+
+    const std::string & id = handles.id(first);
+
+    handles.release(first);
+
+    // Released id is still valid, and its handle is not handed out
+    auto third = handles.add("third");
+
+    EXPECT_NE(third, first);
+    EXPECT_EQ(id, "first");
+    EXPECT_EQ(handles.size(), 2u);
+
+    handles.reuseReleased();
+
+    EXPECT_EQ(handles.add("fourth"), first);
+    EXPECT_EQ(handles.id(second), "second");
+
+    // Ids are looked up by handle, released ones right away
+    EXPECT_EQ(handles.find("second"), second);
+    EXPECT_EQ(handles.find("fourth"), first);
+    EXPECT_EQ(handles.find("first"), detail::ConnectionHandles<std::string>::NoHandle);
+
+    handles.release(second);
+    EXPECT_EQ(handles.find("second"), detail::ConnectionHandles<std::string>::NoHandle);
+    EXPECT_EQ(handles.add("second"), third + 1);
+}
+
+TEST(SellerOrderBookTest, finds_cheapest_sellers_within_price)
+{
+    detail::SellerOrderBook<ID> book;
+
+    book.update(0, protocol_wire::SellerTerms(30, 1, 5, 1, 1));
+    book.update(1, protocol_wire::SellerTerms(10, 1, 5, 1, 1));
+    book.update(2, protocol_wire::SellerTerms(20, 1, 5, 1, 1));
+    book.update(3, protocol_wire::SellerTerms(50, 1, 5, 1, 1));
+
+    // Seller lowers price
+    book.update(0, protocol_wire::SellerTerms(5, 1, 5, 1, 1));
+
+    std::vector<ID> sellers;
+
+    book.compatibleSellers(protocol_wire::BuyerTerms(40, 10, 1, 10), 0, sellers);
+    EXPECT_EQ(sellers, std::vector<ID>({0, 1, 2}));
+
+    book.compatibleSellers(protocol_wire::BuyerTerms(40, 10, 1, 10), 2, sellers);
+    EXPECT_EQ(sellers, std::vector<ID>({0, 1}));
+
+    book.remove(1);
+
+    EXPECT_EQ(book.size(), 3u);
+    EXPECT_TRUE(book.terms(1) == nullptr);
+    EXPECT_EQ(book.terms(2)->minPrice(), 20u);
+}
+
+TEST(UploadSchedulerTest, shares_budget_by_weight)
+{
+    UploadScheduler scheduler(8000, 8000, 1000);
+
+    int sentByCheap = 0, sentByGenerous = 0;
+
+    UploadScheduler::Flow cheap = scheduler.add([]() { return 1000u; }, [&sentByCheap]() { sentByCheap++; });
+    UploadScheduler::Flow generous = scheduler.add([]() { return 1000u; }, [&sentByGenerous]() { sentByGenerous++; });
+
+    scheduler.setWeight(cheap, 10);
+    scheduler.setWeight(generous, 30);
+
+    scheduler.schedule(cheap);
+    scheduler.schedule(generous);
+
+    auto now = std::chrono::high_resolution_clock::now();
+
+    // Budget is used up by both flows in proportion to weight
+    scheduler.run(now);
+
+    EXPECT_EQ(sentByCheap, 2);
+    EXPECT_EQ(sentByGenerous, 6);
+    EXPECT_EQ(scheduler.bytesSent(), 8000u);
+
+    // Budget is refilled as time passes
+    scheduler.run(now + std::chrono::milliseconds(500));
+
+    EXPECT_EQ(sentByCheap + sentByGenerous, 12);
+
+    scheduler.remove(generous);
+
+    EXPECT_EQ(scheduler.numberOfFlows(), 1u);
+    EXPECT_EQ(scheduler.numberOfScheduledFlows(), 1u);
+
+    // Flow with nothing left to send is no longer scheduled
+    UploadScheduler unlimited;
+
+    int left = 3;
+
+    UploadScheduler::Flow flow = unlimited.add([&left]() { return left > 0 ? 100u : 0u; }, [&left]() { left--; });
+
+    unlimited.schedule(flow);
+    unlimited.run(now);
+
+    EXPECT_EQ(left, 0);
+    EXPECT_EQ(unlimited.numberOfScheduledFlows(), 0u);
+}
+
+TEST(TokenBucketTest, limits_rate_and_counts_throttled_time)
+{
+    detail::TokenBucket bucket(1000, 2000);
+
+    auto now = std::chrono::high_resolution_clock::now();
+
+    // Burst can be sent at once
+    EXPECT_TRUE(bucket.allows(2000, now));
+    bucket.spend(2000);
+
+    EXPECT_FALSE(bucket.allows(500, now));
+
+    // Refilled at given rate
+    EXPECT_FALSE(bucket.allows(500, now + std::chrono::milliseconds(250)));
+    EXPECT_TRUE(bucket.allows(500, now + std::chrono::milliseconds(500)));
+
+    EXPECT_NEAR(bucket.throttledTime(now + std::chrono::seconds(10)).count(), 0.5, 1e-6);
+
+    // Send larger than burst waits for full bucket, leaving it in debt
+    bucket.spend(500);
+
+    EXPECT_FALSE(bucket.allows(5000, now + std::chrono::milliseconds(1500)));
+    EXPECT_TRUE(bucket.allows(5000, now + std::chrono::milliseconds(2500)));
+    bucket.spend(5000);
+
+    EXPECT_FALSE(bucket.allows(1, now + std::chrono::milliseconds(4500)));
+
+    // No limit
+    detail::TokenBucket unlimited;
+
+    EXPECT_TRUE(unlimited.allows(UINT32_MAX, now));
+}
+
+TEST(BuyingCheckpointTest, round_trips_through_file)
+{
+    BuyingCheckpoint checkpoint;
+
+    checkpoint.numberOfPieces = 1000;
+    checkpoint.downloaded.resize(1000);
+    checkpoint.downloaded.set(0);
+    checkpoint.downloaded.set(999);
+    checkpoint.priorities.push_back(BuyingCheckpoint::PriorityRange(10, 20, MaxPiecePriority));
+    checkpoint.terms = protocol_wire::BuyerTerms(24, 200, 1, 400);
+    checkpoint.speedTests["peer"] = std::chrono::milliseconds(1500);
+
+    std::string file = temporaryFile();
+
+    checkpoint.save(file);
+
+    BuyingCheckpoint loaded = BuyingCheckpoint::load(file);
+
+    EXPECT_EQ(loaded.numberOfPieces, 1000u);
+    EXPECT_EQ(loaded.downloaded, checkpoint.downloaded);
+    ASSERT_EQ(loaded.priorities.size(), 1u);
+    EXPECT_EQ(loaded.priorities[0].begin, 10u);
+    EXPECT_EQ(loaded.priorities[0].end, 20u);
+    EXPECT_EQ(loaded.priorities[0].priority, MaxPiecePriority);
+    EXPECT_EQ(loaded.terms.maxContractFeePerKb(), 400u);
+    EXPECT_EQ(loaded.speedTests["peer"].count(), 1500);
+
+    // Priority out of range is rejected
+    checkpoint.priorities.push_back(BuyingCheckpoint::PriorityRange(0, 1, MaxPiecePriority + 1));
+    checkpoint.save(file);
+
+    EXPECT_THROW(BuyingCheckpoint::load(file), exception::InvalidCheckpoint);
+
+    // Truncated file is rejected
+    {
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        out.write("JSBC", 4);
+    }
+
+    EXPECT_THROW(BuyingCheckpoint::load(file), exception::InvalidCheckpoint);
+
+    // As is one claiming more pieces than it holds
+    {
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        uint32_t version = 1, numberOfPieces = UINT32_MAX;
+        char terms[8 + 2 + 4 + 8] = {0};
+
+        out.write("JSBC", 4);
+        out.write((const char *)&version, sizeof(version));
+        out.write((const char *)&numberOfPieces, sizeof(numberOfPieces));
+        out.write(terms, sizeof(terms));
+    }
+
+    EXPECT_THROW(BuyingCheckpoint::load(file), exception::InvalidCheckpoint);
+
+    std::remove(file.c_str());
+}
+
 int main(int argc, char *argv[])
 {
     ::testing::InitGoogleTest(&argc, argv);